@@ -0,0 +1,52 @@
+#!/bin/sh
+# Build the benchmark trees, one directory for each case, under the given directory (about 3 GB in all).
+# Usage: bench/gen.sh [dir] [tree ...]; the default is every tree, under ./bench-trees
+set -e
+DIR=${1:-bench-trees}
+[ $# -gt 0 ] && shift
+TREES=${*:-small unique tails links deep}
+mkdir -p "$DIR"
+cd "$DIR"
+
+for t in $TREES; do
+  rm -rf "$t"
+  mkdir "$t"
+  case $t in
+  small) # Many small files, a third of them copies
+    for d in $(seq 100); do
+      mkdir small/$d
+      for f in $(seq 1000); do head -c $((f % 300 + 1)) /dev/urandom > small/$d/$f; done
+    done
+    for d in $(seq 33); do cp -a small/$d small/copy$d; done
+    ;;
+  unique) # Many unique files of the same size
+    for f in $(seq 20000); do head -c 8192 /dev/urandom > unique/$f; done
+    ;;
+  tails) # Large near-duplicates that differ only in their last page
+    head -c 256M /dev/urandom > tails/0
+    for f in $(seq 8); do
+      cp tails/0 tails/$f
+      printf %04d $f | dd of=tails/$f bs=1 seek=$((256*1048576 - 4)) conv=notrunc status=none
+    done
+    ;;
+  links) # Heavy hard-link fan-in: a few files with many links, plus a copy of each
+    for f in $(seq 10); do
+      head -c 1M /dev/urandom > links/$f
+      cp links/$f links/copy$f
+      for l in $(seq 500); do ln links/$f links/$f.$l; done
+    done
+    ;;
+  deep) # Deep directories
+    p=deep
+    for d in $(seq 200); do p=$p/d; done
+    mkdir -p $p
+    for f in $(seq 100); do head -c 100000 /dev/urandom > $p/$f; cp $p/$f deep/$f; done
+    ;;
+  *)
+    rmdir "$t"
+    echo "$0: unknown tree $t (small, unique, tails, links or deep)" >&2
+    exit 1
+    ;;
+  esac
+  echo "$t: $(find "$t" -type f | wc -l) files"
+done
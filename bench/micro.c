@@ -0,0 +1,313 @@
+/* Microbenchmarks for the parts of dupmerge that can be run on their own: grouping a file table (dupgroup_sort),
+ * the reclaim-first order (dupgroup_schedule), relink planning (dupengine_compare with a keyed comparer and a sink
+ * that only counts), first-page hashes of files in the page cache, first-page and full hashes of data already in
+ * memory (BLAKE3), and content-defined chunking (FastCDC).
+ *
+ * Each is run over the same input until it has taken at least half a second, and the time per operation is
+ * printed, after Google Benchmark's output, so two builds can be compared line by line:
+ * gcc -O3 -pthread -I. -o micro bench/micro.c libdupengine.a blake3.c fastcdc.c && ./micro [filter]
+ *
+ * May be used under the terms of the GNU General Public License v 2.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "dupengine.h"
+#include "blake3.h"
+#include "fastcdc.h"
+
+#define MIN_SECONDS 0.5
+
+static double now_seconds(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t Rand_state = 0x853c49e6748fea9bULL;
+
+static uint64_t rand64(void){
+  uint64_t z = (Rand_state += 0x9e3779b97f4a7c15ULL); /* splitmix64 */
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* A file table like a walk would give: sizes spread over a few orders of magnitude, with about a third of the
+ * files sharing their size with another, on two devices
+ */
+static void make_table(struct entry *t,int n){
+  int i;
+
+  for(i=0;i<n;i++){
+    t[i].size = i % 3 == 0 ? (off_t)(rand64() % (n / 3 + 1)) * 512 + 1 : (off_t)(rand64() % (1ULL << 36)) + 1;
+    t[i].ino = i + 1;
+    t[i].mtime = rand64() % 1000000000000000000LL;
+    t[i].nlink = 1 + (rand64() % 16 == 0);
+    t[i].id = i;
+    t[i].dev = rand64() % 2;
+    t[i].gone = 0;
+  }
+}
+
+/* Run op(arg) until MIN_SECONDS have gone by, with setup(arg) untimed before each run; report per item */
+static void run(const char *name,const char *filter,void (*setup)(void *),void (*op)(void *),void *arg,
+		double items,const char *unit){
+  double per,spent = 0,t;
+  long iterations = 0;
+
+  if(filter != NULL && strstr(name,filter) == NULL)
+    return;
+  while(spent < MIN_SECONDS){
+    if(setup != NULL)
+      setup(arg);
+    t = now_seconds();
+    op(arg);
+    spent += now_seconds() - t;
+    iterations++;
+  }
+  per = spent / iterations;
+  printf("%-28s %12.0f ns %10ld iterations %12.1f ns/%s\n",name,per * 1e9,iterations,per * 1e9 / items,unit);
+}
+
+struct groupbench {
+  struct entry *master,*table;
+  int n,grouped;
+  dupgroup g;
+};
+
+static void group_setup(void *arg){
+  struct groupbench *b = (struct groupbench *)arg;
+
+  memcpy(b->table,b->master,(size_t)b->n * sizeof(*b->table));
+  dupgroup_init(&b->g);
+}
+
+static void group_sort(void *arg){
+  struct groupbench *b = (struct groupbench *)arg;
+
+  b->grouped = dupgroup_sort(&b->g,b->table,b->n);
+}
+
+static void schedule_setup(void *arg){
+  group_setup(arg);
+  group_sort(arg);
+}
+
+static void group_schedule(void *arg){
+  struct groupbench *b = (struct groupbench *)arg;
+
+  dupgroup_schedule(&b->g,b->table,b->grouped);
+}
+
+/* Relink planning: which files in each group would be linked to which. Files share contents, and so a key, with
+ * about half of the others of their size; the sink just counts what it would link
+ */
+struct planbench {
+  struct groupbench gb;
+  dupengine e;
+  dupkeyed keyed;
+  long long planned;
+};
+
+static int plan_key(void *arg,const struct entry *ep,unsigned char *key){
+  unsigned long long k = ep->id % 4 < 2 ? 0 : ep->id + 1;
+
+  memcpy(key,&k,sizeof(k));
+  return 0;
+}
+
+static void plan_merge(void *arg,struct entry *ref,struct entry *dup){
+  ((struct planbench *)arg)->planned++;
+}
+
+static void plan_setup(void *arg){
+  struct planbench *b = (struct planbench *)arg;
+
+  memcpy(b->gb.table,b->gb.master,(size_t)b->gb.n * sizeof(*b->gb.table));
+  dupengine_init(&b->e);
+  b->e.comparer.compare = dupkeyed_compare;
+  b->e.comparer.arg = &b->keyed;
+  b->e.action.merge = plan_merge;
+  b->e.action.arg = b;
+  b->gb.grouped = dupengine_group(&b->e,b->gb.table,b->gb.n);
+}
+
+static void plan_links(void *arg){
+  struct planbench *b = (struct planbench *)arg;
+
+  dupengine_compare(&b->e,b->gb.table,b->gb.grouped);
+}
+
+/* First-page hashes of files, as dupmerge takes them: open, read a page, hash, close. The files were just written,
+ * so this is the cost of the system calls and the hash, not of the disk
+ */
+struct filebench {
+  char dir[64];
+  int n;
+  size_t len;
+};
+
+static void file_path(const struct filebench *b,int i,char *path,size_t size){
+  snprintf(path,size,"%s/f%d",b->dir,i);
+}
+
+static void hash_files(void *arg){
+  struct filebench *b = (struct filebench *)arg;
+  unsigned char page[4096];
+  uint8_t md[BLAKE3_OUT_LEN];
+  blake3_hasher h;
+  char path[128];
+  ssize_t len;
+  int fd,i;
+
+  for(i=0;i<b->n;i++){
+    file_path(b,i,path,sizeof(path));
+    if((fd = open(path,O_RDONLY)) == -1){
+      perror(path);
+      exit(1);
+    }
+    len = pread(fd,page,sizeof(page),0);
+    close(fd);
+    blake3_hasher_init(&h);
+    blake3_hasher_update(&h,page,len > 0 ? (size_t)len : 0);
+    blake3_hasher_finalize(&h,md);
+  }
+}
+
+struct hashbench {
+  const unsigned char *data;
+  size_t len,n;			/* n buffers of len bytes each */
+};
+
+static void hash_each(void *arg){
+  struct hashbench *b = (struct hashbench *)arg;
+  blake3_hasher h;
+  uint8_t md[BLAKE3_OUT_LEN];
+  size_t i;
+
+  for(i=0;i<b->n;i++){
+    blake3_hasher_init(&h);
+    blake3_hasher_update(&h,b->data + i * b->len,b->len);
+    blake3_hasher_finalize(&h,md);
+  }
+}
+
+struct chunkbench {
+  fastcdc c;
+  const unsigned char *data;
+  size_t len;
+  uint32_t lens[4096];
+};
+
+static void chunk_all(void *arg){
+  struct chunkbench *b = (struct chunkbench *)arg;
+  size_t off,n,i;
+
+  for(off = 0; off < b->len; ){
+    n = fastcdc_split(&b->c,b->data + off,b->len - off,1,b->lens,sizeof(b->lens) / sizeof(b->lens[0]));
+    for(i=0;i<n;i++)
+      off += b->lens[i];
+  }
+}
+
+int main(int argc,char *argv[]){
+  const char *filter = argc > 1 ? argv[1] : NULL;
+  static const int sizes[] = { 10000, 1000000 };
+  struct groupbench gb;
+  struct planbench pb;
+  struct filebench fb;
+  struct hashbench hb;
+  struct chunkbench cb;
+  unsigned char *data;
+  size_t datalen = 64 << 20,i;
+  char name[64];
+  int s;
+
+  printf("hash: blake3 (%s); chunking: %s\n",blake3_implementation(),fastcdc_implementation());
+  for(s=0;s<(int)(sizeof(sizes) / sizeof(sizes[0]));s++){
+    gb.n = sizes[s];
+    gb.master = (struct entry *)malloc((size_t)gb.n * sizeof(*gb.master));
+    gb.table = (struct entry *)malloc((size_t)gb.n * sizeof(*gb.table));
+    if(gb.master == NULL || gb.table == NULL){
+      perror("malloc");
+      exit(1);
+    }
+    make_table(gb.master,gb.n);
+    snprintf(name,sizeof(name),"group_sort/%d",gb.n);
+    run(name,filter,group_setup,group_sort,&gb,gb.n,"file");
+    snprintf(name,sizeof(name),"group_schedule/%d",gb.n);
+    run(name,filter,schedule_setup,group_schedule,&gb,gb.n,"file");
+    pb.gb = gb;
+    memset(&pb.keyed,0,sizeof(pb.keyed));
+    pb.keyed.key = plan_key;
+    pb.keyed.keylen = sizeof(unsigned long long);
+    pb.planned = 0;
+    snprintf(name,sizeof(name),"relink_plan/%d",gb.n);
+    run(name,filter,plan_setup,plan_links,&pb,gb.n,"file");
+    free(gb.master);
+    free(gb.table);
+  }
+
+  data = (unsigned char *)malloc(datalen);
+  if(data == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  for(i=0;i + 8 <= datalen;i += 8){
+    uint64_t r = rand64();
+
+    memcpy(data + i,&r,8);
+  }
+  fb.n = 1000;
+  fb.len = 64 * 1024;
+  snprintf(fb.dir,sizeof(fb.dir),"/tmp/micro.XXXXXX");
+  if(filter == NULL || strstr("hash_file_first_page",filter) != NULL){
+    if(mkdtemp(fb.dir) == NULL){
+      perror(fb.dir);
+      exit(1);
+    }
+    for(s=0;s<fb.n;s++){
+      char path[128];
+      int fd;
+
+      file_path(&fb,s,path,sizeof(path));
+      if((fd = open(path,O_WRONLY|O_CREAT|O_EXCL,0600)) == -1
+	 || write(fd,data + (size_t)s * fb.len % (datalen - fb.len),fb.len) != (ssize_t)fb.len){
+	perror(path);
+	exit(1);
+      }
+      close(fd);
+    }
+    snprintf(name,sizeof(name),"hash_file_first_page/%d",fb.n);
+    run(name,filter,NULL,hash_files,&fb,fb.n,"file");
+    for(s=0;s<fb.n;s++){
+      char path[128];
+
+      file_path(&fb,s,path,sizeof(path));
+      unlink(path);
+    }
+    rmdir(fb.dir);
+  }
+  hb.data = data;
+  hb.len = 4096;		/* First page hashes, one file after another */
+  hb.n = datalen / hb.len;
+  run("hash_first_page/4096",filter,NULL,hash_each,&hb,hb.n,"page");
+  hb.len = 16 << 20;		/* Full hashes of files in memory */
+  hb.n = datalen / hb.len;
+  run("hash_full/16M",filter,NULL,hash_each,&hb,(double)datalen / (1 << 20),"MB");
+
+  fastcdc_init(&cb.c,64 * 1024);
+  cb.data = data;
+  cb.len = datalen;
+  run("chunk/64K",filter,NULL,chunk_all,&cb,(double)datalen / (1 << 20),"MB");
+  fastcdc_free(&cb.c);
+  free(data);
+  return 0;
+}
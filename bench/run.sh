@@ -0,0 +1,27 @@
+#!/bin/sh
+# Run dupmerge in dry-run mode with -R over each benchmark tree made by gen.sh and keep the JSON reports.
+# Usage: bench/run.sh [-c] dupmerge-binary [dir] [reportdir] [-- dupmerge options]
+#   -c        drop the page cache before each tree (as root), to measure the disks rather than the CPU
+#   dir       where gen.sh put the trees (default ./bench-trees)
+#   reportdir where the reports go, as <tree>.json (default ./bench-reports/<date-time>)
+set -e
+COLD=no
+if [ "$1" = "-c" ]; then COLD=yes; shift; fi
+[ $# -ge 1 ] || { echo "usage: $0 [-c] dupmerge-binary [dir] [reportdir] [-- options]" >&2; exit 1; }
+BIN=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+DIR=bench-trees
+REPORTS=bench-reports/$(date +%Y%m%d-%H%M%S)
+[ $# -gt 0 ] && [ "$1" != "--" ] && { DIR=$1; shift; }
+[ $# -gt 0 ] && [ "$1" != "--" ] && { REPORTS=$1; shift; }
+[ "$1" = "--" ] && shift
+mkdir -p "$REPORTS"
+REPORTS=$(cd "$REPORTS" && pwd)
+
+for t in small unique tails links deep; do
+  [ -d "$DIR/$t" ] || continue
+  [ $COLD = yes ] && sync && echo 3 > /proc/sys/vm/drop_caches
+  (cd "$DIR" && "$BIN" -q -n -R "$REPORTS/$t.json" "$@" "$t" 2>/dev/null)
+  printf '%-8s %s\n' "$t" "$(grep -m1 '"elapsed_seconds"' "$REPORTS/$t.json" | tr -d ' ,')"
+done
+echo "reports in $REPORTS"
@@ -0,0 +1,448 @@
+/* BLAKE3 hash function, as used by dupmerge
+ *
+ * Follows the BLAKE3 specification and reference implementation (hash mode only).
+ * The input is split into 1 KB chunks, each hashed to a chaining value, and the chaining values are
+ * combined pairwise in a binary tree. All but the last chunk are independent of each other, so
+ * blake3_hasher_update() compresses as many as it can at once, one per vector lane: 16 with AVX-512,
+ * 8 with AVX2, otherwise 4 (SSE4.1 or SSE2 on x86, NEON on ARM64). The kernel is chosen once at run time.
+ *
+ * May be used under the terms of the GNU General Public License v 2.0
+ */
+#include <assert.h>
+#include <string.h>
+#include "blake3.h"
+
+#define BLOCK_LEN 64
+#define CHUNK_LEN BLAKE3_CHUNK_LEN
+#define MAX_LANES 16
+
+enum {
+  CHUNK_START = 1,
+  CHUNK_END = 2,
+  PARENT = 4,
+  ROOT = 8,
+};
+
+static const uint32_t IV[8] = {
+  0x6A09E667,0xBB67AE85,0x3C6EF372,0xA54FF53A,0x510E527F,0x9B05688C,0x1F83D9AB,0x5BE0CD19
+};
+
+/* All seven rounds, with the message word order for each (the permutation applied repeatedly).
+ * Written out so the compiler sees constant indices and can keep everything in registers
+ */
+#define ROUNDS					\
+  ROUND(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15); \
+  ROUND(2,6,3,10,7,0,4,13,1,11,12,5,9,14,15,8); \
+  ROUND(3,4,10,12,13,2,7,14,6,5,9,0,11,15,8,1); \
+  ROUND(10,7,12,9,14,3,13,15,4,0,11,2,5,8,1,6); \
+  ROUND(12,13,9,11,15,10,14,8,7,2,5,3,0,1,6,4); \
+  ROUND(9,14,11,5,8,12,15,1,13,3,0,10,2,6,4,7); \
+  ROUND(11,15,5,0,1,9,8,6,14,10,2,12,3,4,7,13);
+
+static inline uint32_t load32(const uint8_t *p){
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store32(uint8_t *p,uint32_t w){
+  p[0] = w;
+  p[1] = w >> 8;
+  p[2] = w >> 16;
+  p[3] = w >> 24;
+}
+
+static inline uint32_t rotr32(uint32_t w,int c){
+  return (w >> c) | (w << (32 - c));
+}
+
+#define G(a,b,c,d,x,y)				\
+  v[a] = v[a] + v[b] + m[x];			\
+  v[d] = rotr32(v[d] ^ v[a],16);		\
+  v[c] = v[c] + v[d];				\
+  v[b] = rotr32(v[b] ^ v[c],12);		\
+  v[a] = v[a] + v[b] + m[y];			\
+  v[d] = rotr32(v[d] ^ v[a],8);			\
+  v[c] = v[c] + v[d];				\
+  v[b] = rotr32(v[b] ^ v[c],7);
+
+#define ROUND(s0,s1,s2,s3,s4,s5,s6,s7,s8,s9,s10,s11,s12,s13,s14,s15) \
+  G(0,4,8,12,s0,s1);				\
+  G(1,5,9,13,s2,s3);				\
+  G(2,6,10,14,s4,s5);				\
+  G(3,7,11,15,s6,s7);				\
+  G(0,5,10,15,s8,s9);				\
+  G(1,6,11,12,s10,s11);				\
+  G(2,7,8,13,s12,s13);				\
+  G(3,4,9,14,s14,s15);
+
+/* The compression function, one block at a time; the first 8 words of out are the new chaining value */
+static void compress(const uint32_t cv[8],const uint8_t block[BLOCK_LEN],uint8_t block_len,
+		     uint64_t counter,uint8_t flags,uint32_t out[16]){
+  uint32_t v[16],m[16];
+  int i;
+
+  for(i=0;i<16;i++)
+    m[i] = load32(block + 4 * i);
+  for(i=0;i<8;i++)
+    v[i] = cv[i];
+  v[8] = IV[0];
+  v[9] = IV[1];
+  v[10] = IV[2];
+  v[11] = IV[3];
+  v[12] = (uint32_t)counter;
+  v[13] = (uint32_t)(counter >> 32);
+  v[14] = block_len;
+  v[15] = flags;
+  ROUNDS;
+  for(i=0;i<8;i++){
+    out[i] = v[i] ^ v[i+8];
+    out[i+8] = v[i+8] ^ cv[i];
+  }
+}
+
+/* Compress blocks consecutive blocks of input into a chaining value, as for a chunk or a parent node */
+static void hash_one(const uint8_t *input,int blocks,const uint32_t key[8],uint64_t counter,
+		     uint8_t flags,uint8_t flags_start,uint8_t flags_end,uint8_t *out){
+  uint32_t cv[8],state[16];
+  int block,i;
+
+  memcpy(cv,key,sizeof(cv));
+  for(block=0;block<blocks;block++){
+    compress(cv,input + block * BLOCK_LEN,BLOCK_LEN,counter,
+	     flags | (block == 0 ? flags_start : 0) | (block == blocks - 1 ? flags_end : 0),state);
+    memcpy(cv,state,sizeof(cv));
+  }
+  for(i=0;i<8;i++)
+    store32(out + 4 * i,cv[i]);
+}
+
+/* The same for several inputs at a time */
+#define LANES 4
+#define LANES_NAME hash_many_4
+#define LANES_BYTE_ROTATE 0
+#define LANES_TARGET
+#include "blake3_lanes.h"
+#undef LANES
+#undef LANES_NAME
+#undef LANES_TARGET
+#undef LANES_BYTE_ROTATE
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_WIDE_LANES 1
+
+#define LANES 4
+#define LANES_NAME hash_many_4_sse41
+#define LANES_BYTE_ROTATE 1
+#define LANES_TARGET __attribute__((target("sse4.1")))
+#include "blake3_lanes.h"
+#undef LANES
+#undef LANES_NAME
+#undef LANES_TARGET
+#undef LANES_BYTE_ROTATE
+
+#define LANES 8
+#define LANES_NAME hash_many_8
+#define LANES_BYTE_ROTATE 1
+#define LANES_TARGET __attribute__((target("avx2")))
+#include "blake3_lanes.h"
+#undef LANES
+#undef LANES_NAME
+#undef LANES_TARGET
+#undef LANES_BYTE_ROTATE
+
+#define LANES 16
+#define LANES_NAME hash_many_16
+#define LANES_BYTE_ROTATE 0
+#define LANES_TARGET __attribute__((target("avx512f")))
+#include "blake3_lanes.h"
+#undef LANES
+#undef LANES_NAME
+#undef LANES_TARGET
+#undef LANES_BYTE_ROTATE
+#endif
+
+/* Kernels this CPU can run */
+enum kernel { UNCHECKED,GENERIC,SSE41,AVX2,AVX512 };
+static enum kernel Kernel;
+
+static enum kernel kernel(void){
+  if(Kernel == UNCHECKED){
+    enum kernel k = GENERIC;
+#ifdef HAVE_WIDE_LANES
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f"))
+      k = AVX512;
+    else if(__builtin_cpu_supports("avx2"))
+      k = AVX2;
+    else if(__builtin_cpu_supports("sse4.1"))
+      k = SSE41;
+#endif
+    __atomic_store_n(&Kernel,k,__ATOMIC_RELAXED); /* Harmless race: every thread finds the same answer */
+  }
+  return Kernel;
+}
+
+const char *blake3_implementation(void){
+  switch(kernel()){
+  case AVX512:
+    return "avx512";
+  case AVX2:
+    return "avx2";
+  case SSE41:
+    return "sse4.1";
+  default:
+#if defined(__aarch64__) || defined(__ARM_NEON)
+    return "neon";
+#elif defined(__x86_64__) || defined(__SSE2__)
+    return "sse2";
+#else
+    return "generic";
+#endif
+  }
+}
+
+/* Chaining values of n inputs stride bytes apart, each of the given number of blocks: either whole chunks
+ * (none of them the root) numbered from counter, or parent nodes
+ */
+static void hash_many(const uint8_t *input,size_t n,size_t stride,int blocks,const uint32_t key[8],
+		      uint64_t counter,int increment,uint8_t flags,uint8_t flags_start,uint8_t flags_end,
+		      uint8_t *out){
+  enum kernel k = kernel();
+  int lanes;
+
+  while(n > 0){
+#ifdef HAVE_WIDE_LANES
+    if(k >= AVX512 && n >= 16){
+      hash_many_16(input,stride,blocks,key,counter,increment,flags,flags_start,flags_end,out);
+      lanes = 16;
+    } else if(k >= AVX2 && n >= 8){
+      hash_many_8(input,stride,blocks,key,counter,increment,flags,flags_start,flags_end,out);
+      lanes = 8;
+    } else if(k >= SSE41 && n >= 4){
+      hash_many_4_sse41(input,stride,blocks,key,counter,increment,flags,flags_start,flags_end,out);
+      lanes = 4;
+    } else
+#endif
+    if(n >= 4){
+      hash_many_4(input,stride,blocks,key,counter,increment,flags,flags_start,flags_end,out);
+      lanes = 4;
+    } else {
+      hash_one(input,blocks,key,counter,flags,flags_start,flags_end,out);
+      lanes = 1;
+    }
+    input += lanes * stride;
+    out += lanes * BLAKE3_OUT_LEN;
+    counter += lanes * increment;
+    n -= lanes;
+  }
+}
+
+/* A node whose compression is deferred until we know whether it's the root */
+struct output {
+  uint32_t cv[8];
+  uint8_t block[BLOCK_LEN];
+  uint8_t block_len;
+  uint64_t counter;
+  uint8_t flags;
+};
+
+static void output_chaining_value(const struct output *o,uint32_t cv[8]){
+  uint32_t state[16];
+
+  compress(o->cv,o->block,o->block_len,o->counter,o->flags,state);
+  memcpy(cv,state,8 * sizeof(uint32_t));
+}
+
+static void parent_output(const uint32_t key[8],const uint32_t left[8],const uint32_t right[8],struct output *o){
+  int i;
+
+  memcpy(o->cv,key,sizeof(o->cv));
+  for(i=0;i<8;i++){
+    store32(o->block + 4 * i,left[i]);
+    store32(o->block + 32 + 4 * i,right[i]);
+  }
+  o->block_len = BLOCK_LEN;
+  o->counter = 0;
+  o->flags = PARENT;
+}
+
+static void chunk_init(blake3_chunk_state *c,const uint32_t key[8],uint64_t counter){
+  memcpy(c->cv,key,sizeof(c->cv));
+  c->chunk_counter = counter;
+  memset(c->buf,0,sizeof(c->buf));
+  c->buf_len = 0;
+  c->blocks_compressed = 0;
+}
+
+static size_t chunk_len(const blake3_chunk_state *c){
+  return (size_t)c->blocks_compressed * BLOCK_LEN + c->buf_len;
+}
+
+static uint8_t chunk_start_flag(const blake3_chunk_state *c){
+  return c->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void chunk_update(blake3_chunk_state *c,const uint8_t *input,size_t len){
+  while(len > 0){
+    size_t take;
+
+    /* Compress a full block only once we know it isn't the chunk's last */
+    if(c->buf_len == BLOCK_LEN){
+      uint32_t state[16];
+
+      compress(c->cv,c->buf,BLOCK_LEN,c->chunk_counter,chunk_start_flag(c),state);
+      memcpy(c->cv,state,sizeof(c->cv));
+      c->blocks_compressed++;
+      c->buf_len = 0;
+      memset(c->buf,0,sizeof(c->buf));
+    }
+    take = BLOCK_LEN - c->buf_len;
+    if(take > len)
+      take = len;
+    memcpy(c->buf + c->buf_len,input,take);
+    c->buf_len += take;
+    input += take;
+    len -= take;
+  }
+}
+
+static void chunk_output(const blake3_chunk_state *c,struct output *o){
+  memcpy(o->cv,c->cv,sizeof(o->cv));
+  memcpy(o->block,c->buf,BLOCK_LEN);
+  o->block_len = c->buf_len;
+  o->counter = c->chunk_counter;
+  o->flags = chunk_start_flag(c) | CHUNK_END;
+}
+
+/* Add the chaining value of a complete subtree, merging every larger subtree it completes.
+ * total is the number of subtrees of its size so far, counting this one
+ */
+static void push_cv(blake3_hasher *self,const uint8_t cvbytes[BLAKE3_OUT_LEN],uint64_t total){
+  uint32_t cv[8];
+  struct output o;
+  int i;
+
+  for(i=0;i<8;i++)
+    cv[i] = load32(cvbytes + 4 * i);
+  while((total & 1) == 0){
+    parent_output(self->key,self->cv_stack[--self->cv_stack_len],cv,&o);
+    output_chaining_value(&o,cv);
+    total >>= 1;
+  }
+  memcpy(self->cv_stack[self->cv_stack_len++],cv,sizeof(cv));
+}
+
+void blake3_hasher_init(blake3_hasher *self){
+  memcpy(self->key,IV,sizeof(self->key));
+  chunk_init(&self->chunk,self->key,0);
+  self->cv_stack_len = 0;
+}
+
+void blake3_hasher_update(blake3_hasher *self,const void *input,size_t len){
+  const uint8_t *in = (const uint8_t *)input;
+  uint8_t cvs[MAX_LANES * BLAKE3_OUT_LEN];
+
+  /* Fill out a partial chunk; finish it only if more input follows */
+  if(chunk_len(&self->chunk) > 0){
+    size_t take = CHUNK_LEN - chunk_len(&self->chunk);
+    struct output o;
+    uint32_t cv[8];
+    int i;
+
+    if(take > len)
+      take = len;
+    chunk_update(&self->chunk,in,take);
+    in += take;
+    len -= take;
+    if(len == 0)
+      return;
+    chunk_output(&self->chunk,&o);
+    output_chaining_value(&o,cv);
+    for(i=0;i<8;i++)
+      store32(cvs + 4 * i,cv[i]);
+    push_cv(self,cvs,self->chunk.chunk_counter + 1);
+    chunk_init(&self->chunk,self->key,self->chunk.chunk_counter + 1);
+  }
+  /* Whole chunks with more input after them, several at a time.
+   * The last chunk is held back since it may turn out to be the root
+   */
+  while(len > CHUNK_LEN){
+    uint64_t counter = self->chunk.chunk_counter;
+    size_t n = (len - 1) / CHUNK_LEN;
+    size_t i;
+
+    if(n > MAX_LANES)
+      n = MAX_LANES;
+    hash_many(in,n,CHUNK_LEN,CHUNK_LEN/BLOCK_LEN,self->key,counter,1,0,CHUNK_START,CHUNK_END,cvs);
+    if(n == MAX_LANES && counter % MAX_LANES == 0){
+      /* A whole aligned subtree: reduce it to one chaining value a level at a time, also in parallel */
+      for(i=MAX_LANES/2;i>0;i/=2)
+	hash_many(cvs,i,2 * BLAKE3_OUT_LEN,1,self->key,0,0,PARENT,0,0,cvs);
+      push_cv(self,cvs,counter / MAX_LANES + 1);
+    } else {
+      for(i=0;i<n;i++)
+	push_cv(self,cvs + i * BLAKE3_OUT_LEN,counter + i + 1);
+    }
+    chunk_init(&self->chunk,self->key,counter + n);
+    in += n * CHUNK_LEN;
+    len -= n * CHUNK_LEN;
+  }
+  chunk_update(&self->chunk,in,len);
+}
+
+void blake3_hasher_finalize(const blake3_hasher *self,uint8_t out[BLAKE3_OUT_LEN]){
+  struct output o;
+  uint32_t cv[8],state[16];
+  int i;
+
+  chunk_output(&self->chunk,&o);
+  for(i=self->cv_stack_len;i > 0;i--){
+    output_chaining_value(&o,cv);
+    parent_output(self->key,self->cv_stack[i-1],cv,&o);
+  }
+  compress(o.cv,o.block,o.block_len,0,o.flags | ROOT,state);
+  for(i=0;i<8;i++)
+    store32(out + 4 * i,state[i]);
+}
+
+void blake3_subtree(const void *input,size_t len,uint64_t counter,uint8_t cv[BLAKE3_OUT_LEN]){
+  blake3_hasher h;
+  struct output o;
+  uint32_t w[8];
+  int i;
+
+  assert(len >= CHUNK_LEN && (len & (len - 1)) == 0 && counter % (len / CHUNK_LEN) == 0);
+  blake3_hasher_init(&h);
+  h.chunk.chunk_counter = counter;
+  blake3_hasher_update(&h,input,len);
+  /* As in finalizing, but the top node is an inner one, not the root */
+  chunk_output(&h.chunk,&o);
+  for(i=h.cv_stack_len;i > 0;i--){
+    output_chaining_value(&o,w);
+    parent_output(h.key,h.cv_stack[i-1],w,&o);
+  }
+  output_chaining_value(&o,w);
+  for(i=0;i<8;i++)
+    store32(cv + 4 * i,w[i]);
+}
+
+void blake3_hasher_push_subtree(blake3_hasher *self,const uint8_t cv[BLAKE3_OUT_LEN],size_t len){
+  uint64_t n = len / CHUNK_LEN;
+
+  /* A whole chunk held back by blake3_hasher_update() isn't the last after all */
+  if(chunk_len(&self->chunk) == CHUNK_LEN){
+    struct output o;
+    uint32_t w[8];
+    uint8_t bytes[BLAKE3_OUT_LEN];
+    int i;
+
+    chunk_output(&self->chunk,&o);
+    output_chaining_value(&o,w);
+    for(i=0;i<8;i++)
+      store32(bytes + 4 * i,w[i]);
+    push_cv(self,bytes,self->chunk.chunk_counter + 1);
+    chunk_init(&self->chunk,self->key,self->chunk.chunk_counter + 1);
+  }
+  assert(chunk_len(&self->chunk) == 0 && (n & (n - 1)) == 0 && self->chunk.chunk_counter % n == 0);
+  push_cv(self,cv,self->chunk.chunk_counter / n + 1);
+  chunk_init(&self->chunk,self->key,self->chunk.chunk_counter + n);
+}
@@ -0,0 +1,51 @@
+/* BLAKE3 hash function, as used by dupmerge
+ *
+ * Hash mode only (no keyed hashing, key derivation or extended output).
+ * Whole chunks are compressed several at a time with whatever vector unit the CPU has,
+ * picked at run time; see blake3.c
+ *
+ * May be used under the terms of the GNU General Public License v 2.0
+ */
+#ifndef _BLAKE3_H
+#define _BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54 /* Enough for 2^64 bytes of input */
+
+typedef struct {
+  uint32_t cv[8];		/* Chaining value */
+  uint64_t chunk_counter;
+  uint8_t buf[64];		/* Current block */
+  uint8_t buf_len;
+  uint8_t blocks_compressed;
+} blake3_chunk_state;
+
+typedef struct {
+  uint32_t key[8];
+  blake3_chunk_state chunk;
+  uint8_t cv_stack_len;
+  uint32_t cv_stack[BLAKE3_MAX_DEPTH][8]; /* Roots of the completed subtrees */
+} blake3_hasher;
+
+void blake3_hasher_init(blake3_hasher *self);
+void blake3_hasher_update(blake3_hasher *self,const void *input,size_t len);
+void blake3_hasher_finalize(const blake3_hasher *self,uint8_t out[BLAKE3_OUT_LEN]);
+
+/* Pieces of one input hashed apart, e.g., on several threads. A subtree is len bytes of whole chunks, a power of 2
+ * of them, starting at chunk number counter, which must be a multiple of that power of 2.
+ * blake3_subtree() gives its chaining value; blake3_hasher_push_subtree() then adds it to a hasher whose input
+ * so far ends at chunk counter, as if the subtree's bytes had been passed to blake3_hasher_update().
+ * The input may not end with a pushed subtree: its last chunk, at least, must go through blake3_hasher_update(),
+ * as only that chunk's node can turn out to be the root
+ */
+void blake3_subtree(const void *input,size_t len,uint64_t counter,uint8_t cv[BLAKE3_OUT_LEN]);
+void blake3_hasher_push_subtree(blake3_hasher *self,const uint8_t cv[BLAKE3_OUT_LEN],size_t len);
+
+/* Name of the compression kernel chosen for this CPU */
+const char *blake3_implementation(void);
+
+#endif
@@ -0,0 +1,107 @@
+/* BLAKE3 compression of LANES inputs at once, one per vector lane.
+ * Included by blake3.c once for each vector width; the includer defines
+ *   LANES		number of 32-bit lanes, i.e., inputs per call
+ *   LANES_NAME		name of the function to define
+ *   LANES_TARGET	function attributes, e.g., __attribute__((target("avx2"))), or nothing
+ *   LANES_BYTE_ROTATE	1 if the target has a fast byte shuffle (pshufb) but no vector rotate
+ * GCC/clang vector extensions turn this into whatever instructions the target has.
+ */
+
+#if LANES == 4
+#define LANE_LIST(f,s) {f(s,0),f(s,1),f(s,2),f(s,3)}
+#elif LANES == 8
+#define LANE_LIST(f,s) {f(s,0),f(s,1),f(s,2),f(s,3),f(s,4),f(s,5),f(s,6),f(s,7)}
+#elif LANES == 16
+#define LANE_LIST(f,s) {f(s,0),f(s,1),f(s,2),f(s,3),f(s,4),f(s,5),f(s,6),f(s,7), \
+      f(s,8),f(s,9),f(s,10),f(s,11),f(s,12),f(s,13),f(s,14),f(s,15)}
+#endif
+/* Shuffle masks for one stage of a LANES x LANES transpose: rows r and r+s, for r & s == 0,
+ * swap their off-diagonal s x s blocks. Doing this for s = LANES/2 ... 1 transposes the whole matrix
+ */
+#define MASK_LO(s,j) (((j) & (s)) == 0 ? (j) : LANES + (j) - (s))
+#define MASK_HI(s,j) (((j) & (s)) == 0 ? (j) + (s) : LANES + (j))
+#define ROT16_BYTES(s,j) 4*(j)+2,4*(j)+3,4*(j),4*(j)+1
+#define ROT8_BYTES(s,j) 4*(j)+1,4*(j)+2,4*(j)+3,4*(j)
+
+LANES_TARGET static void LANES_NAME(const uint8_t *input,size_t stride,int blocks,const uint32_t key[8],
+				    uint64_t counter,int increment,uint8_t flags,uint8_t flags_start,
+				    uint8_t flags_end,uint8_t *out){
+  typedef uint32_t vec __attribute__((vector_size(4 * LANES)));
+  typedef int32_t mask __attribute__((vector_size(4 * LANES)));
+#if LANES_BYTE_ROTATE
+  typedef uint8_t bytes __attribute__((vector_size(4 * LANES)));
+  /* Rotations by whole bytes are byte shuffles within each word */
+  static const bytes rot16 = LANE_LIST(ROT16_BYTES,0);
+  static const bytes rot8 = LANE_LIST(ROT8_BYTES,0);
+#endif
+  vec h[8],v[16],m[16];
+  vec counter_lo,counter_hi;
+  int block,i,lane,r;
+
+  for(lane=0;lane<LANES;lane++){
+    counter_lo[lane] = (uint32_t)(counter + lane * increment);
+    counter_hi[lane] = (uint32_t)((counter + lane * increment) >> 32);
+  }
+  for(i=0;i<8;i++)
+    h[i] = (vec){0} + key[i];
+
+  for(block=0;block<blocks;block++){
+    const uint8_t *bp = input + block * BLOCK_LEN;
+
+    /* Transpose: word i of every lane's block into m[i], LANES words at a time */
+    for(i=0;i<16;i+=LANES){
+      vec *t = &m[i];
+
+      for(r=0;r<LANES;r++)
+	memcpy(&t[r],bp + r * stride + 4 * i,sizeof(vec)); /* Little-endian only */
+#define STAGE(s)							\
+      if(LANES > (s)){							\
+	static const mask lo = LANE_LIST(MASK_LO,s);			\
+	static const mask hi = LANE_LIST(MASK_HI,s);			\
+	for(r=0;r<LANES;r++){						\
+	  if((r & (s)) == 0){						\
+	    vec x = t[r],y = t[r+(s)];					\
+	    t[r] = __builtin_shuffle(x,y,lo);				\
+	    t[r+(s)] = __builtin_shuffle(x,y,hi);			\
+	  }								\
+	}								\
+      }
+      STAGE(8);
+      STAGE(4);
+      STAGE(2);
+      STAGE(1);
+#undef STAGE
+    }
+    for(i=0;i<8;i++){
+      v[i] = h[i];
+      v[i+8] = (vec){0} + (i < 4 ? IV[i] : 0);
+    }
+    v[12] = counter_lo;
+    v[13] = counter_hi;
+    v[14] = (vec){0} + BLOCK_LEN;
+    v[15] = (vec){0} + (flags | (block == 0 ? flags_start : 0) | (block == blocks - 1 ? flags_end : 0));
+
+    /* The rounds, in vector form */
+#if LANES_BYTE_ROTATE
+#define rotr32(x,n) ((n) == 16 ? (vec)__builtin_shuffle((bytes)(x),rot16) \
+		     : (n) == 8 ? (vec)__builtin_shuffle((bytes)(x),rot8) \
+		     : ((x) >> (n)) | ((x) << (32 - (n))))
+#else
+#define rotr32(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+#endif
+    ROUNDS;
+#undef rotr32
+    for(i=0;i<8;i++)
+      h[i] = v[i] ^ v[i+8];
+  }
+  for(lane=0;lane<LANES;lane++){
+    for(i=0;i<8;i++)
+      store32(out + lane * BLAKE3_OUT_LEN + 4 * i,h[i][lane]);
+  }
+}
+
+#undef LANE_LIST
+#undef MASK_LO
+#undef MASK_HI
+#undef ROT16_BYTES
+#undef ROT8_BYTES
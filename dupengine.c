@@ -0,0 +1,134 @@
+/* Engine of dupmerge: the loop over the groups of a file table, between a comparer that finds which files in a
+ * group have the same contents and an action sink that's told about each. See dupengine.h.
+ *
+ * Groups are the runs of entries with the same size and device that dupgroup_sort() leaves; the comparer is given
+ * each in turn and reports every duplicate with dupengine_same(), which drops further links to the file kept
+ * before the sink sees them, so no sink ever links a file to itself.
+ *
+ * May be used under the terms of the GNU General Public License v 2.0
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dupengine.h"
+
+void dupengine_init(dupengine *e){
+  memset(e,0,sizeof(*e));
+  dupgroup_init(&e->group);
+}
+
+int dupengine_group(dupengine *e,struct entry *entries,int nfiles){
+  nfiles = dupgroup_sort(&e->group,entries,nfiles);
+  if(e->reclaim_first)
+    dupgroup_schedule(&e->group,entries,nfiles);
+  return nfiles;
+}
+
+void dupengine_compare(dupengine *e,struct entry *entries,int nfiles){
+  int i,j;
+
+  if(e->comparer.begin != NULL)
+    e->comparer.begin(e->comparer.arg,entries,nfiles);
+  for(i=0;i<nfiles-1;i=j){
+    for(j=i+1; j<nfiles && entries[j].size == entries[i].size && entries[j].dev == entries[i].dev; j++)
+      ;
+    if(j - i < 2)
+      continue; /* Unique size, can't have a duplicate */
+    if(e->comparer.start != NULL && e->comparer.start(e->comparer.arg,entries,i,j,nfiles)){
+      e->stats.groups_skipped++;
+      continue;
+    }
+    e->comparer.compare(e->comparer.arg,e,&entries[i],j - i);
+    e->stats.groups++;
+    e->stats.files += j - i;
+    if(e->action.done != NULL)
+      e->action.done(e->action.arg,&entries[i],j - i);
+  }
+  if(e->action.finish != NULL)
+    e->action.finish(e->action.arg);
+}
+
+void dupengine_same(dupengine *e,struct entry *ref,struct entry *dup){
+  dup->gone = 1; /* Don't use it as a file to keep later */
+  if(ref->ino == dup->ino){
+    e->stats.links++; /* Existing hard link to the file kept */
+    return;
+  }
+  e->stats.merged++;
+  e->stats.bytes += dup->size;
+  e->action.merge(e->action.arg,ref,dup);
+}
+
+/* A member of a group and its key, for dupkeyed_compare() */
+struct keyedref {
+  const unsigned char *key;
+  size_t len;
+  struct entry *ep;
+};
+
+/* By inode, then by place in the group */
+static int compare_ino(const void *ap,const void *bp){
+  const struct keyedref *a = (const struct keyedref *)ap;
+  const struct keyedref *b = (const struct keyedref *)bp;
+
+  if(a->ep->ino != b->ep->ino)
+    return a->ep->ino < b->ep->ino ? -1 : 1;
+  if(a->ep != b->ep)
+    return a->ep < b->ep ? -1 : 1;
+  return 0;
+}
+
+/* By key, then by place in the group, so the first of each set of equal keys is the oldest */
+static int compare_key(const void *ap,const void *bp){
+  const struct keyedref *a = (const struct keyedref *)ap;
+  const struct keyedref *b = (const struct keyedref *)bp;
+  int c;
+
+  if((c = memcmp(a->key,b->key,a->len)) != 0)
+    return c;
+  if(a->ep != b->ep)
+    return a->ep < b->ep ? -1 : 1;
+  return 0;
+}
+
+void dupkeyed_compare(void *arg,dupengine *e,struct entry *group,int n){
+  dupkeyed *k = (dupkeyed *)arg;
+  struct keyedref *refs;
+  unsigned char *keys;
+  int dropped,i,m,run,set;
+
+  refs = (struct keyedref *)malloc((size_t)n * sizeof(*refs) + 1);
+  keys = (unsigned char *)malloc((size_t)n * k->keylen + 1);
+  assert(refs != NULL && keys != NULL);
+  for(m=i=0;i<n;i++){
+    if(!group[i].gone){
+      refs[m].key = keys + (size_t)m * k->keylen;
+      refs[m].len = k->keylen;
+      refs[m++].ep = &group[i];
+    }
+  }
+  /* One key per inode; a file that has none is dropped with its links */
+  qsort(refs,m,sizeof(*refs),compare_ino);
+  for(dropped=run=i=0;i<m;i++){
+    if(i > 0 && refs[i].ep->ino == refs[i-1].ep->ino){
+      if(dropped)
+	continue;
+      memcpy((unsigned char *)refs[i].key,refs[i-1].key,k->keylen);
+    } else {
+      k->keys++;
+      if((dropped = k->key(k->arg,refs[i].ep,(unsigned char *)refs[i].key) != 0)){
+	k->failed++;
+	continue;
+      }
+    }
+    refs[run++] = refs[i];
+  }
+  m = run;
+  qsort(refs,m,sizeof(*refs),compare_key);
+  for(set=0;set<m;set=run){
+    for(run=set+1; run<m && memcmp(refs[run].key,refs[set].key,k->keylen) == 0; run++)
+      dupengine_same(e,refs[set].ep,refs[run].ep);
+  }
+  free(keys);
+  free(refs);
+}
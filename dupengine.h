@@ -0,0 +1,98 @@
+/* Engine of dupmerge: group a file table (dupgroup.h), find the files in each group with the same contents with a
+ * pluggable comparer, and hand each duplicate to an action sink with the file that's kept.
+ *
+ * The comparer decides what "the same contents" means and how it's found out: dupmerge's reads and hashes files, a
+ * program with hashes of its own can use dupkeyed_compare(). The action sink decides what's done about it: dupmerge's
+ * links or dedupes, a planner might only count. All the state is in a dupengine, so several engines (one per volume,
+ * say) can run at once in one process, from C or C++. Nothing here reads a file
+ *
+ * May be used under the terms of the GNU General Public License v 2.0
+ */
+#ifndef _DUPENGINE_H
+#define _DUPENGINE_H
+
+#include <stddef.h>
+#include "dupgroup.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dupengine dupengine;
+
+typedef struct {
+  /* Called once per table before its groups; may be NULL */
+  void (*begin)(void *arg,struct entry *entries,int nfiles);
+  /* Called before entries[first..end-1], a group of the table; nonzero skips it (e.g., when a budget has run out).
+   * May be NULL
+   */
+  int (*start)(void *arg,struct entry *entries,int first,int end,int nfiles);
+  /* Find the files of group[0..n-1] not yet gone with the same contents and report each with dupengine_same(),
+   * the one to keep first: the group is oldest first, so that's normally the earliest in it
+   */
+  void (*compare)(void *arg,dupengine *e,struct entry *group,int n);
+  void *arg;
+} dupcomparer;
+
+typedef struct {
+  /* dup has the same contents as ref, a different inode, which is kept. dup is already marked gone */
+  void (*merge)(void *arg,struct entry *ref,struct entry *dup);
+  /* Called after each group, e.g. to carry out the merges batched up; may be NULL */
+  void (*done)(void *arg,struct entry *group,int n);
+  /* Called at the end of each table, when the entries handed to merge() may be about to go away; may be NULL */
+  void (*finish)(void *arg);
+  void *arg;
+} dupaction;
+
+typedef struct {
+  long long groups;		/* Groups compared */
+  long long groups_skipped;	/* Groups the comparer's start() turned down */
+  long long files;		/* Entries in the groups compared */
+  long long links;		/* Duplicates already linked to the file kept */
+  long long merged;		/* Duplicates handed to the action sink */
+  long long bytes;		/* Their sizes */
+} dupengine_stats;
+
+struct dupengine {
+  dupgroup group;		/* Options and statistics of the grouping stage */
+  int reclaim_first;		/* Put the groups in reclaim-first order (dupgroup_schedule()) */
+  dupcomparer comparer;
+  dupaction action;
+  dupengine_stats stats;	/* Added to by each call */
+};
+
+void dupengine_init(dupengine *e);
+
+/* Group entries[0..nfiles-1] with dupgroup_sort(), and dupgroup_schedule() if reclaim_first.
+ * Returns the number of entries left in groups of two or more, which come first
+ */
+int dupengine_group(dupengine *e,struct entry *entries,int nfiles);
+
+/* Hand each group of a grouped table to the comparer, and the duplicates it finds to the action sink */
+void dupengine_compare(dupengine *e,struct entry *entries,int nfiles);
+
+/* For comparers: dup has the same contents as ref, which is kept. Marks dup gone and, unless it's a further link
+ * to ref's inode, hands it to the action sink
+ */
+void dupengine_same(dupengine *e,struct entry *ref,struct entry *dup);
+
+/* A comparer for callers that can give each file a key, such as a hash of its contents, that's equal only for files
+ * with the same contents. Pass dupkeyed_compare as compare() and a dupkeyed as its arg
+ */
+typedef struct {
+  /* Fill in ep's key, keylen bytes; nonzero if there's none (the file can't be read, say) and it's left alone */
+  int (*key)(void *arg,const struct entry *ep,unsigned char *key);
+  size_t keylen;
+  void *arg;			/* Passed to key() */
+  /* Statistics, added to by each call */
+  long long keys;		/* Keys asked for; further links to a file share its key */
+  long long failed;		/* Of those, the ones key() had none for */
+} dupkeyed;
+
+void dupkeyed_compare(void *arg,dupengine *e,struct entry *group,int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
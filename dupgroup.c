@@ -0,0 +1,237 @@
+/* Grouping the file table, for dupmerge. Files can only be identical to others of the same size on the same device,
+ * so the table is put in order of size (decreasing unless small_first), then device, then oldest first and, among
+ * files of the same age, those with more links first, so they're kept and the others are merged into them.
+ *
+ * Sizes that only one file has are dropped first by counting sizes in a hash table. What's left is ordered by
+ * an LSD radix sort on compact keys, a byte at a time over the device index and the 64-bit size; passes over a
+ * byte that's the same in every key are skipped. Only the (usually small) groups of equal size and device are
+ * sorted by time, and each entry is copied just once, into its final place.
+ *
+ * May be used under the terms of the GNU General Public License v 2.0
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dupgroup.h"
+
+struct sortkey {
+  unsigned long long size;	/* Complemented unless small_first, so the radix sort is always ascending */
+  unsigned int index;		/* Into the file table */
+  unsigned short dev;
+};
+#define RADIX_DIGITS 10		/* 2 bytes of device index, then 8 of size */
+#define GROUP_PREFETCH 16	/* Entries fetched ahead when groups are copied out in order */
+
+/* What a group is ordered by, copied out of its entries so the comparison needs no pointer to the table */
+struct agekey {
+  long long mtime;
+  unsigned int nlink;
+  unsigned int index;		/* Into the file table; ties keep table order */
+};
+
+void dupgroup_init(dupgroup *g){
+  memset(g,0,sizeof(*g));
+}
+
+static inline int radix_digit(const struct sortkey *k,int d){
+  return d < 2 ? (k->dev >> (8 * d)) & 0xff : (k->size >> (8 * (d - 2))) & 0xff;
+}
+
+/* Older first; among files with the same mtime, more links first */
+static int compare_age(const void *ap,const void *bp){
+  const struct agekey *a = (const struct agekey *)ap;
+  const struct agekey *b = (const struct agekey *)bp;
+
+  if(a->mtime != b->mtime)
+    return a->mtime < b->mtime ? -1 : 1;
+  if(a->nlink != b->nlink)
+    return a->nlink > b->nlink ? -1 : 1;
+  if(a->index != b->index)
+    return a->index < b->index ? -1 : 1;
+  return 0;
+}
+
+int dupgroup_sort(dupgroup *g,struct entry *entries,int nfiles){
+  unsigned long long *seen,h;
+  size_t count[RADIX_DIGITS][256];
+  struct sortkey *keys,*tmp,*t;
+  struct agekey *ages;
+  struct entry *out,*ep;
+  unsigned int mask,slot;
+  int ahead,bits,d,i,j,k,m,n;
+
+  /* Pass 1: mark the sizes seen more than once. Slots hold size+1, so 0 is empty; the top bit is set on a repeat */
+  for(bits=1; (1ULL << bits) < 2ULL * (unsigned)nfiles; bits++)
+    ;
+  mask = (1U << bits) - 1;
+  seen = (unsigned long long *)calloc((size_t)mask + 1,sizeof(*seen));
+  assert(seen != NULL);
+#define SIZE_SLOT(sz) ((unsigned int)(((unsigned long long)(sz) * 0x9e3779b97f4a7c15ULL) >> (64 - bits)) & mask)
+#define REPEAT (1ULL << 63)
+#define SIZE_PREFETCH 16	/* Slots are looked up this far ahead, as each one is likely a cache miss */
+  for(i=0;i<nfiles;i++){
+    if(i + SIZE_PREFETCH < nfiles)
+      __builtin_prefetch(&seen[SIZE_SLOT(entries[i + SIZE_PREFETCH].size)],1);
+    h = (unsigned long long)entries[i].size + 1;
+    for(slot = SIZE_SLOT(entries[i].size); seen[slot] != 0 && (seen[slot] & ~REPEAT) != h; slot = (slot + 1) & mask)
+      ;
+    seen[slot] = seen[slot] == 0 ? h : seen[slot] | REPEAT;
+  }
+  /* Pass 2: keys for the files whose size repeats */
+  keys = (struct sortkey *)malloc(2 * (size_t)nfiles * sizeof(*keys) + 1);
+  assert(keys != NULL);
+  tmp = keys + nfiles;
+  memset(count,0,sizeof(count));
+  for(n=i=0;i<nfiles;i++){
+    if(i + SIZE_PREFETCH < nfiles)
+      __builtin_prefetch(&seen[SIZE_SLOT(entries[i + SIZE_PREFETCH].size)],0);
+    h = (unsigned long long)entries[i].size + 1;
+    for(slot = SIZE_SLOT(entries[i].size); (seen[slot] & ~REPEAT) != h; slot = (slot + 1) & mask)
+      ;
+    if(!(seen[slot] & REPEAT))
+      continue;
+    keys[n].size = g->small_first ? (unsigned long long)entries[i].size : ~(unsigned long long)entries[i].size;
+    keys[n].dev = entries[i].dev;
+    keys[n].index = i;
+    for(d=0;d<RADIX_DIGITS;d++)
+      count[d][radix_digit(&keys[n],d)]++;
+    n++;
+  }
+#undef SIZE_SLOT
+#undef SIZE_PREFETCH
+#undef REPEAT
+  free(seen);
+
+  /* Stable counting sort on each byte, least significant first */
+  for(d=0;d<RADIX_DIGITS;d++){
+    size_t offset = 0,c;
+
+    if(n == 0 || count[d][radix_digit(&keys[0],d)] == (size_t)n)
+      continue; /* All the same */
+    for(k=0;k<256;k++){
+      c = count[d][k];
+      count[d][k] = offset;
+      offset += c;
+    }
+    for(i=0;i<n;i++)
+      tmp[count[d][radix_digit(&keys[i],d)]++] = keys[i];
+    t = keys; keys = tmp; tmp = t;
+  }
+  if(keys > tmp){
+    t = keys; keys = tmp; tmp = t; /* keys is the start of the allocation */
+    memcpy(keys,tmp,n * sizeof(*keys));
+  }
+  /* Order each group by age, drop groups left with one file (same size, different devices) and copy out */
+  out = (struct entry *)malloc((size_t)n * sizeof(*out) + 1);
+  ages = (struct agekey *)malloc((size_t)n * sizeof(*ages) + 1);
+  assert(out != NULL && ages != NULL);
+  ahead = 0;
+  for(k=i=0;i<n;i=j){
+    for(j=i+1; j<n && keys[j].size == keys[i].size && keys[j].dev == keys[i].dev; j++)
+      ;
+    for(; ahead < j + GROUP_PREFETCH && ahead < n; ahead++)
+      __builtin_prefetch(&entries[keys[ahead].index],0);
+    if(j - i < 2)
+      continue;
+    for(m=0;i+m<j;m++){
+      ep = &entries[keys[i+m].index];
+      ages[m].mtime = ep->mtime;
+      ages[m].nlink = ep->nlink;
+      ages[m].index = keys[i+m].index;
+    }
+    qsort(ages,m,sizeof(*ages),compare_age);
+    for(i=0;i<m;i++)
+      out[k++] = entries[ages[i].index];
+    g->groups++;
+  }
+  memcpy(entries,out,k * sizeof(*out));
+  free(ages);
+  free(out);
+  free(keys);
+  g->files += nfiles;
+  g->grouped += k;
+  return k;
+}
+
+/* Reclaim-first order (-O). When time or reading is short, the groups that give back the most space for what they
+ * cost to examine should go first, not simply the biggest files. Each group is scored by the space it would give
+ * back if its files were all identical, over the bytes that would have to be read to find out.
+ * The space is the allocated blocks (g->blocks(), so sparse and compressed files count for what they really take)
+ * of every inode but the oldest, which is kept; an inode with links outside the group gives nothing back, as its
+ * data stays in use. The cost is each inode's size plus OPEN_COST, so a group of tiny files pays for its opens.
+ * Groups scoring the same go largest first. Only the order of the groups changes, not the order within them
+ */
+#define OPEN_COST (64*1024)	/* Opening a file costs about as much as reading this much of one */
+
+struct groupscore {
+  double score;			/* Bytes given back per byte read */
+  long long reclaim;		/* Bytes given back */
+  int start,n;			/* Place in the table */
+};
+
+static int compare_score(const void *ap,const void *bp){
+  const struct groupscore *a = (const struct groupscore *)ap;
+  const struct groupscore *b = (const struct groupscore *)bp;
+
+  if(a->score != b->score)
+    return a->score > b->score ? -1 : 1;
+  if(a->reclaim != b->reclaim)
+    return a->reclaim > b->reclaim ? -1 : 1;
+  return a->start < b->start ? -1 : 1;
+}
+
+/* By inode, then by place in the table */
+static int compare_ino_position(const void *ap,const void *bp){
+  const struct entry *a = *(const struct entry **)ap;
+  const struct entry *b = *(const struct entry **)bp;
+
+  if(a->ino != b->ino)
+    return a->ino < b->ino ? -1 : 1;
+  if(a != b)
+    return a < b ? -1 : 1;
+  return 0;
+}
+
+void dupgroup_schedule(dupgroup *g,struct entry *entries,int nfiles){
+  struct groupscore *groups,*gp;
+  struct entry **links,*out;
+  double cost;
+  int ngroups,i,j,k,n,run;
+
+  groups = (struct groupscore *)malloc((size_t)nfiles * sizeof(*groups) + 1);
+  links = (struct entry **)malloc((size_t)nfiles * sizeof(*links) + 1);
+  out = (struct entry *)malloc((size_t)nfiles * sizeof(*out) + 1);
+  assert(groups != NULL && links != NULL && out != NULL);
+  for(ngroups=i=0;i<nfiles;i=j){
+    for(j=i+1; j<nfiles && entries[j].size == entries[i].size && entries[j].dev == entries[i].dev; j++)
+      ;
+    gp = &groups[ngroups++];
+    gp->start = i;
+    gp->n = j - i;
+    gp->reclaim = 0;
+    cost = 0;
+    for(n=0,k=i;k<j;k++){
+      if(!entries[k].gone) /* E.g., linked to a reference file already */
+	links[n++] = &entries[k];
+    }
+    qsort(links,n,sizeof(*links),compare_ino_position);
+    for(k=0;k<n;k=run){
+      for(run=k+1;run<n && links[run]->ino == links[k]->ino;run++)
+	;
+      cost += links[k]->size + OPEN_COST;
+      if(links[k]->ino != entries[i].ino && (unsigned int)(run - k) >= links[k]->nlink)
+	gp->reclaim += g->blocks != NULL ? g->blocks(links[k],g->arg) : links[k]->size;
+    }
+    gp->score = cost > 0 ? gp->reclaim / cost : 0;
+    g->reclaimable += gp->reclaim;
+  }
+  qsort(groups,ngroups,sizeof(*groups),compare_score);
+  for(k=i=0;i<ngroups;i++){
+    memcpy(&out[k],&entries[groups[i].start],groups[i].n * sizeof(*out));
+    k += groups[i].n;
+  }
+  memcpy(entries,out,(size_t)nfiles * sizeof(*out));
+  free(out);
+  free(links);
+  free(groups);
+}
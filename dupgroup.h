@@ -0,0 +1,61 @@
+/* Grouping stage of dupmerge: put a file table in order so that the files that could be duplicates of each other,
+ * the same size on the same device, are together, and optionally put those groups in reclaim-first order (-O).
+ *
+ * All the state is in a dupgroup, so several tables (one per volume, say) can be grouped at once in one process,
+ * from C or C++, and the stage can be timed on its own. Nothing here reads a file
+ *
+ * May be used under the terms of the GNU General Public License v 2.0
+ */
+#ifndef _DUPGROUP_H
+#define _DUPGROUP_H
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* File table entry: just what the sort and the scans look at, 36 bytes where a struct stat alone is 144.
+ * Everything else about a file is kept by the caller, at id
+ */
+struct entry {
+  off_t size;
+  ino_t ino;
+  long long mtime;		/* Nanoseconds since the epoch */
+  unsigned int nlink;
+  unsigned int id;		/* Index into the caller's own table (Files[] in dupmerge) */
+  unsigned short dev;		/* Index into the caller's table of devices */
+  unsigned short gone;		/* Merged, or a further link to an earlier file; skip it */
+} __attribute__((packed));
+
+typedef struct {
+  int small_first;		/* Smallest sizes first, instead of largest */
+  /* Bytes allocated to a file, for dupgroup_schedule(); NULL to count its size */
+  long long (*blocks)(const struct entry *ep,void *arg);
+  void *arg;			/* Passed to blocks() */
+  /* Statistics, added to by each call */
+  long long files;		/* Entries given to dupgroup_sort() */
+  long long grouped;		/* Entries it left in groups of two or more */
+  long long groups;		/* Those groups */
+  long long reclaimable;	/* Bytes dupgroup_schedule() found could be given back if every group were duplicates */
+} dupgroup;
+
+void dupgroup_init(dupgroup *g);
+
+/* Reorder entries[0..nfiles-1] so that each group of two or more files with the same size and device is contiguous:
+ * by size (decreasing unless small_first), then device, then oldest first and, among files of the same age, those
+ * with more links first. Returns the number of entries in such groups, which come first; the rest of the table is
+ * left undefined
+ */
+int dupgroup_sort(dupgroup *g,struct entry *entries,int nfiles);
+
+/* Put the groups of a table left by dupgroup_sort() in order of the space each would give back per byte read to
+ * examine it; the order within each group is kept
+ */
+void dupgroup_schedule(dupgroup *g,struct entry *entries,int nfiles);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
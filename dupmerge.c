@@ -13,12 +13,15 @@
  * than two identical copies of a single file. This version should reliably identify and link all identical copies.
 
  * This program reads from standard input a list of files (such
- * as that generated by "find . -print") and discovers which files are
+ * as that generated by "find . -print"), or walks the directory trees named
+ * on the command line, and discovers which files are
  * identical. Dupmerge unlinks one file of each identical pair and
  * recreates its path name as a link to the other.
  *
  * Non-plain files in the input (directories, pipes, devices, etc)
  * are ignored.  Identical files must be on the same file system to be linked.
+ * Each duplicate is replaced by linking the kept file to a temporary name in its directory and renaming
+ * that over it, so a crash can't leave the path missing.
  *
  * Dupmerge prefers to keep the older of two identical files, as the older
  * timestamp is more likely to be the correct one given that many
@@ -37,6 +40,51 @@
  * -s By default, files are sorted in decreasing order of size so that the actual unlinking of duplicate files starts with
  *    the largest files. This recovers disk space as quickly as possible, but if for some reason you want to start with the
  *    smallest files, use this flag.
+ * -O Order the groups of same-size files by the space each would give back, in allocated blocks, per byte that
+ *    must be read to examine it, so a limited run reclaims as much as it can
+ * -L budget
+ *    Start no more groups after this much time (e.g., 90s, 30m, 2h; plain seconds) or reading (e.g., 500M, 2G).
+ *    Implies -O
+ * -j threads
+ *    Number of threads used to walk directories and compute file hashes (default: number of online CPUs).
+ *    -j 1 hashes serially and lazily, exactly as older versions did. Reads are queued per device, with a few at a
+ *    time on hard disks and many on SSDs, so several disks are read at once; without -j, input on several
+ *    devices gets enough threads for all of them.
+ * -u depth
+ *    Number of reads kept in flight through io_uring (Linux) when hashing whole files (default 32). -u 0 maps
+ *    each file and hashes it in one go instead, as older versions did.
+ * -c cachefile
+ *    Keep file hashes in cachefile between runs, so files that haven't changed aren't read again.
+ * -M manifest
+ *    At the end, write a manifest of the files in the trees: size, device, inode, hashes and whole path name of
+ *    each, sorted by size, for use with -r.
+ * -r manifest
+ *    Link files identical to one in this manifest (a reference set, which may be given more than once) to that
+ *    one, which is always kept. Only the new files are read; each reference file is checked with lstat() first.
+ * -d Instead of unlinking and relinking duplicates, have the kernel share their extents with the reference file
+ *    (FIDEDUPERANGE; btrfs, XFS and others). Every path keeps its own inode, owner and permissions. Files on a
+ *    file system that can't do it are linked as usual.
+ * -b Afterwards, cut the files of 1 MB or more that are still distinct into content-defined chunks and report the
+ *    space they share; with -d, shared runs of whole blocks are deduped too.
+ * -p Look up where each candidate starts on the disk (FIEMAP, else FIBMAP) and read the files on each hard disk
+ *    in that order, so the heads sweep instead of seeking.
+ * -w After the run, keep watching the directories named (inotify) and check each file that is written or moved
+ *    in against the files of its size as it arrives, until SIGINT or SIGTERM.
+ * -m megabytes
+ *    Hold no more than this much of the file table in memory; the rest goes to sorted runs in scratch files,
+ *    merged at the end a few size groups at a time. For trees of billions of files.
+ * -T scratchdir
+ *    Where -m puts its scratch files (default $TMPDIR, else /tmp).
+ * -R reportfile
+ *    Write the statistics, with the time taken by each phase and resource use, as JSON at exit ("-" for stdout).
+ *    SIGUSR1 writes the same report, as it stands, at any time (to stderr without -R).
+ * -P seconds
+ *    Print a line on progress through the current phase, with an estimate of the time left, this often.
+ * -B MB/s[,IOPS]
+ *    Background mode: read at no more than this rate, drop what was read from the page cache, and slow down
+ *    further (or pause) while /proc/pressure shows other tasks stalling on I/O or memory.
+ * directory ...
+ *    Walk these trees (without following symbolic links) instead of reading path names from standard input.
  *
  * Trivia: this program was inspired by a cheating scandal in the introductory computer science course CS-100
  * at Cornell University the year after I graduated. The TAs simply sorted the projects by object code size and compared
@@ -51,6 +99,40 @@
  *
  * https://stackoverflow.com/a/22988405
  * gcc -O3 -fexpensive-optimizations -o dupmerge dupmerge.c -lssl -lcrypto
+ *
+ * October 2026: hashes for each run of same-size groups are computed ahead of the comparison loop by a pool of
+ * threads, so several files are read and hashed at once. The comparisons themselves are still done serially.
+ * gcc -O3 -fexpensive-optimizations -pthread -o dupmerge dupmerge.c -lssl -lcrypto
+ *
+ * Same-size groups are no longer scanned pair by pair: each is sorted into buckets by first page hash, and buckets
+ * with more than one inode are sorted again by full hash. See scan_buckets().
+ *
+ * Files are now hashed with BLAKE3 (blake3.c), which hashes several 1 KB chunks of a file at once in SIMD lanes
+ * and picks the widest vector unit the CPU has at run time. Several times faster than SHA-1, and no openssl needed:
+ * gcc -O3 -fexpensive-optimizations -pthread -o dupmerge dupmerge.c blake3.c
+ * The old SHA-1 hash is still available:
+ * gcc -O3 -fexpensive-optimizations -pthread -DUSE_SHA1 -o dupmerge dupmerge.c -lcrypto
+ *
+ * The file table no longer holds a struct stat, a path name and every hash for each file. The entries that get
+ * sorted and scanned keep only size, inode, mtime, link count and small indexes, 36 bytes; the basename, ctime and
+ * directory index live in a parallel table, names in a string arena with each directory stored once, and hashes
+ * are allocated only for files that share their size with another.
+ *
+ * -b finds duplicate data inside files that aren't duplicates as a whole, with FastCDC chunking (fastcdc.c),
+ * whose rolling hash is computed for eight stretches of a buffer at once with AVX-512 where the CPU has it:
+ * gcc -O3 -fexpensive-optimizations -pthread -o dupmerge dupmerge.c blake3.c fastcdc.c
+ *
+ * -m bounds the memory used by the file table, by writing it out as sorted runs and merging them; see spill_batch().
+ *
+ * Files of 64 MB or more are hashed 4 MB leaves at a time by several threads, as BLAKE3 subtrees, with the same
+ * result as hashing them serially and never more than two leaves per thread in memory; see tree_hash().
+ *
+ * The engine is a library with no global state, libdupengine.a: the grouping stage (the sort, and the -O order) in
+ * dupgroup.c, and in dupengine.c the loop over the groups, which hands each to a pluggable comparer and the duplicates
+ * it finds to an action sink. dupmerge is a client, with a comparer that reads and hashes files and a sink that links
+ * or dedupes them; see engine_start():
+ * gcc -O3 -fexpensive-optimizations -c dupgroup.c dupengine.c && ar rcs libdupengine.a dupgroup.o dupengine.o
+ * gcc -O3 -fexpensive-optimizations -pthread -o dupmerge dupmerge.c blake3.c fastcdc.c libdupengine.a
  * 
  * Copyright Phil Karn, karn@ka9q.net. May be used under the terms of the GNU General Public License v 2.0
  *
@@ -66,12 +148,49 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <libgen.h>
 #include <sys/mman.h>
 #include <limits.h>
 #include <unistd.h>
 #include <regex.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+#endif
+#ifdef USE_SHA1
 #include <openssl/sha.h>
+#define HASHSIZE SHA_DIGEST_LENGTH
+#define HASHNAME "sha1"
+typedef SHA_CTX hash_ctx;
+#define hash_init(c) SHA1_Init(c)
+#define hash_update(c,p,len) SHA1_Update(c,p,len)
+#define hash_final(c,md) SHA1_Final(md,c)
+#else
+#include "blake3.h"
+#define HASHSIZE BLAKE3_OUT_LEN
+#define HASHNAME "blake3"
+typedef blake3_hasher hash_ctx;
+#define hash_init(c) blake3_hasher_init(c)
+#define hash_update(c,p,len) blake3_hasher_update(c,p,len)
+#define hash_final(c,md) blake3_hasher_finalize(c,md)
+#endif
+#include "fastcdc.h"
+#include "dupengine.h"
 
 /* Darwin (OSX) has this, but Linux apparently doesn't */
 #ifndef MAP_NOCACHE
@@ -82,8 +201,17 @@
 #define MAP_POPULATE (0)
 #endif
 
-#define HASHSIZE 20
 #define PAGESIZE (4096)
+#define URING_DEPTH 32 /* Default io_uring reads in flight */
+#define READ_PIECE (256*1024) /* Whole files are read this much at a time when not mapped */
+/* Between the first page and the full hash, big files are told apart by sampled pages: stage 1 the last page,
+ * stage 2 SAMPLE_PAGES more spread through the file
+ */
+#define SAMPLE_STAGES 2
+#define SAMPLE_PAGES 6
+#define SAMPLE_MINSIZE (16*PAGESIZE) /* Smaller files go straight to the full hash */
+#define SMALL_MAXSIZE (4*PAGESIZE) /* Files this small are read whole for their first page hash */
+#define TREE_MINSIZE (64LL*1024*1024) /* Bigger files are hashed a leaf at a time by several threads */
 
 enum flag { NO=0,YES=1,UNKNOWN=-1 };
 
@@ -93,6 +221,28 @@ enum flag Quiet_flag = NO;
 enum flag Fast_threshold = 100000;
 enum flag No_do = NO;
 enum flag Small_first = NO;
+enum flag Dedupe_flag = NO; /* Share extents with FIDEDUPERANGE instead of linking */
+enum flag Chunk_flag = NO; /* Also look for duplicate chunks within distinct files */
+enum flag Physical_flag = NO; /* Read files on hard disks in the order of their blocks */
+enum flag Watch_flag = NO; /* Afterwards, stay up and check new files as they arrive */
+int Hash_threads = 0; /* Size of hashing pool including main thread; 0 = one per online CPU */
+int Tree_threads = 1; /* Threads hashing the leaves of one big file */
+int Uring_depth = URING_DEPTH; /* io_uring reads in flight; 0 = don't use io_uring */
+char *Myname; /* argv[0], for messages */
+char *Cache_file = NULL; /* Persistent hash cache, if any */
+long long Memory_budget = 0; /* Bytes of file table to hold before spilling it to sorted runs; 0 = no limit */
+char *Scratch_dir = NULL; /* For the runs; default $TMPDIR or /tmp */
+char *Report_file = NULL; /* Machine-readable statistics written here at exit, if set */
+int Progress_interval = 0; /* Seconds between progress lines; 0 = none */
+enum flag Background_flag = NO; /* Read politely and at a limited rate, beside other work */
+double Rate_bytes = 0; /* Background mode limits, bytes and reads per second; 0 = none */
+double Rate_iops = 0;
+enum flag Reclaim_first = NO; /* Order the groups by space given back per byte read, not by size */
+double Time_budget = 0; /* With -L: seconds, or bytes read, after which no more groups are started; 0 = none */
+long long Byte_budget = 0;
+char *Manifest_file = NULL; /* Manifest of the trees written here at exit, if set */
+char **Reference_files; /* Manifests of reference sets to link to */
+int Nreference_files;
 
 /* Statistics counts */
 unsigned Regular_file = 0;
@@ -110,46 +260,231 @@ unsigned Stat_fail = 0;
 unsigned Not_accessible = 0;
 unsigned Files_deleted = 0;
 long long Blocks_reclaimed = 0;
+long long Dedupe_files = 0;	/* Files whose extents were all shared with their reference file */
+long long Dedupe_bytes = 0;
+long long Dedupe_differs = 0;	/* Turned down by the kernel as different, i.e., changed since they were hashed */
+long long Dedupe_fallbacks = 0;	/* Linked instead, the file system not supporting dedupe */
 long long Full_hashes_computed = 0;
 long long Block_hashes_computed = 0;
 long long Full_hash_hits = 0;
 long long Block_hash_hits = 0;
+long long Small_files = 0;	/* Read whole for the first page hash, giving the full hash too */
 long long Partial_hit_full_fail = 0;
 long long Unlinks = 0;
 long long Unlink_failures = 0;
 long long Map_fails = 0;
+long long Tree_hashes = 0;	/* Big files hashed a leaf at a time */
+long long Cache_hits = 0;
+long long Sample_hashes[SAMPLE_STAGES];
+long long Sample_hits[SAMPLE_STAGES];
+long long Sample_rejects[SAMPLE_STAGES];	/* Files found distinct by each sample stage */
+long long Stream_compares = 0;
+long long Stream_bytes = 0;
+long long Spill_total = 0;	/* Entries written to sorted runs with -m */
+int Spill_runs = 0;
+long long Bytes_hashed = 0;	/* Through any hash, by any thread */
+long long Background_cached = 0;	/* Bytes already in the page cache in background mode, so not charged */
+long long Pressure_backoffs = 0;	/* Times the rate was cut, or reading paused, for PSI pressure */
+double Throttle_wait = 0;	/* Seconds readers were held back by the rate limits, summed over threads */
+double Pressure_wait = 0;	/* And paused for pressure */
+long long Chunk_nfiles = 0;	/* Files cut into chunks by -b */
+long long Chunk_bytes = 0;
+long long Chunk_count = 0;
+long long Chunk_shared = 0;	/* Chunks seen earlier, in another file or the same one */
+long long Chunk_shared_bytes = 0;
+long long Chunk_deduped_bytes = 0;
+long long Chunk_unaligned_bytes = 0;	/* In shared runs at different offsets within a block, so not deduped */
+long long Physical_found = 0;	/* Files whose disk address -p could find */
+long long Physical_unknown = 0;
+long long Watch_files = 0;	/* New or changed files looked at in watch mode */
+long long Watch_ndirs = 0;	/* Directories watched */
+long long Watch_overflows = 0;	/* Times the kernel dropped events */
+enum flag Budget_spent = NO;
+dupengine Engine;		/* Grouping, comparing and linking, with the statistics of each; see engine_start() */
+long long Reference_records = 0;	/* In the manifests given with -r */
+long long Reference_matches = 0;	/* Files linked to a file in a reference set */
+long long Reference_stale = 0;	/* Matching records whose files had changed, so weren't linked to */
+
+/* Wall time spent in each phase, for the report (-R). Linking happens inside the comparisons; its time is
+ * counted under PHASE_LINK and not under PHASE_COMPARE
+ */
+enum phase { PHASE_WALK, PHASE_REFERENCE, PHASE_SORT, PHASE_COMPARE, PHASE_LINK, PHASE_CHUNK, PHASE_WATCH,
+	     PHASE_MANIFEST, PHASE_CACHE, NPHASES };
+const char *Phase_names[NPHASES] = { "walk", "reference", "sort", "compare", "link", "chunk", "watch",
+				     "manifest", "cache" };
+double Phase_time[NPHASES];
+double Watch_link_time;	/* The part of PHASE_LINK spent in watch mode, counted under it and not under PHASE_COMPARE */
+double Reference_link_time;	/* Likewise in reference_scan() */
+enum phase Phase = PHASE_WALK;	/* Current phase, never PHASE_LINK */
+double Phase_started;
+double Run_started;
+long long Files_examined;	/* Regular files kept for comparison */
+/* Progress through the current phase, in bytes of the files it has to look at */
+long long Progress_total,Progress_done;
+
+/* Latency histograms: bucket i counts times from 2^(i-1) up to 2^i microseconds, the last everything longer */
+#define HIST_BUCKETS 25
+struct histogram {
+  long long count[HIST_BUCKETS];
+  long long total_ns;
+};
+struct histogram Open_latency;	/* Opening a file to read it */
+struct histogram Hash_latency;	/* Hashing a file, or some pages of it, reads included */
+struct histogram Link_latency;	/* Unlinking and relinking a duplicate, or one dedupe call */
+
+/* struct entry, the file table entry, is in dupgroup.h */
 
-#define ENTRYCHUNK 5000 /* Allocation unit for file table */
+/* The rest of what we know about a file */
+struct file {
+  const char *name;		/* Last component of the path name, in a string arena */
+  struct hashes *hashes;	/* Only for files with others of the same size; NULL until they're needed */
+  long long ctime;		/* Nanoseconds, for the hash cache */
+  unsigned int dir;		/* Index into Dirs[] */
+  unsigned int reference:1;	/* From a manifest (-r); always the one kept */
+  unsigned int blocks:31;	/* Allocated, in 4 KB units (st_blocks / 8), for -O; saturates at 8 TB */
+};
 
-/* File table entry */
-struct entry {
-  char *pathname; /* Path name, reserved space for null */
-  struct stat statbuf; /* file i-node data */
+/* File hashes; see HASHES() */
+struct hashes {
   unsigned char partialhash[HASHSIZE];
   unsigned char filehash[HASHSIZE];
+  unsigned char samplehash[SAMPLE_STAGES][HASHSIZE]; /* The first sample_stage are valid; see get_sample_hash() */
   int partialhash_present:1;
   int filehash_present:1;
+  unsigned int sample_stage:2;
+  /* Set when the hashing pool computed the hash ahead of time and no comparison has used it yet,
+   * so the first use isn't counted as a hit
+   */
+  int partialhash_fresh:1;
+  int filehash_fresh:1;
+  unsigned int samplehash_fresh:SAMPLE_STAGES; /* One bit per stage */
+  unsigned int relinked:1;	/* Linked to or deduped since the walk, so its ctime is out of date */
+  unsigned long long physical;	/* Where the data starts on the disk, with -p; 0 if unknown */
+};
+
+struct file *Files;		/* Indexed by entry id */
+size_t Files_allocated;
+unsigned int Files_used;	/* Ids handed out so far */
+const char **Dirs;		/* Full path names of the directories holding the files; "" for none */
+dev_t Devices[USHRT_MAX+1];	/* Distinct devices seen */
+
+#define HASHES(ep) (Files[(ep)->id].hashes)
+#define MTIME_SEC(ep) ((ep)->mtime >= 0 ? (ep)->mtime / 1000000000 : ((ep)->mtime + 1) / 1000000000 - 1)
+
+/* Strings allocated a chunk at a time and never freed: the file and directory names */
+#define ARENA_CHUNK (1024*1024)
+struct arena {
+  char *next;
+  size_t left;
 };
+const char *arena_strdup(struct arena *a,const char *s,size_t len);
+void *table_grow(void *table,size_t *allocated,size_t n,size_t size);
+unsigned int dir_index(const char *path,size_t len,struct arena *a);
+unsigned short dev_index(dev_t dev);
+void entry_fill(struct entry *ep,struct file *fp,const struct stat *sb,unsigned short dev);
+char *path_of(const struct entry *ep,char *buf);
+void alloc_hashes(struct entry *ep);
+unsigned int file_new(void);
 
 /* Comparison functions */
 int comparison_equal(const void *ap,const void *bp); /* Does most of the work */
-int comparison_sort(const void *ap,const void *bp); /* Version called by qsort() */
+long long file_blocks(const struct entry *ep,void *arg); /* For dupgroup_schedule() */
+int budget_spent(void);
+
+/* Hash functions */
+void get_small_hash(struct entry *ep);
+void get_big_hash(struct entry *ep);
+void get_sample_hash(struct entry *ep);
+void use_small_hash(struct entry *ep);
+void use_sample_hash(struct entry *ep,int stage);
+void use_big_hash(struct entry *ep);
+
+/* Building the file table */
+int read_list(FILE *fp,struct entry **entriesp);
+int walk_trees(char *roots[],int nroots,struct entry **entriesp);
+void count_type(mode_t mode);
+
+/* Duplicate detection within a group of same-size files on one device */
+void scan_buckets(dupengine *e,struct entry *group,int n);
+void scan_pairwise(dupengine *e,struct entry *group,int n);
+int stream_wanted(off_t size,int n);
+void merge(void *arg,struct entry *ref,struct entry *dup);
+void dedupe_flush(void);
+void relink_flush(void);
+
+/* The engine (dupengine.c), with the comparer and action sink above plugged in */
+void engine_start(void);
+void compare_begin(void *arg,struct entry *entries,int nfiles);
+int compare_start(void *arg,struct entry *entries,int first,int end,int nfiles);
+void compare_files(void *arg,dupengine *e,struct entry *group,int n);
+void merge_done(void *arg,struct entry *group,int n);
+void merge_finish(void *arg);
+
+/* External mode: bounded memory for the file table */
+void spill_start(void);
+void spill_batch(const struct entry *batch,const struct file *files,int n);
+void external_merge(void);
+
+/* Sub-file duplicates */
+int chunk_candidates(struct entry *entries,int nfiles,struct entry **bigp);
+void chunk_scan(struct entry *big,int nbig,struct entry *entries,int nfiles,int ntotal);
+
+/* Watch mode */
+int watch_trees(char *roots[],int nroots,struct entry *entries,int nfiles,struct entry **entriesp);
+
+/* Manifests and reference sets */
+void manifest_write(const char *path,struct entry *entries,int nfiles);
+void reference_open(const char *path);
+void reference_scan(struct entry *entries,int nfiles);
+
+/* Persistent hash cache */
+void cache_open(const char *path);
+int cache_lookup(struct entry *ep);
+void cache_save(const char *path,struct entry *entries,int nfiles);
+
+/* Hashing pool */
+#define PREFETCH_BATCH 64 /* Minimum entries per thread handed to the pool at once */
+void hash_pool_start(int nthreads);
+int device_threads(int nthreads);
+int prefetch_hashes(struct entry *entries,int first,int nfiles);
+
+/* Background mode */
+size_t read_data(struct entry *ep,int fd,void *buf,size_t len,off_t offset);
+void throttle(size_t bytes);
+void pressure_check(void);
+
+/* Full file reads through io_uring */
+void uring_start(int depth);
+int uring_hash(struct entry **batch,int n);
+
+/* Run report and progress */
+double now_seconds(void);
+void phase_enter(enum phase p);
+void hist_add(struct histogram *h,double start);
+int timed_open(const char *path,int flags);
+void report_write(const char *path);
+void monitor_start(void);
 
 int main(int argc,char *argv[]){
-  int i,j;
-  struct entry *entries = NULL; /* Dynamically allocated file table */
-  struct entry *ep;
-  int entryarraysize = 0; /* Start with empty table, allocate on first pass */
-  int nfiles;
+  int i;
+  struct entry *entries = NULL; /* File table */
+  int nfiles,ntotal = 0;
+  int auto_threads; /* No -j */
+  struct entry *big = NULL; /* Copies of the entries to chunk with -b */
+  int nbig = 0;
+  struct entry *whole = NULL; /* The whole table, in id order, for -w and -M */
+
+  Myname = argv[0];
+  Run_started = Phase_started = now_seconds();
 
   /* Process command line args */
   {
     char c;
 
-    while((c = getopt(argc,argv,"snqf0t:")) != EOF){
+    while((c = getopt(argc,argv,"snqf0dbpwOt:j:c:u:m:r:M:T:R:P:B:L:")) != EOF){
       switch(c){
       default:
-	fprintf(stderr,"Usage: %s [-s] [-n] [-q] [-f] [-0] [-t threshold_size]\n",argv[0]);
+	fprintf(stderr,"Usage: %s [-s] [-n] [-q] [-f] [-0] [-d] [-b] [-p] [-w] [-O] [-t threshold_size] [-j threads] [-u depth] [-c cachefile] [-M manifest] [-r manifest] [-m megabytes] [-T scratchdir] [-R reportfile] [-P seconds] [-B MB/s[,IOPS]] [-L budget] [directory ...]\n",argv[0]);
 	break;
       case 's':
 	Small_first = YES;
@@ -166,128 +501,128 @@ int main(int argc,char *argv[]){
       case '0':
 	Zero_flag = YES; /* Path names are delimited by nulls, e.g., from 'find . -print0' */
 	break;
+      case 'd':
+	Dedupe_flag = YES; /* Share extents rather than link */
+	break;
+      case 'b':
+	Chunk_flag = YES; /* Chunk what's left */
+	break;
+      case 'p':
+	Physical_flag = YES; /* Read in disk order */
+	break;
+      case 'w':
+	Watch_flag = YES; /* Then keep watching for new files */
+	break;
+      case 'O':
+	Reclaim_first = YES; /* Most space back per byte read first */
+	break;
       case 't':
 	Fast_threshold = atoi(optarg);
 	break;
+      case 'j':
+	Hash_threads = atoi(optarg);
+	break;
+      case 'u':
+	Uring_depth = atoi(optarg); /* io_uring reads in flight */
+	break;
+      case 'c':
+	Cache_file = optarg; /* Hashes from earlier runs */
+	break;
+      case 'm':
+	Memory_budget = atoll(optarg) * 1024 * 1024; /* External mode */
+	break;
+      case 'r':
+	Reference_files = (char **)realloc(Reference_files,(Nreference_files + 1) * sizeof(*Reference_files));
+	assert(Reference_files != NULL);
+	Reference_files[Nreference_files++] = optarg; /* Link to what's in this manifest */
+	break;
+      case 'M':
+	Manifest_file = optarg; /* Write one of these trees */
+	break;
+      case 'T':
+	Scratch_dir = optarg;
+	break;
+      case 'R':
+	Report_file = optarg; /* JSON statistics at exit */
+	break;
+      case 'P':
+	Progress_interval = atoi(optarg);
+	break;
+      case 'B':
+	Background_flag = YES; /* Polite reads, at no more than MB/s[,IOPS] */
+	Rate_bytes = atof(optarg) * 1024 * 1024;
+	if(strchr(optarg,',') != NULL)
+	  Rate_iops = atof(strchr(optarg,',') + 1);
+	break;
+      case 'L':
+	{
+	  char *end;
+	  double v = strtod(optarg,&end);
+
+	  switch(*end){
+	  case '\0': case 's': Time_budget = v; break;
+	  case 'm': Time_budget = v * 60; break;
+	  case 'h': Time_budget = v * 3600; break;
+	  case 'K': Byte_budget = v * 1024; break;
+	  case 'M': Byte_budget = v * 1024 * 1024; break;
+	  case 'G': Byte_budget = v * 1024 * 1024 * 1024; break;
+	  case 'T': Byte_budget = v * 1024 * 1024 * 1024 * 1024; break;
+	  default:
+	    fprintf(stderr,"%s: -L takes a time (s, m or h) or an amount to read (K, M, G or T), e.g., 30m or 500G\n",argv[0]);
+	    exit(1);
+	  }
+	  Reclaim_first = YES; /* Spend it where it gives back the most */
+	}
+	break;
       }
     }
   }
+  if((auto_threads = Hash_threads <= 0)){
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    Hash_threads = ncpu > 0 ? ncpu : 1;
+  }
+  Tree_threads = Hash_threads; /* Before any more are added for devices; the leaves want CPUs */
   if(No_do && Quiet_flag){
     fprintf(stderr,"%s: -q flag forced off with -n set\n",argv[0]);
     Quiet_flag = NO; /* Force off */
   }
-
-  /* Start by reading stdin for list of path names
-   * Check each one and ignore non-regular files, zero-length files, special files, errors, etc
-   */
-  ep = NULL;
-  for(nfiles=0;!feof(stdin) && !ferror(stdin);){
-    int ch;
-    char pathname[PATH_MAX+1];
-
-    /* Expand file table if necessary and possible */
-    if(nfiles >= entryarraysize){
-      entries = (struct entry *)realloc(entries,(entryarraysize + ENTRYCHUNK) * sizeof(struct entry));
-      assert(entries != NULL);
-      entryarraysize += ENTRYCHUNK;
+  if(Memory_budget > 0){
+    if(Chunk_flag){
+      fprintf(stderr,"%s: -b can't be used with -m, ignored\n",argv[0]);
+      Chunk_flag = NO; /* Needs every big file's entry at the end */
     }
-    ep = &entries[nfiles];
-    for(i=0;i< PATH_MAX;i++){
-      
-      if(EOF == (ch = getc(stdin)) || '\0' == ch || (!Zero_flag && '\n' == ch))
-	break;
-
-      pathname[i] = ch;
-    }      
-    if(ch == EOF)
-      break;
-
-    pathname[i] = '\0';
-
-    Total_files++;
-
-    /* Ignore null file names */
-    if(strlen(pathname) == 0){
-      Null_pathname++;
-      continue; /* Reuse entry for next file */
+    if(Watch_flag){
+      fprintf(stderr,"%s: -w can't be used with -m, ignored\n",argv[0]);
+      Watch_flag = NO; /* Needs the whole table in memory */
     }
-    /* If we can't stat it, ignore it */
-    if(lstat(pathname,&entries[nfiles].statbuf) != 0){
-      Stat_fail++;
-      continue;
+    if(Nreference_files > 0 || Manifest_file != NULL){
+      fprintf(stderr,"%s: -r and -M can't be used with -m, ignored\n",argv[0]);
+      Nreference_files = 0; /* Both need the whole table in memory */
+      Manifest_file = NULL;
     }
+    if(Cache_file != NULL)
+      fprintf(stderr,"%s: with -m the hash cache is only read, not updated\n",argv[0]);
+    spill_start();
+  }
+  if(Watch_flag && optind >= argc){
+    fprintf(stderr,"%s: -w needs the directories to watch on the command line\n",argv[0]);
+    exit(1);
+  }
+  if(Background_flag)
+    Uring_depth = 0; /* Deep queues of big reads are just what other users of the disk don't want */
+  monitor_start();
 
-#if DEBUG
-#ifdef __darwin__
-    {
-    fprintf(stderr," nlink %d; uid %d; gid %d; atime %ld.%09ld; mtime %ld.%09ld; ctime %ld.%09ld; size %lld; gen %d %s\n",
-	    ep->statbuf.st_nlink,ep->statbuf.st_uid,ep->statbuf.st_gid,
-	    ep->statbuf.st_atimespec.tv_sec,ep->statbuf.st_atimespec.tv_nsec,
-	    ep->statbuf.st_mtimespec.tv_sec,ep->statbuf.st_mtimespec.tv_nsec,
-	    ep->statbuf.st_ctimespec.tv_sec,ep->statbuf.st_ctimespec.tv_nsec,
-	    (long long)ep->statbuf.st_size,ep->statbuf.st_gen,pathname);
-    }
-#else
-    {
-    fprintf(stderr," nlink %d; uid %d; gid %d; atime %ld; mtime %ld; ctime %ld; size %lld %s\n",
-	    ep->statbuf.st_nlink,ep->statbuf.st_uid,ep->statbuf.st_gid,
-	    ep->statbuf.st_atime,
-	    ep->statbuf.st_mtime,
-	    ep->statbuf.st_ctime,
-	    (long long)ep->statbuf.st_size,pathname);
-    }
-#endif
-#endif
-    /* Ignore all but ordinary files */
-    switch(ep->statbuf.st_mode & S_IFMT){
-    case S_IFREG:
-      Regular_file++;
-      break;
-    case S_IFIFO:
-      FIFO++;
-      break;
-    case S_IFCHR:
-      Character_special++;
-      break;
-    case S_IFDIR:
-      Directory++;
-      break;
-    case S_IFBLK:
-      Block_special++;
-      break;
-    case S_IFLNK:
-      Symbolic_link++;
-      break;
-    case S_IFSOCK:
-      Socket++;
-      break;
-#ifdef S_IFWHT
-    case S_IFWHT:
-      Whiteout++; /* What's this? */
-      break;
-#endif
-    }
-    if((ep->statbuf.st_mode & S_IFMT) != S_IFREG)
-      continue;
+  /* Build the file table, either by walking the trees named on the command line
+   * or from the list of path names on stdin
+   */
+  if(optind < argc)
+    nfiles = walk_trees(&argv[optind],argc - optind,&entries);
+  else
+    nfiles = read_list(stdin,&entries);
+  Files_examined = Memory_budget > 0 ? Spill_total : nfiles;
+  if(auto_threads)
+    Hash_threads = device_threads(Hash_threads); /* Enough readers to keep every device busy */
 
-    /* Ignore empty files and files with no assigned data blocks (any data being stored in the inode).
-     * Zero size files are often used as flags and locks we don't want to upset. And we won't recover
-     * any data blocks from a file without any data blocks!
-     * I should also exclude HFS files on OSX with resource forks
-     */
-    if(ep->statbuf.st_blocks == 0 || ep->statbuf.st_size == 0){
-      Empty++;
-      continue;
-    }
-    /* Ignore files we can't read */
-    if(access(pathname,R_OK) == -1){
-      Not_accessible++;
-      continue;
-    }
-    /* Otherwise keep the filename and inode on our list */
-    ep->pathname = strdup(pathname);
-    nfiles++;
-  }
   if(!Quiet_flag){
     fprintf(stderr,"%s: input files: total %u; ordinary %u",argv[0],Total_files,Regular_file);
     if(FIFO)
@@ -319,7 +654,7 @@ int main(int argc,char *argv[]){
     if(Not_accessible)
       fprintf(stderr,"%s: files not accessible %u\n",argv[0],Not_accessible);
 
-    if(nfiles == 0){
+    if(nfiles == 0 && Spill_total == 0 && !Watch_flag){
       fprintf(stderr,"%s: no files left to examine\n",argv[0]);
       exit(0);
     }
@@ -327,311 +662,4717 @@ int main(int argc,char *argv[]){
   }
 #if DEBUG
   for(i=0;i<nfiles;i++){
-    fprintf(stderr,"%lld %s\n",(long long)entries[i].statbuf.st_size,entries[i].pathname);
+    char path[PATH_MAX+1];
+
+    fprintf(stderr,"%lld %s\n",(long long)entries[i].size,path_of(&entries[i],path));
   }
 #endif
 
   if(No_do){
     fprintf(stderr,"%s: dry run, no files will actually be unlinked\n",argv[0]);
   }
-  
-  /* Sort by file size/device/mod time/nlinks */
-  qsort(entries,nfiles,sizeof(struct entry),comparison_sort);
-  if(!Quiet_flag)
-    fprintf(stderr,"%s: sort done, %d entries\n",argv[0],nfiles);
-    
+  if(Cache_file != NULL)
+    cache_open(Cache_file);
+  for(i=0;i<Nreference_files;i++)
+    reference_open(Reference_files[i]);
+  hash_pool_start(Hash_threads);
+  uring_start(Uring_depth);
+  engine_start();
+
+  if(Memory_budget > 0){
+    /* The table went to sorted runs on disk as it was built; merge them a few size groups at a time */
+    phase_enter(PHASE_COMPARE);
+    external_merge();
+  } else {
+    if(Nreference_files > 0){
+      /* Files identical to ones in the reference sets are linked to those first */
+      phase_enter(PHASE_REFERENCE);
+      reference_scan(entries,nfiles);
+    }
+    /* Group by file size/device, then mod time/nlinks. Files with unique sizes are dropped */
+    phase_enter(PHASE_SORT);
+    ntotal = nfiles;
+    if(Chunk_flag)
+      nbig = chunk_candidates(entries,nfiles,&big);
+    if(Watch_flag || Manifest_file != NULL){
+      whole = (struct entry *)malloc((size_t)nfiles * sizeof(*whole) + 1);
+      assert(whole != NULL);
+      memcpy(whole,entries,(size_t)nfiles * sizeof(*whole));
+    }
+    nfiles = dupengine_group(&Engine,entries,nfiles);
+    if(!Quiet_flag)
+      fprintf(stderr,"%s: sort done, %d entries; %d in %lld same-size groups\n",argv[0],ntotal,nfiles,Engine.group.groups);
+
 #if DEBUG
-  for(i=0;i<nfiles;i++){
-    fprintf(stderr,"%lld %d %s\n",
-	    (long long)entries[i].statbuf.st_size,
-	    (int)entries[i].statbuf.st_nlink,
-	    entries[i].pathname);
-  }
-#endif
-  /* Walk through first of each group of files that are candidates for being the same
-   *  This is the reference file
-   */
-  for(i=0;i<nfiles-1;i++){
-    
-    /* Ignore hard links to earlier reference files */
-    if(entries[i].pathname == NULL)
-      continue;
+    for(i=0;i<nfiles;i++){
+      char path[PATH_MAX+1];
 
-    /* The qsort grouped together all files with the same size on the same device
-     * Scan forward for all files with the same size and device as the reference file
-     */
-    for(j=i+1;
-	j<nfiles
-	  && entries[i].statbuf.st_size == entries[j].statbuf.st_size
-	  && entries[i].statbuf.st_dev == entries[j].statbuf.st_dev;
-	j++){
-      
-      
-      /* Ignore hard links to earlier reference files */
-      if(entries[j].pathname == NULL)
-	continue;
+      fprintf(stderr,"%lld %d %s\n",
+	      (long long)entries[i].size,
+	      (int)entries[i].nlink,
+	      path_of(&entries[i],path));
+    }
+#endif
+    phase_enter(PHASE_COMPARE);
+    for(i=0;i<nfiles;i++)
+      Progress_total += entries[i].size;
+    dupengine_compare(&Engine,entries,nfiles);
+  }
+  if(Chunk_flag && !Budget_spent){
+    phase_enter(PHASE_CHUNK);
+    chunk_scan(big,nbig,entries,nfiles,ntotal);
+    free(big);
+  }
+  if(whole != NULL){
+    for(i=0;i<nfiles;i++)
+      whole[entries[i].id].gone = entries[i].gone; /* The table is numbered in order */
+    entries = whole; /* From now on, for the cache too */
+    nfiles = ntotal;
+  }
+  if(Watch_flag){
+    struct entry *table;
 
-      if(entries[i].statbuf.st_dev == entries[j].statbuf.st_dev
-	 && entries[i].statbuf.st_ino == entries[j].statbuf.st_ino){
-	/* Existing hard link to reference file; mark so we'll skip over it later */
-	free(entries[j].pathname);
-	entries[j].pathname = NULL;
-	continue;
-      }
-      if(comparison_equal(&entries[i],&entries[j]) == 0){
-	/* Distinct files with identical contents on same file system, can be linked */
-	if(!Quiet_flag){
-	  fprintf(stderr,"%s: %lld ln %s -> %s\n",argv[0],(long long)entries[j].statbuf.st_size,entries[j].pathname,entries[i].pathname);
-	  //	  fprintf(stderr,"debug: inodes %lld %lld\n",(long long)entries[j].statbuf.st_ino,(long long)entries[i].statbuf.st_ino);
-	}
-	if(entries[j].statbuf.st_nlink == 1){
-	  /* Pathname has single remaining link, so its blocks will be recovered */
-	  Blocks_reclaimed += entries[j].statbuf.st_blocks;
-	}
-	
-	{
-	  /* Some last minute paranoid checks */
-	  struct stat statbuf_a,statbuf_b;
-	  
-	  if(lstat(entries[i].pathname,&statbuf_a)){
-	    fprintf(stderr,"%s: can't lstat(%s): %d %s\n",argv[0],entries[i].pathname,errno,strerror(errno));
-	    abort();
-	  }
-	  if(lstat(entries[j].pathname,&statbuf_b)){
-	    fprintf(stderr,"%s: can't lstat(%s): %d %s\n",argv[0],entries[j].pathname,errno,strerror(errno));
-	    abort();
-	  }
-	  assert(statbuf_a.st_size == statbuf_b.st_size);
-	  assert(statbuf_a.st_ino != statbuf_b.st_ino);
-	  assert(statbuf_a.st_dev == statbuf_b.st_dev);
-	  assert(statbuf_a.st_mtime <= statbuf_b.st_mtime);
-	}
-	if(!No_do){
-	  if(unlink(entries[j].pathname)) {
-	    Unlink_failures++;
-	    fprintf(stderr,"%s: can't unlink(%s): %d %s\n",argv[0],entries[j].pathname,errno,strerror(errno));
-	  } else if(link(entries[i].pathname,entries[j].pathname)){
-	    /* Should never fail */
-	    fprintf(stderr,"%s: can't link(%s,%s): %d %s\n",argv[0],entries[i].pathname,entries[j].pathname,errno,strerror(errno));
-	    abort();
-	  }
-	}
-	/* Don't use this entry as a reference file later */
-	free(entries[j].pathname);
-	entries[j].pathname = NULL;
-	Unlinks++;
-      } /* if same */
-    } /* End of inner for() loop */
-  } /* end of for loop looking ahead for match with file i */
+    phase_enter(PHASE_WATCH);
+    nfiles = watch_trees(&argv[optind],argc - optind,entries,nfiles,&table);
+    free(whole);
+    entries = table; /* Now the index */
+  }
+  if(Manifest_file != NULL){
+    phase_enter(PHASE_MANIFEST);
+    manifest_write(Manifest_file,entries,nfiles);
+  }
   if(!Quiet_flag){
     if(No_do)
       fprintf(stderr,"%s: This was a dry run; no files were actually unlinked.\n",argv[0]);
-    if(Unlinks)
+    if(Unlinks || Dedupe_files)
       fprintf(stderr,"%s: Unlinks: %llu; Unlink failures: %llu; disk blocks reclaimed: %llu\n",argv[0],Unlinks,Unlink_failures,Blocks_reclaimed);
+    if(Dedupe_flag)
+      fprintf(stderr,"%s: Deduped files: %llu; bytes shared: %llu; changed since compared: %llu; linked instead: %llu\n",
+	      argv[0],Dedupe_files,Dedupe_bytes,Dedupe_differs,Dedupe_fallbacks);
+    if(Chunk_flag){
+      fprintf(stderr,"%s: Chunked files: %llu; bytes: %llu; chunks: %llu (%s)\n",
+	      argv[0],Chunk_nfiles,Chunk_bytes,Chunk_count,fastcdc_implementation());
+      fprintf(stderr,"%s: Shared chunks: %llu; bytes: %llu",argv[0],Chunk_shared,Chunk_shared_bytes);
+      if(Dedupe_flag)
+	fprintf(stderr,"; bytes deduped: %llu; not block aligned: %llu",Chunk_deduped_bytes,Chunk_unaligned_bytes);
+      putc('\n',stderr);
+    }
 
-    fprintf(stderr,"%s: First page hashes: %llu; hits %llu\n",argv[0],Block_hashes_computed,Block_hash_hits);
-    fprintf(stderr,"%s: Full file hashes: %llu; hits: %llu; full file hash mismatches: %llu; map fails: %llu\n",argv[0],Full_hashes_computed,Full_hash_hits,Partial_hit_full_fail,Map_fails);
+#ifdef USE_SHA1
+    fprintf(stderr,"%s: Hash: %s\n",argv[0],HASHNAME);
+#else
+    fprintf(stderr,"%s: Hash: %s (%s)\n",argv[0],HASHNAME,blake3_implementation());
+#endif
+    fprintf(stderr,"%s: First page hashes: %llu; hits %llu; small files read whole %llu\n",argv[0],Block_hashes_computed,Block_hash_hits,Small_files);
+    if(Sample_hashes[0])
+      fprintf(stderr,"%s: Last page hashes: %llu; hits %llu; files told apart %llu\n",argv[0],Sample_hashes[0],Sample_hits[0],Sample_rejects[0]);
+    if(Sample_hashes[1])
+      fprintf(stderr,"%s: Sampled page hashes: %llu; hits %llu; files told apart %llu\n",argv[0],Sample_hashes[1],Sample_hits[1],Sample_rejects[1]);
+    fprintf(stderr,"%s: Full file hashes: %llu; hits: %llu; full file hash mismatches: %llu; map fails: %llu; hashed as trees: %llu\n",argv[0],Full_hashes_computed,Full_hash_hits,Partial_hit_full_fail,Map_fails,Tree_hashes);
+    if(Stream_compares)
+      fprintf(stderr,"%s: Lockstep comparisons: %llu; bytes read: %llu\n",argv[0],Stream_compares,Stream_bytes);
+    if(Time_budget > 0 || Byte_budget > 0)
+      fprintf(stderr,"%s: Budget %s; size groups left unexamined: %llu\n",argv[0],Budget_spent ? "spent" : "not spent",
+	      Engine.stats.groups_skipped);
+    if(Nreference_files > 0)
+      fprintf(stderr,"%s: Reference sets: %d; files in them: %llu; files linked to them: %llu; changed since: %llu\n",
+	      argv[0],Nreference_files,Reference_records,Reference_matches,Reference_stale);
+    if(Watch_flag)
+      fprintf(stderr,"%s: Watched directories: %llu; new files checked: %llu; event queue overflows: %llu\n",
+	      argv[0],Watch_ndirs,Watch_files,Watch_overflows);
+    if(Physical_flag)
+      fprintf(stderr,"%s: Files read in disk order: %llu; disk address unknown: %llu\n",argv[0],Physical_found,Physical_unknown);
+    if(Cache_file != NULL)
+      fprintf(stderr,"%s: Hash cache hits: %llu\n",argv[0],Cache_hits);
+    if(Background_flag)
+      fprintf(stderr,"%s: Background: bytes found in cache: %llu; held back by rate limits %.1f s; paused for pressure %.1f s; backoffs: %llu\n",
+	      argv[0],Background_cached,Throttle_wait,Pressure_wait,Pressure_backoffs);
   }
-  /* Not really necessary since we're exiting */
-  free(entries);
+  if(Cache_file != NULL && Memory_budget == 0){
+    phase_enter(PHASE_CACHE);
+    cache_save(Cache_file,entries,nfiles);
+  }
+  phase_enter(NPHASES); /* Done */
+  if(Report_file != NULL)
+    report_write(Report_file);
   exit(0);
 }
 
-
-/* Compare files by size (used by second sort)
- * Return 0 means same size *and* on same device
- * Returning <0 causes the first argument to sort toward the top of the list
- * Returning >0 causes the second argument to sort toward the top of the list
-
- * We want the largest files to go to the top of the list, so "smaller is greater".
- * We also want empty entries to go to the end of the list, so they are always "greater" 
+/* The engine groups the table and walks through its groups, each a set of files that are candidates for being
+ * the same: dupgroup_sort() (or external_merge()) put together all files with the same size on the same device.
+ * What's dupmerge's own is the comparer, which reads and hashes the files, and the action sink, which links or
+ * dedupes them
  */
-int comparison_sort(const void *ap,const void *bp){
-  struct entry *a,*b;
+void engine_start(void){
+  dupengine_init(&Engine);
+  Engine.group.small_first = Small_first;
+  Engine.group.blocks = file_blocks;
+  Engine.reclaim_first = Reclaim_first;
+  Engine.comparer.begin = compare_begin;
+  Engine.comparer.start = compare_start;
+  Engine.comparer.compare = compare_files;
+  Engine.action.merge = merge;
+  Engine.action.done = merge_done;
+  Engine.action.finish = merge_finish;
+}
 
-  a = (struct entry *)ap;
-  b = (struct entry *)bp;
+static int Prefetched; /* Entries of the table being compared before this index have been hashed by the pool */
 
-  assert(a != NULL);
-  assert(b != NULL);
+void compare_begin(void *arg,struct entry *entries,int nfiles){
+  Prefetched = 0;
+}
 
-  if(a == b)
-    return 0; /* Can this happen? */
+/* Skip the group if the budget has run out, unless the pool has already read its hashes;
+ * otherwise hash the next run of size groups in parallel before comparing them
+ */
+int compare_start(void *arg,struct entry *entries,int first,int end,int nfiles){
+  int k;
 
-  /* Push all invalid entries to the bottom of the sort */
-  if(!b->pathname && !a->pathname)
-    return 0;
-  if(!b->pathname)
-    return -1;
-  if(!a->pathname)
+  if((Time_budget > 0 || Byte_budget > 0) && first >= Prefetched && budget_spent())
     return 1;
+  if(Hash_threads > 1 && first >= Prefetched)
+    Prefetched = prefetch_hashes(entries,first,nfiles);
+  for(k=first;k<end;k++)
+    alloc_hashes(&entries[k]);
+  return 0;
+}
 
-  /* Distinguish first by size.
-   * By default, bigger files sort first unless overridden with -s option
-   */
-  if(b->statbuf.st_size != a->statbuf.st_size){
-    if(Small_first)
-      return a->statbuf.st_size - b->statbuf.st_size;
-    else
-      return b->statbuf.st_size - a->statbuf.st_size;
-  }
-  /* Files are same size; distinguish if on different device; ordering is unimportant */
-  if(b->statbuf.st_dev != a->statbuf.st_dev)
-    return b->statbuf.st_dev - a->statbuf.st_dev;
-
-  /* Same size, same device; distinguish by modification time, older files first */
-  if(a->statbuf.st_mtime != b->statbuf.st_mtime)
-    return a->statbuf.st_mtime - b->statbuf.st_mtime;
+void compare_files(void *arg,dupengine *e,struct entry *group,int n){
+  if(Fast_flag && group[0].size > Fast_threshold)
+    scan_pairwise(e,group,n);
+  else
+    scan_buckets(e,group,n);
+  if(Memory_budget == 0)
+    Progress_done += n * group[0].size; /* external_merge() counts as it reads */
+}
 
-  /* Order equal, same time files with fewer links later so they'll be preferentially deleted sooner */
-  if(a->statbuf.st_nlink != b->statbuf.st_nlink)
-    return b->statbuf.st_nlink - a->statbuf.st_nlink;
+void merge_done(void *arg,struct entry *group,int n){
+  double t = now_seconds();
 
-  /* Same size, same device, same modification time, same number of links; includes case of two links to same inode */
-  return 0;
+  dedupe_flush();
+  Phase_time[PHASE_LINK] += now_seconds() - t;
 }
 
+void merge_finish(void *arg){
+  relink_flush(); /* The links queued are to entries that may not outlast the table, with -m */
+}
 
-void get_small_hash(struct entry *ep);
-void get_big_hash(struct entry *ep);
+/* Has the time or the reading allowed by -L run out? Checked before each group is started */
+int budget_spent(void){
+  if(!Budget_spent && ((Time_budget > 0 && now_seconds() - Run_started >= Time_budget)
+		       || (Byte_budget > 0 && Bytes_hashed + Stream_bytes >= Byte_budget))){
+    Budget_spent = YES;
+    if(!Quiet_flag)
+      fprintf(stderr,"%s: budget spent after %.1f s and %lld bytes read; no more groups will be started\n",
+	      Myname,now_seconds() - Run_started,Bytes_hashed + Stream_bytes);
+  }
+  return Budget_spent;
+}
 
-int comparison_equal(const void *ap,const void *bp){
-  struct entry *a,*b;
+/* Read the list of path names on fp into a new file table, returning the number of entries
+ * Check each one and ignore non-regular files, zero-length files, special files, errors, etc
+ */
+int read_list(FILE *fp,struct entry **entriesp){
   int i;
+  struct entry *entries = NULL; /* Dynamically allocated file table */
+  struct entry *ep,spill_entry;
+  struct file *filep,spill_file; /* With -m, each file goes straight to spill_batch() from these */
+  size_t entryarraysize = 0; /* Start with empty table, allocate on first pass */
+  struct arena arena = {NULL,0};
+  char lastdir[PATH_MAX+1]; /* Directory of the previous file, usually shared with this one */
+  size_t lastdirlen = 0;
+  unsigned int dir = 0;
+  dev_t lastdev = 0;
+  unsigned short dev = 0;
+  int nfiles;
 
-  a = (struct entry *)ap;
-  b = (struct entry *)bp;
+  ep = NULL;
+  lastdir[0] = '\0';
+  for(nfiles=0;!feof(fp) && !ferror(fp);){
+    int ch;
+    char pathname[PATH_MAX+1];
+    struct stat statbuf;
+    char *name;
 
-  if(a == b)
-    return 0; /* Can this happen? */
+    /* Expand file table if necessary */
+    if(Memory_budget > 0){
+      ep = &spill_entry;
+      filep = &spill_file;
+    } else {
+      entries = (struct entry *)table_grow(entries,&entryarraysize,nfiles + 1,sizeof(struct entry));
+      Files = (struct file *)table_grow(Files,&Files_allocated,nfiles + 1,sizeof(struct file));
+      ep = &entries[nfiles];
+      filep = &Files[nfiles];
+    }
+    for(i=0;i< PATH_MAX;i++){
+      
+      if(EOF == (ch = getc(fp)) || '\0' == ch || (!Zero_flag && '\n' == ch))
+	break;
 
-  assert(a != NULL);
-  assert(b != NULL);
+      pathname[i] = ch;
+    }      
+    if(ch == EOF)
+      break;
 
-  if(a->statbuf.st_dev == b->statbuf.st_dev && a->statbuf.st_ino == b->statbuf.st_ino)
-    return 0; /* Files are already hard-linked, so they're the same */
+    pathname[i] = '\0';
 
-  /* Make file size the most significant part of the comparison */
-  if(b->statbuf.st_size != a->statbuf.st_size)
-    return b->statbuf.st_size - a->statbuf.st_size;
+    Total_files++;
 
-  /* Same-size files sort together only when they're on the same device */
-  if(b->statbuf.st_dev != a->statbuf.st_dev)
-    return b->statbuf.st_dev - a->statbuf.st_dev;
+    /* Ignore null file names */
+    if(strlen(pathname) == 0){
+      Null_pathname++;
+      continue; /* Reuse entry for next file */
+    }
+    /* If we can't stat it, ignore it */
+    if(lstat(pathname,&statbuf) != 0){
+      Stat_fail++;
+      continue;
+    }
 
+#if DEBUG
+#ifdef __darwin__
+    {
+    fprintf(stderr," nlink %d; uid %d; gid %d; atime %ld.%09ld; mtime %ld.%09ld; ctime %ld.%09ld; size %lld; gen %d %s\n",
+	    statbuf.st_nlink,statbuf.st_uid,statbuf.st_gid,
+	    statbuf.st_atimespec.tv_sec,statbuf.st_atimespec.tv_nsec,
+	    statbuf.st_mtimespec.tv_sec,statbuf.st_mtimespec.tv_nsec,
+	    statbuf.st_ctimespec.tv_sec,statbuf.st_ctimespec.tv_nsec,
+	    (long long)statbuf.st_size,statbuf.st_gen,pathname);
+    }
+#else
+    {
+    fprintf(stderr," nlink %d; uid %d; gid %d; atime %ld; mtime %ld; ctime %ld; size %lld %s\n",
+	    statbuf.st_nlink,statbuf.st_uid,statbuf.st_gid,
+	    statbuf.st_atime,
+	    statbuf.st_mtime,
+	    statbuf.st_ctime,
+	    (long long)statbuf.st_size,pathname);
+    }
+#endif
+#endif
+    /* Ignore all but ordinary files */
+    count_type(statbuf.st_mode);
+    if((statbuf.st_mode & S_IFMT) != S_IFREG)
+      continue;
 
-  /* Optionally use the rsync heuristic -- if the files have the same size, mod timestamp and
-   * the same base name, declare them the same without actually reading the contents
-   * Do this only on files larger than Fast_threshold to further reduce chances of false equality
-   */
-  if(Fast_flag && a->statbuf.st_size > Fast_threshold){	/* Rsync-style fast comparison */
-    char *bn1,*bn2;
-    
-    /* I could use the built-in basename() function, but what a mess it is */
-    if((bn1 = strrchr(a->pathname,'/')) == NULL)
-      bn1 = a->pathname;
-    if((bn2 = strrchr(b->pathname,'/')) == NULL)
-      bn2 = b->pathname;
-    
-    /* Are the basenames and mod times identical? */
-    if(0 == strcmp(bn1,bn2) && a->statbuf.st_mtime == b->statbuf.st_mtime)
-      return 0;
+    /* Ignore empty files and files with no assigned data blocks (any data being stored in the inode).
+     * Zero size files are often used as flags and locks we don't want to upset. And we won't recover
+     * any data blocks from a file without any data blocks!
+     * I should also exclude HFS files on OSX with resource forks
+     */
+    if(statbuf.st_blocks == 0 || statbuf.st_size == 0){
+      Empty++;
+      continue;
+    }
+    /* Ignore files we can't read */
+    if(access(pathname,R_OK) == -1){
+      Not_accessible++;
+      continue;
+    }
+    /* Otherwise keep the filename and inode on our list */
+    if(nfiles == 0 || statbuf.st_dev != lastdev){
+      lastdev = statbuf.st_dev;
+      dev = dev_index(lastdev);
+    }
+    entry_fill(ep,filep,&statbuf,dev);
+    ep->id = nfiles;
+    if(Memory_budget > 0){
+      filep->name = pathname; /* Whole path, copied straight into the run being built */
+      spill_batch(ep,filep,1);
+      continue;
+    }
+    /* Directory part, up to and including the last slash */
+    name = strrchr(pathname,'/');
+    name = name != NULL ? name + 1 : pathname;
+    if(nfiles == 0 || name - pathname != lastdirlen || memcmp(pathname,lastdir,lastdirlen) != 0){
+      lastdirlen = name - pathname;
+      memcpy(lastdir,pathname,lastdirlen);
+      dir = dir_index(pathname,lastdirlen,&arena);
+    }
+    filep->dir = dir;
+    filep->name = arena_strdup(&arena,name,strlen(name));
+    nfiles++;
   }
+  Files_used = nfiles;
+  *entriesp = entries;
+  return nfiles;
+}
 
-  /* Next order of business: compare the partial file hashes */
-  if(!a->partialhash_present){
-    get_small_hash(a);
-  } else
-    Block_hash_hits++;
+/* Tally input files by type. The walker threads call this too */
+void count_type(mode_t mode){
+  switch(mode & S_IFMT){
+  case S_IFREG:
+    __atomic_add_fetch(&Regular_file,1,__ATOMIC_RELAXED);
+    break;
+  case S_IFIFO:
+    __atomic_add_fetch(&FIFO,1,__ATOMIC_RELAXED);
+    break;
+  case S_IFCHR:
+    __atomic_add_fetch(&Character_special,1,__ATOMIC_RELAXED);
+    break;
+  case S_IFDIR:
+    __atomic_add_fetch(&Directory,1,__ATOMIC_RELAXED);
+    break;
+  case S_IFBLK:
+    __atomic_add_fetch(&Block_special,1,__ATOMIC_RELAXED);
+    break;
+  case S_IFLNK:
+    __atomic_add_fetch(&Symbolic_link,1,__ATOMIC_RELAXED);
+    break;
+  case S_IFSOCK:
+    __atomic_add_fetch(&Socket,1,__ATOMIC_RELAXED);
+    break;
+#ifdef S_IFWHT
+  case S_IFWHT:
+    __atomic_add_fetch(&Whiteout,1,__ATOMIC_RELAXED); /* What's this? */
+    break;
+#endif
+  }
+}
 
-  if(!b->partialhash_present){
-    get_small_hash(b);
-  } else
-    Block_hash_hits++;
+/* File table storage. The tables grow geometrically rather than a fixed chunk at a time, so each entry is copied
+ * only a couple of times on average; on Linux mremap() moves the pages without copying them at all.
+ * Path names are split at the last slash: each directory name is stored once, and each file keeps only its
+ * last component and the directory's index.
+ */
+static pthread_mutex_t Table_mutex = PTHREAD_MUTEX_INITIALIZER; /* For Dirs[] and Devices[] */
+static size_t Dirs_allocated;
+static unsigned int Ndirs;
+static int Ndevices;
+static int Nhashes_left;
+static struct hashes *Hashes_next;
 
-  i = memcmp(a->partialhash,b->partialhash,HASHSIZE);
-  if(i != 0) /* They differ, no need to continue */
-    return i;
+static long long timespec_ns(const struct timespec *ts){
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
 
-  /* Partial hashes are the same, compare full file hashes */
-  if(!a->filehash_present){
-    get_big_hash(a);
-  } else 
-    Full_hash_hits++;
+#ifdef __APPLE__
+#define MTIME_NS(sb) timespec_ns(&(sb)->st_mtimespec)
+#define CTIME_NS(sb) timespec_ns(&(sb)->st_ctimespec)
+#else
+#define MTIME_NS(sb) timespec_ns(&(sb)->st_mtim)
+#define CTIME_NS(sb) timespec_ns(&(sb)->st_ctim)
+#endif
 
-  if(!b->filehash_present){
-    get_big_hash(b);
-  } else
-    Full_hash_hits++;
+void *table_grow(void *table,size_t *allocated,size_t n,size_t size){
+  size_t want = *allocated > 0 ? *allocated : 65536;
 
-  i = memcmp(a->filehash,b->filehash,HASHSIZE);
-  if(i != 0){
-    Partial_hit_full_fail++;
-    return i;
+  while(want < n)
+    want *= 2;
+  if(want == *allocated)
+    return table;
+#ifdef MREMAP_MAYMOVE
+  if(table == NULL)
+    table = mmap(NULL,want * size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  else
+    table = mremap(table,*allocated * size,want * size,MREMAP_MAYMOVE);
+  assert(table != MAP_FAILED);
+#else
+  table = realloc(table,want * size);
+  assert(table != NULL);
+#endif
+  *allocated = want;
+  return table;
+}
+
+/* Copy len bytes of s, plus a null, into arena a. Each thread has its own arena */
+const char *arena_strdup(struct arena *a,const char *s,size_t len){
+  char *p;
+
+  if(len + 1 > a->left){
+    a->left = len + 1 > ARENA_CHUNK ? len + 1 : ARENA_CHUNK;
+    a->next = (char *)malloc(a->left);
+    assert(a->next != NULL);
   }
-  return 0; /* We've passed the gauntlet; the files are the same! */
+  p = a->next;
+  memcpy(p,s,len);
+  p[len] = '\0';
+  a->next += len + 1;
+  a->left -= len + 1;
+  return p;
 }
 
-void get_small_hash(struct entry *ep){
-  if(!ep->filehash_present){
-    int fd,i,len;
-    void *p;
+/* Add a directory name to Dirs[], returning its index */
+unsigned int dir_index(const char *path,size_t len,struct arena *a){
+  const char *copy = arena_strdup(a,path,len);
+  unsigned int i;
+
+  pthread_mutex_lock(&Table_mutex);
+  Dirs = (const char **)table_grow(Dirs,&Dirs_allocated,Ndirs + 1,sizeof(*Dirs));
+  i = Ndirs++;
+  Dirs[i] = copy;
+  pthread_mutex_unlock(&Table_mutex);
+  return i;
+}
+
+/* Index of dev in Devices[], adding it if it's new */
+unsigned short dev_index(dev_t dev){
+  int i;
 
-    Block_hashes_computed++;
-    if((fd = open(ep->pathname,O_RDONLY)) == -1){
-      fprintf(stderr,"can't open(%s): %d %s\n",ep->pathname,errno,strerror(errno));
+  pthread_mutex_lock(&Table_mutex);
+  for(i=0;i<Ndevices && Devices[i] != dev;i++)
+    ;
+  if(i == Ndevices){
+    if(Ndevices > USHRT_MAX){
+      fprintf(stderr,"%s: too many file systems\n",Myname);
       abort();
     }
-    assert(fd != -1);
-    len = ep->statbuf.st_size > PAGESIZE ? PAGESIZE : ep->statbuf.st_size;
-    p = mmap(NULL, len, PROT_READ, MAP_NOCACHE|MAP_FILE|MAP_SHARED, fd, 0);
-    assert(p != MAP_FAILED); /* No reason for it to fail */
-    SHA1(p,len,ep->partialhash);
-    i = munmap(p,len);
-    assert(i == 0);
-    i = close(fd);
-    assert(i == 0);
-    ep->partialhash_present = 1;
+    Devices[Ndevices++] = dev;
   }
+  pthread_mutex_unlock(&Table_mutex);
+  return i;
 }
 
-void get_big_hash(struct entry *ep){
+/* Fill in a file table entry from what stat() said */
+void entry_fill(struct entry *ep,struct file *fp,const struct stat *sb,unsigned short dev){
+  memset(ep,0,sizeof(*ep));
+  memset(fp,0,sizeof(*fp));
+  ep->size = sb->st_size;
+  ep->ino = sb->st_ino;
+  ep->mtime = MTIME_NS(sb);
+  ep->nlink = sb->st_nlink;
+  ep->dev = dev;
+  fp->ctime = CTIME_NS(sb);
+  fp->blocks = (sb->st_blocks + 7) / 8 < (1LL << 31) ? (sb->st_blocks + 7) / 8 : (1LL << 31) - 1;
+}
 
-  if(!ep->filehash_present){
-    int fd,i;
-    void *p;
+/* The full path name of a file, assembled in buf, which must hold PATH_MAX+1 bytes */
+char *path_of(const struct entry *ep,char *buf){
+  const struct file *fp = &Files[ep->id];
+  const char *dir = Dirs[fp->dir];
+  size_t dlen = strlen(dir);
+  size_t nlen = strlen(fp->name);
 
-    Full_hashes_computed++;
-    if((fd = open(ep->pathname,O_RDONLY)) == -1){
-      fprintf(stderr,"can't open(%s): %d %s\n",ep->pathname,errno,strerror(errno));
-      abort();
+  assert(dlen + nlen + 1 <= PATH_MAX);
+  memcpy(buf,dir,dlen);
+  if(dlen > 0 && dir[dlen-1] != '/')
+    buf[dlen++] = '/';
+  memcpy(buf + dlen,fp->name,nlen + 1);
+  return buf;
+}
+
+/* Space allocated to a file, in bytes */
+long long file_blocks(const struct entry *ep,void *arg){
+  return 4096LL * Files[ep->id].blocks;
+}
+
+/* A new record at the end of Files[], for a file not in the table built at the start; returns its id.
+ * Main thread only, once the table is built
+ */
+unsigned int file_new(void){
+  Files = (struct file *)table_grow(Files,&Files_allocated,Files_used + 1,sizeof(struct file));
+  memset(&Files[Files_used],0,sizeof(struct file));
+  return Files_used++;
+}
+
+/* Give ep somewhere to keep its hashes. Only files in a size group ever need them. Main thread only */
+void alloc_hashes(struct entry *ep){
+  if(HASHES(ep) != NULL)
+    return;
+  if(Nhashes_left == 0){
+    Nhashes_left = 4096;
+    Hashes_next = (struct hashes *)calloc(Nhashes_left,sizeof(struct hashes));
+    assert(Hashes_next != NULL);
+  }
+  HASHES(ep) = Hashes_next++;
+  Nhashes_left--;
+}
+
+/* Parallel directory walker, used when directories are given on the command line instead of a list on stdin.
+ * Each directory is opened with openat() relative to its parent's descriptor and read with getdents64(),
+ * so no path is ever resolved from the root again; only the inode fields we need are fetched, with statx().
+ * Subdirectories go on a shared queue while it's short enough to need feeding, otherwise the thread
+ * that found them descends into them itself.
+ */
+#define WALK_BUFSIZE 65536	/* getdents64() buffer */
+#define WALK_BATCH 1024		/* Entries collected per thread before they're added to the file table */
+#define WALK_MAXDEPTH 64	/* Descend no deeper while holding parent directory descriptors open */
+#define WALK_PATHBYTES (256*1024)	/* With -m, path name space per batch */
+
+struct walkjob {
+  struct walkjob *next;
+  int fd;			/* Open directory, or -1 to open path */
+  char *path;
+};
+
+static pthread_mutex_t Walk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Walk_wakeup = PTHREAD_COND_INITIALIZER;
+static struct walkjob *Walk_queue;
+static int Walk_queued;
+static int Walk_active;		/* Threads working on a directory */
+static struct entry *Walk_entries;	/* The file table being built */
+static int Walk_nfiles;
+static size_t Walk_arraysize;
+
+struct walker {
+  struct entry batch[WALK_BATCH];
+  struct file files[WALK_BATCH];
+  int nbatch;
+  struct arena arena;		/* For names */
+  const char *dirpath;		/* Directory being read */
+  int dir;			/* Its index in Dirs[], or -1 until a file in it is kept */
+  dev_t lastdev;		/* Device of the last file kept, and its index */
+  int devindex;
+  char *paths;			/* With -m, whole path names for the batch instead of Dirs[] and names */
+  size_t pathsused;
+};
+
+static void walk_push(int fd,char *path){
+  struct walkjob *job = (struct walkjob *)malloc(sizeof(*job));
+
+  assert(job != NULL);
+  job->fd = fd;
+  job->path = path;
+  pthread_mutex_lock(&Walk_mutex);
+  job->next = Walk_queue;
+  Walk_queue = job;
+  Walk_queued++;
+  pthread_cond_signal(&Walk_wakeup);
+  pthread_mutex_unlock(&Walk_mutex);
+}
+
+/* Move a thread's batch of entries into the file table */
+static void walk_flush(struct walker *w){
+  int i;
+
+  if(w->nbatch == 0)
+    return;
+  pthread_mutex_lock(&Walk_mutex);
+  if(Memory_budget > 0){
+    spill_batch(w->batch,w->files,w->nbatch);
+    pthread_mutex_unlock(&Walk_mutex);
+    w->nbatch = 0;
+    w->pathsused = 0;
+    return;
+  }
+  Walk_entries = (struct entry *)table_grow(Walk_entries,&Walk_arraysize,Walk_nfiles + w->nbatch,sizeof(struct entry));
+  Files = (struct file *)table_grow(Files,&Files_allocated,Walk_nfiles + w->nbatch,sizeof(struct file));
+  for(i=0;i<w->nbatch;i++)
+    w->batch[i].id = Walk_nfiles + i;
+  memcpy(&Walk_entries[Walk_nfiles],w->batch,w->nbatch * sizeof(struct entry));
+  memcpy(&Files[Walk_nfiles],w->files,w->nbatch * sizeof(struct file));
+  Walk_nfiles += w->nbatch;
+  Files_used = Walk_nfiles;
+  pthread_mutex_unlock(&Walk_mutex);
+  w->nbatch = 0;
+}
+
+static char *path_join(const char *dir,const char *name){
+  size_t dlen = strlen(dir);
+  size_t nlen = strlen(name);
+  char *path = (char *)malloc(dlen + nlen + 2);
+
+  assert(path != NULL);
+  memcpy(path,dir,dlen);
+  if(dlen > 0 && dir[dlen-1] != '/')
+    path[dlen++] = '/';
+  memcpy(path + dlen,name,nlen + 1);
+  return path;
+}
+
+/* lstat() name relative to dirfd, fetching only what the file table uses */
+static int walk_stat(int dirfd,const char *name,struct stat *sb){
+#ifdef STATX_TYPE
+  struct statx stx;
+
+  if(statx(dirfd,name,AT_SYMLINK_NOFOLLOW|AT_NO_AUTOMOUNT,
+	   STATX_TYPE|STATX_NLINK|STATX_INO|STATX_SIZE|STATX_BLOCKS|STATX_MTIME|STATX_CTIME,&stx) == 0){
+    memset(sb,0,sizeof(*sb));
+    sb->st_mode = stx.stx_mode;
+    sb->st_nlink = stx.stx_nlink;
+    sb->st_ino = stx.stx_ino;
+    sb->st_dev = makedev(stx.stx_dev_major,stx.stx_dev_minor);
+    sb->st_size = stx.stx_size;
+    sb->st_blocks = stx.stx_blocks;
+    sb->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    sb->st_ctim.tv_sec = stx.stx_ctime.tv_sec; /* For the hash cache */
+    sb->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+    return 0;
+  }
+  if(errno != ENOSYS)
+    return -1;
+#endif
+  return fstatat(dirfd,name,sb,AT_SYMLINK_NOFOLLOW);
+}
+
+static void walk_dir(struct walker *w,int fd,const char *path,int depth);
+
+/* Look at one name in directory dirfd; d_type is a DT_ value, possibly DT_UNKNOWN */
+static void walk_name(struct walker *w,int dirfd,const char *dirpath,const char *name,int d_type,int depth){
+  struct stat statbuf;
+  char *path;
+  int fd;
+
+  __atomic_add_fetch(&Total_files,1,__ATOMIC_RELAXED);
+
+  /* The directory entry type saves a stat() on everything but ordinary files */
+  switch(d_type){
+  case DT_DIR:
+    count_type(S_IFDIR);
+    break;
+  case DT_FIFO:
+    count_type(S_IFIFO);
+    return;
+  case DT_CHR:
+    count_type(S_IFCHR);
+    return;
+  case DT_BLK:
+    count_type(S_IFBLK);
+    return;
+  case DT_LNK:
+    count_type(S_IFLNK);
+    return;
+  case DT_SOCK:
+    count_type(S_IFSOCK);
+    return;
+  default: /* DT_REG, or a filesystem that doesn't say */
+    if(walk_stat(dirfd,name,&statbuf) != 0){
+      __atomic_add_fetch(&Stat_fail,1,__ATOMIC_RELAXED);
+      return;
     }
-    assert(fd != -1);
-    p = mmap(NULL, ep->statbuf.st_size, PROT_READ, MAP_NOCACHE|MAP_FILE|MAP_SHARED|MAP_POPULATE, fd, 0);
-    if(p != MAP_FAILED){
-      SHA1(p,ep->statbuf.st_size,ep->filehash);
-      i = munmap(p,ep->statbuf.st_size);
-      assert(i == 0);
-    } else { /* Not enough address space to map entire file? */
-      unsigned long len;
-      SHA_CTX context;
-      char buffer[PAGESIZE];
+    count_type(statbuf.st_mode);
+    if((statbuf.st_mode & S_IFMT) == S_IFDIR)
+      break;
+    if((statbuf.st_mode & S_IFMT) != S_IFREG)
+      return;
+    if(statbuf.st_blocks == 0 || statbuf.st_size == 0){
+      __atomic_add_fetch(&Empty,1,__ATOMIC_RELAXED);
+      return;
+    }
+    if(faccessat(dirfd,name,R_OK,0) == -1 || strlen(dirpath) + strlen(name) + 1 > PATH_MAX){
+      __atomic_add_fetch(&Not_accessible,1,__ATOMIC_RELAXED);
+      return;
+    }
+    if(w->devindex == -1 || statbuf.st_dev != w->lastdev){
+      w->lastdev = statbuf.st_dev;
+      w->devindex = dev_index(w->lastdev);
+    }
+    if(w->paths != NULL){
+      /* External mode: nothing is kept in memory past the next flush */
+      if(w->pathsused + strlen(dirpath) + strlen(name) + 2 > WALK_PATHBYTES)
+	walk_flush(w);
+      entry_fill(&w->batch[w->nbatch],&w->files[w->nbatch],&statbuf,w->devindex);
+      path = path_join(dirpath,name);
+      w->files[w->nbatch].name = strcpy(w->paths + w->pathsused,path);
+      w->pathsused += strlen(path) + 1;
+      free(path);
+    } else {
+      if(w->dir == -1)
+	w->dir = dir_index(dirpath,strlen(dirpath),&w->arena);
+      entry_fill(&w->batch[w->nbatch],&w->files[w->nbatch],&statbuf,w->devindex);
+      w->files[w->nbatch].dir = w->dir;
+      w->files[w->nbatch].name = arena_strdup(&w->arena,name,strlen(name));
+    }
+    if(++w->nbatch == WALK_BATCH)
+      walk_flush(w);
+    return;
+  }
+  /* Directory */
+  path = path_join(dirpath,name);
+  if((fd = openat(dirfd,name,O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1){
+    fprintf(stderr,"%s: can't open directory %s: %d %s\n",Myname,path,errno,strerror(errno));
+    __atomic_add_fetch(&Not_accessible,1,__ATOMIC_RELAXED);
+    free(path);
+    return;
+  }
+  if(Walk_queued < 2 * Hash_threads){
+    walk_push(fd,path); /* Somebody may be waiting for work */
+  } else if(depth < WALK_MAXDEPTH){
+    walk_dir(w,fd,path,depth+1);
+    close(fd);
+    free(path);
+  } else {
+    close(fd); /* Don't run out of descriptors; reopen from the path later */
+    walk_push(-1,path);
+  }
+}
+
+static void walk_dir(struct walker *w,int fd,const char *path,int depth){
+  /* A subdirectory read in the middle of this one replaces the current directory; put it back after */
+  const char *saved_dirpath = w->dirpath;
+  int saved_dir = w->dir;
+#ifdef __linux__
+  char *buf = (char *)malloc(WALK_BUFSIZE);
+  long n,off;
+
+  assert(buf != NULL);
+  w->dirpath = path;
+  w->dir = -1;
+  while((n = getdents64(fd,buf,WALK_BUFSIZE)) > 0){
+    for(off=0;off < n;){
+      struct dirent64 *d = (struct dirent64 *)(buf + off);
+
+      off += d->d_reclen;
+      if(strcmp(d->d_name,".") == 0 || strcmp(d->d_name,"..") == 0)
+	continue;
+      walk_name(w,fd,path,d->d_name,d->d_type,depth);
+    }
+  }
+  if(n < 0)
+    fprintf(stderr,"%s: can't read directory %s: %d %s\n",Myname,path,errno,strerror(errno));
+  free(buf);
+#else
+  DIR *dirp;
+  struct dirent *d;
+  int dfd;
+
+  w->dirpath = path;
+  w->dir = -1;
+  /* closedir() would close fd, which belongs to the caller */
+  if((dfd = dup(fd)) == -1 || (dirp = fdopendir(dfd)) == NULL){
+    fprintf(stderr,"%s: can't read directory %s: %d %s\n",Myname,path,errno,strerror(errno));
+    if(dfd != -1)
+      close(dfd);
+  } else {
+    while((d = readdir(dirp)) != NULL){
+      if(strcmp(d->d_name,".") == 0 || strcmp(d->d_name,"..") == 0)
+	continue;
+      walk_name(w,fd,path,d->d_name,d->d_type,depth);
+    }
+    closedir(dirp);
+  }
+#endif
+  w->dirpath = saved_dirpath;
+  w->dir = saved_dir;
+}
+
+static struct walker *walker_new(void){
+  struct walker *w = (struct walker *)calloc(1,sizeof(struct walker));
+
+  assert(w != NULL);
+  w->dir = -1;
+  w->devindex = -1;
+  if(Memory_budget > 0){
+    w->paths = (char *)malloc(WALK_PATHBYTES);
+    assert(w->paths != NULL);
+  }
+  return w;
+}
+
+static void *walk_worker(void *arg){
+  struct walker *w = walker_new();
+  struct walkjob *job;
+
+  for(;;){
+    pthread_mutex_lock(&Walk_mutex);
+    while(Walk_queue == NULL && Walk_active > 0)
+      pthread_cond_wait(&Walk_wakeup,&Walk_mutex);
+    if(Walk_queue == NULL){
+      /* Nothing queued and nobody left to queue anything: done */
+      pthread_cond_broadcast(&Walk_wakeup);
+      pthread_mutex_unlock(&Walk_mutex);
+      break;
+    }
+    job = Walk_queue;
+    Walk_queue = job->next;
+    Walk_queued--;
+    Walk_active++;
+    pthread_mutex_unlock(&Walk_mutex);
+
+    if(job->fd == -1 && (job->fd = open(job->path,O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1){
+      fprintf(stderr,"%s: can't open directory %s: %d %s\n",Myname,job->path,errno,strerror(errno));
+      __atomic_add_fetch(&Not_accessible,1,__ATOMIC_RELAXED);
+    } else {
+      walk_dir(w,job->fd,job->path,0);
+      close(job->fd);
+    }
+    free(job->path);
+    free(job);
+
+    pthread_mutex_lock(&Walk_mutex);
+    if(--Walk_active == 0 && Walk_queue == NULL)
+      pthread_cond_broadcast(&Walk_wakeup);
+    pthread_mutex_unlock(&Walk_mutex);
+  }
+  walk_flush(w);
+  free(w->paths);
+  free(w);
+  return NULL;
+}
+
+/* Walk the named trees with Hash_threads threads into a new file table, returning the number of entries */
+int walk_trees(char *roots[],int nroots,struct entry **entriesp){
+  pthread_t *tids;
+  struct walker *w;
+  int i,nthreads;
+
+  w = walker_new();
+  w->dirpath = "";
+  /* The roots themselves, taken as given relative to the current directory. Like find, don't follow them
+   * if they're symbolic links
+   */
+  for(i=0;i<nroots;i++)
+    walk_name(w,AT_FDCWD,"",roots[i],DT_UNKNOWN,0);
+  walk_flush(w);
+  free(w->paths);
+  free(w);
+
+  nthreads = Hash_threads > 0 ? Hash_threads : 1;
+  tids = (pthread_t *)calloc(nthreads,sizeof(pthread_t));
+  assert(tids != NULL);
+  for(i=1;i<nthreads;i++){
+    if(pthread_create(&tids[i],NULL,walk_worker,NULL) != 0){
+      fprintf(stderr,"%s: can't create walker thread: %d %s\n",Myname,errno,strerror(errno));
+      nthreads = i;
+      break;
+    }
+  }
+  walk_worker(NULL);
+  for(i=1;i<nthreads;i++)
+    pthread_join(tids[i],NULL);
+  free(tids);
+
+  *entriesp = Walk_entries;
+  return Walk_nfiles;
+}
+
+/* Watch mode (-w). After the usual run, stay up and deal with files as they land in the trees, instead of
+ * walking, sorting and comparing everything again to catch a few new ones. Every file kept by the walk is in
+ * an index by device and size: a hash table of chains through Watch_next[]. Each directory of the trees has an
+ * inotify watch for files closed after writing and files renamed in (the usual way of delivering a file
+ * atomically); new directories get watches of their own, and what is already in them is looked at at once.
+ *
+ * A file that arrives is checked against the entries of its size only, so nothing is read unless its size
+ * matches another's, and then comparison_equal() reads only as much as it has to, as in the main run. Before
+ * an indexed entry is used, its path is checked with lstat(): if it no longer names the same unchanged inode
+ * (replaced, modified, or linked away in the meantime) the entry is retired and the new version, if any,
+ * comes in through its own event. The new file is kept in the index unless it was linked to an older copy.
+ *
+ * fanotify could watch whole file systems without a watch per directory, but needs CAP_SYS_ADMIN; inotify
+ * works for any user, up to fs.inotify.max_user_watches directories. If the kernel's event queue overflows,
+ * the files in it are missed until the next full run. SIGINT or SIGTERM ends the watch; the statistics,
+ * report and hash cache are then written as usual
+ */
+#ifdef __linux__
+#define WATCH_MASK (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_ONLYDIR|IN_DONT_FOLLOW|IN_EXCL_UNLINK)
+#define WATCH_BUFSIZE 65536
+
+static struct entry *Watch_entries;	/* Indexed files; ids into Files[] as usual */
+static size_t Watch_allocated;
+static int Watch_count;
+static int *Watch_next;			/* Chains of same-size entries */
+static size_t Watch_next_allocated;
+static int *Watch_slots;		/* Head of each chain, -1 if none */
+static unsigned int Watch_mask;		/* Slots - 1 */
+static unsigned int *Watch_dirs;	/* Dirs[] index by watch descriptor */
+static size_t Watch_dirs_allocated;
+static struct arena Watch_arena;
+static int Watch_fd = -1;
+static volatile sig_atomic_t Watch_stop;
+
+static unsigned int watch_slot(off_t size,unsigned short dev){
+  return (unsigned int)((((unsigned long long)size ^ ((unsigned long long)dev << 48)) * 0x9e3779b97f4a7c15ULL) >> 32) & Watch_mask;
+}
+
+/* Add Watch_entries[i] to its chain, doubling the table first if it's getting full */
+static void watch_insert(int i){
+  unsigned int slot;
+  int k;
+
+  if((unsigned int)Watch_count >= Watch_mask / 2){
+    Watch_mask = Watch_mask == 0 ? 4095 : 2 * Watch_mask + 1;
+    free(Watch_slots);
+    Watch_slots = (int *)malloc((Watch_mask + 1) * sizeof(*Watch_slots));
+    assert(Watch_slots != NULL);
+    memset(Watch_slots,0xff,(Watch_mask + 1) * sizeof(*Watch_slots));
+    Watch_count = 0;
+    for(k=0;k<i;k++)
+      watch_insert(k);
+  }
+  Watch_next = (int *)table_grow(Watch_next,&Watch_next_allocated,i + 1,sizeof(*Watch_next));
+  slot = watch_slot(Watch_entries[i].size,Watch_entries[i].dev);
+  Watch_next[i] = Watch_slots[slot];
+  Watch_slots[slot] = i;
+  Watch_count++;
+}
+
+/* Does ep's path still name the same file, with the same contents? Linking to it changes its ctime but not
+ * its data, so that's only brought up to date, for the cache
+ */
+static int watch_current(const struct entry *ep){
+  char path[PATH_MAX+1];
+  struct stat statbuf;
 
-      Map_fails++;
+  if(lstat(path_of(ep,path),&statbuf) != 0
+     || statbuf.st_ino != ep->ino
+     || statbuf.st_size != ep->size
+     || MTIME_NS(&statbuf) != ep->mtime)
+    return 0;
+  Files[ep->id].ctime = CTIME_NS(&statbuf);
+  return 1;
+}
+
+/* A file closed after writing, or moved in: name in directory Dirs[dir] */
+static void watch_file(unsigned int dir,const char *name){
+  char path[PATH_MAX+1];
+  struct stat statbuf;
+  struct entry *ep,*cp;
+  unsigned int id;
+  int i,k;
+  size_t dlen = strlen(Dirs[dir]);
+
+  if(dlen + strlen(name) + 1 > PATH_MAX)
+    return;
+  memcpy(path,Dirs[dir],dlen);
+  if(dlen > 0 && path[dlen-1] != '/')
+    path[dlen++] = '/';
+  strcpy(path + dlen,name);
+  if(lstat(path,&statbuf) != 0 || (statbuf.st_mode & S_IFMT) != S_IFREG
+     || statbuf.st_blocks == 0 || statbuf.st_size == 0 || access(path,R_OK) == -1)
+    return;
+  Watch_files++;
+
+  /* Seen already, e.g., closed again by a dedupe without being changed? */
+  for(k = Watch_slots[watch_slot(statbuf.st_size,dev_index(statbuf.st_dev))]; k != -1; k = Watch_next[k]){
+    cp = &Watch_entries[k];
+    if(Devices[cp->dev] == statbuf.st_dev && cp->ino == statbuf.st_ino && cp->size == statbuf.st_size
+       && cp->mtime == MTIME_NS(&statbuf))
+      return;
+  }
+  i = Watch_count;
+  Watch_entries = (struct entry *)table_grow(Watch_entries,&Watch_allocated,i + 1,sizeof(struct entry));
+  ep = &Watch_entries[i];
+  id = file_new();
+  entry_fill(ep,&Files[id],&statbuf,dev_index(statbuf.st_dev));
+  ep->id = id;
+  Files[ep->id].dir = dir;
+  Files[ep->id].name = arena_strdup(&Watch_arena,name,strlen(name));
+
+  for(k = Watch_slots[watch_slot(ep->size,ep->dev)]; k != -1; k = Watch_next[k]){
+    cp = &Watch_entries[k];
+    if(cp->gone || cp->size != ep->size || cp->dev != ep->dev)
+      continue;
+    if(cp->ino != ep->ino && !watch_current(cp)){
+      cp->gone = 1; /* Stale; its replacement, if any, has an event of its own */
+      continue;
+    }
+    alloc_hashes(cp);
+    alloc_hashes(ep);
+    if(comparison_equal(cp,ep) == 0){
+      /* Keep the older, as the main run does; either way the survivor stays indexed */
+      double link = Phase_time[PHASE_LINK],start = now_seconds();
+
+      if(!watch_current(ep))
+	break; /* Still being written after all */
+      if(cp->mtime <= ep->mtime)
+	dupengine_same(&Engine,cp,ep);
+      else
+	dupengine_same(&Engine,ep,cp);
+      dedupe_flush();
+      relink_flush(); /* Now, before the index can move */
+      Phase_time[PHASE_LINK] = link + now_seconds() - start;
+      Watch_link_time += now_seconds() - start;
+      break;
+    }
+  }
+  watch_insert(i);
+}
+
+/* Watch directory path, with Dirs[] index dir, and everything below it; files found in it are looked at
+ * too when it's new
+ */
+static void watch_dir(const char *path,unsigned int dir,int scan){
+  DIR *dirp;
+  struct dirent *d;
+  struct stat statbuf;
+  char *sub;
+  int wd;
+
+  if((wd = inotify_add_watch(Watch_fd,path,WATCH_MASK)) == -1){
+    if(errno == ENOSPC)
+      fprintf(stderr,"%s: out of inotify watches at %s; raise fs.inotify.max_user_watches\n",Myname,path);
+    else if(errno != ENOTDIR && errno != ENOENT)
+      fprintf(stderr,"%s: can't watch %s: %d %s\n",Myname,path,errno,strerror(errno));
+    return;
+  }
+  Watch_dirs = (unsigned int *)table_grow(Watch_dirs,&Watch_dirs_allocated,wd + 1,sizeof(*Watch_dirs));
+  Watch_dirs[wd] = dir;
+  Watch_ndirs++;
+  if((dirp = opendir(path)) == NULL)
+    return;
+  while((d = readdir(dirp)) != NULL){
+    if(strcmp(d->d_name,".") == 0 || strcmp(d->d_name,"..") == 0)
+      continue;
+    if(d->d_type == DT_DIR || (d->d_type == DT_UNKNOWN && fstatat(dirfd(dirp),d->d_name,&statbuf,AT_SYMLINK_NOFOLLOW) == 0
+				 && S_ISDIR(statbuf.st_mode))){
+      sub = path_join(path,d->d_name);
+      watch_dir(sub,dir_index(sub,strlen(sub),&Watch_arena),scan);
+      free(sub);
+    } else if(scan && (d->d_type == DT_REG || d->d_type == DT_UNKNOWN)){
+      watch_file(dir,d->d_name);
+    }
+  }
+  closedir(dirp);
+}
+
+static void watch_signal(int sig){
+  Watch_stop = 1;
+}
+
+/* Index entries[0..nfiles-1], the whole file table in id order with what the main run retired marked gone,
+ * then watch the trees until told to stop. Returns the index, for the hash cache, in *entriesp
+ */
+int watch_trees(char *roots[],int nroots,struct entry *entries,int nfiles,struct entry **entriesp){
+  struct sigaction sa;
+  struct pollfd pfd;
+  char *buf,*p;
+  const struct inotify_event *ev;
+  ssize_t n;
+  int i;
 
-      SHA1_Init(&context);
-      while((len = read(fd,buffer,PAGESIZE)) > 0){
-	SHA1_Update(&context,buffer,len);
+  Watch_entries = (struct entry *)table_grow(NULL,&Watch_allocated,nfiles + 1,sizeof(struct entry));
+  memcpy(Watch_entries,entries,nfiles * sizeof(struct entry));
+  for(i=0;i<nfiles;i++)
+    watch_insert(i);
+  if((Watch_fd = inotify_init1(IN_CLOEXEC)) == -1){
+    fprintf(stderr,"%s: can't start watching: %d %s\n",Myname,errno,strerror(errno));
+    *entriesp = Watch_entries;
+    return Watch_count;
+  }
+  for(i=0;i<nroots;i++)
+    watch_dir(roots[i],dir_index(roots[i],strlen(roots[i]),&Watch_arena),0);
+  if(!Quiet_flag)
+    fprintf(stderr,"%s: watching %llu directories, %d files indexed\n",Myname,Watch_ndirs,Watch_count);
+
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler = watch_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT,&sa,NULL);
+  sigaction(SIGTERM,&sa,NULL);
+  buf = (char *)malloc(WATCH_BUFSIZE);
+  assert(buf != NULL);
+  pfd.fd = Watch_fd;
+  pfd.events = POLLIN;
+  while(!Watch_stop){
+    /* The signal may go to another thread, so don't block for long */
+    if(poll(&pfd,1,1000) <= 0 || (n = read(Watch_fd,buf,WATCH_BUFSIZE)) <= 0)
+      continue;
+    for(p = buf; p < buf + n; p += sizeof(*ev) + ev->len){
+      ev = (const struct inotify_event *)p;
+      if(ev->mask & IN_Q_OVERFLOW){
+	Watch_overflows++;
+	fprintf(stderr,"%s: inotify queue overflowed; some new files were missed\n",Myname);
+	continue;
       }
-      if(len < 0){
-	fprintf(stderr,"Read error on %s: %d %s\n",ep->pathname,errno,strerror(errno));
-	abort();
+      if(ev->wd < 0 || (size_t)ev->wd >= Watch_dirs_allocated || ev->len == 0)
+	continue;
+      if(ev->mask & IN_ISDIR){
+	if(ev->mask & (IN_CREATE|IN_MOVED_TO)){
+	  char *sub = path_join(Dirs[Watch_dirs[ev->wd]],ev->name);
+
+	  watch_dir(sub,dir_index(sub,strlen(sub),&Watch_arena),1);
+	  free(sub);
+	}
+      } else if(ev->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)){
+	watch_file(Watch_dirs[ev->wd],ev->name);
       }
-      SHA1_Final(ep->filehash,&context);
     }
-    i = close(fd);
-    assert(i == 0);
-    ep->filehash_present = 1;
   }
+  free(buf);
+  close(Watch_fd);
+  *entriesp = Watch_entries;
+  return Watch_count;
+}
+#else
+int watch_trees(char *roots[],int nroots,struct entry *entries,int nfiles,struct entry **entriesp){
+  fprintf(stderr,"%s: -w needs inotify, which only Linux has\n",Myname);
+  *entriesp = entries;
+  return nfiles;
+}
+#endif
+
+/* External mode (-m), for trees too big for the file table to fit in memory. Instead of going into entries[]
+ * and Files[], each file kept by read_list() or the walker becomes a fixed-size record plus its whole path name
+ * in a buffer. When the buffer reaches the memory budget, the records are sorted into the order dupgroup_sort()
+ * would give and written out as a run to an unlinked scratch file, and the path names are appended to another.
+ * At the end the runs are merged, each read through its own buffer, and the size groups come out one after the
+ * other; each group of two or more is given a small file table of its own, with its path names read back and
+ * Dirs[] holding just "", and compared exactly as usual. Only the current window of groups is in memory then.
+ */
+#define SPILL_WINDOW 4096	/* Entries of consecutive groups compared together, so the pool has enough to do */
+#define SPILL_MINBUF 1024	/* Records read from a run at a time, at least */
+
+struct spillrec {
+  long long size;
+  unsigned long long ino;
+  long long mtime;		/* Nanoseconds */
+  long long ctime;
+  unsigned long long path;	/* Offset of the path name in the names file */
+  unsigned int nlink;
+  unsigned short pathlen;
+  unsigned short dev;
+};
+
+struct spillrun {
+  off_t start;			/* In the runs file */
+  long long count;
+  struct spillrec *buf;		/* While merging */
+  size_t n,next;
+};
+
+static struct spillrec *Spill_recs;	/* Run being built */
+static size_t Spill_n,Spill_allocated;
+static char *Spill_paths;		/* Its path names, each with a null */
+static size_t Spill_pathbytes,Spill_pathsize;
+static struct spillrun *Spill_runlist;
+static size_t Spill_runsize;
+static int Spill_fd = -1,Names_fd = -1;
+static off_t Spill_end,Names_end;
+static const char *Spill_dirs[1] = {""};
+static long long Spill_bytes;		/* Total size of the files, for progress through the merge */
+
+static void write_all(int fd,const void *buf,size_t len,off_t offset){
+  ssize_t r;
+
+  for(; len > 0; len -= r, offset += r, buf = (const char *)buf + r){
+    if((r = pwrite(fd,buf,len,offset)) <= 0 && errno != EINTR){
+      fprintf(stderr,"%s: can't write scratch file: %d %s\n",Myname,errno,strerror(errno));
+      abort();
+    }
+    if(r < 0)
+      r = 0;
+  }
+}
+
+static void read_all(int fd,void *buf,size_t len,off_t offset){
+  ssize_t r;
+
+  for(; len > 0; len -= r, offset += r, buf = (char *)buf + r){
+    if((r = pread(fd,buf,len,offset)) <= 0 && errno != EINTR){
+      fprintf(stderr,"%s: can't read scratch file: %d %s\n",Myname,r == 0 ? EIO : errno,strerror(r == 0 ? EIO : errno));
+      abort();
+    }
+    if(r < 0)
+      r = 0;
+  }
+}
+
+/* An unlinked scratch file, gone when we exit however that happens */
+static int scratch_file(const char *dir){
+  char *path = (char *)malloc(strlen(dir) + 32);
+  int fd;
+
+  assert(path != NULL);
+  sprintf(path,"%s/dupmerge.XXXXXX",dir);
+  if((fd = mkstemp(path)) == -1){
+    fprintf(stderr,"%s: can't create scratch file in %s: %d %s\n",Myname,dir,errno,strerror(errno));
+    exit(1);
+  }
+  unlink(path);
+  free(path);
+  return fd;
+}
+
+void spill_start(void){
+  const char *dir = Scratch_dir;
+
+  if(dir == NULL && (dir = getenv("TMPDIR")) == NULL)
+    dir = "/tmp";
+  Spill_fd = scratch_file(dir);
+  Names_fd = scratch_file(dir);
+  Dirs = Spill_dirs; /* path_of() then gives back each Files[].name unchanged */
+}
+
+/* Same order as dupgroup_sort(): size (decreasing unless -s), device, oldest first, most links first */
+static int spillrec_compare(const void *ap,const void *bp){
+  const struct spillrec *a = (const struct spillrec *)ap,*b = (const struct spillrec *)bp;
+
+  if(a->size != b->size)
+    return (a->size < b->size) == Small_first ? -1 : 1;
+  if(a->dev != b->dev)
+    return a->dev < b->dev ? -1 : 1;
+  if(a->mtime != b->mtime)
+    return a->mtime < b->mtime ? -1 : 1;
+  if(a->nlink != b->nlink)
+    return a->nlink > b->nlink ? -1 : 1;
+  return 0;
+}
+
+/* Sort the records collected so far and write them out as a run, and their path names after the others */
+static void spill_run(void){
+  size_t i;
+
+  if(Spill_n == 0)
+    return;
+  for(i=0;i<Spill_n;i++)
+    Spill_recs[i].path += Names_end; /* Was relative to Spill_paths */
+  qsort(Spill_recs,Spill_n,sizeof(*Spill_recs),spillrec_compare);
+  write_all(Names_fd,Spill_paths,Spill_pathbytes,Names_end);
+  Names_end += Spill_pathbytes;
+  write_all(Spill_fd,Spill_recs,Spill_n * sizeof(*Spill_recs),Spill_end);
+
+  Spill_runlist = (struct spillrun *)table_grow(Spill_runlist,&Spill_runsize,Spill_runs + 1,sizeof(*Spill_runlist));
+  memset(&Spill_runlist[Spill_runs],0,sizeof(Spill_runlist[Spill_runs]));
+  Spill_runlist[Spill_runs].start = Spill_end;
+  Spill_runlist[Spill_runs].count = Spill_n;
+  Spill_runs++;
+  Spill_end += Spill_n * sizeof(*Spill_recs);
+  Spill_n = Spill_pathbytes = 0;
+}
+
+/* Add a batch of new entries, whose Files[].name are whole path names, to the run being built.
+ * The walker threads call this holding Walk_mutex
+ */
+void spill_batch(const struct entry *batch,const struct file *files,int n){
+  struct spillrec *rp;
+  size_t len;
+  int i;
+
+  for(i=0;i<n;i++){
+    len = strlen(files[i].name) + 1;
+    if(Spill_pathbytes + len > Spill_pathsize){
+      Spill_pathsize = Spill_pathsize > 0 ? 2 * Spill_pathsize : ARENA_CHUNK;
+      Spill_paths = (char *)realloc(Spill_paths,Spill_pathsize);
+      assert(Spill_paths != NULL);
+    }
+    if(Spill_n == Spill_allocated){
+      Spill_allocated = Spill_allocated > 0 ? 2 * Spill_allocated : 65536;
+      Spill_recs = (struct spillrec *)realloc(Spill_recs,Spill_allocated * sizeof(*Spill_recs));
+      assert(Spill_recs != NULL);
+    }
+    rp = &Spill_recs[Spill_n++];
+    rp->size = batch[i].size;
+    Spill_bytes += batch[i].size;
+    rp->ino = batch[i].ino;
+    rp->mtime = batch[i].mtime;
+    rp->ctime = files[i].ctime;
+    rp->nlink = batch[i].nlink;
+    rp->dev = batch[i].dev;
+    rp->path = Spill_pathbytes;
+    rp->pathlen = len - 1;
+    memcpy(Spill_paths + Spill_pathbytes,files[i].name,len);
+    Spill_pathbytes += len;
+    Spill_total++;
+    if((long long)(Spill_n * sizeof(*Spill_recs) + Spill_pathbytes) >= Memory_budget)
+      spill_run();
+  }
+}
+
+/* The next record of run r, or NULL when it's used up */
+static struct spillrec *run_peek(struct spillrun *r,size_t bufsize){
+  size_t n;
+
+  if(r->next == r->n){
+    if(r->count == 0)
+      return NULL;
+    n = r->count < (long long)bufsize ? (size_t)r->count : bufsize;
+    read_all(Spill_fd,r->buf,n * sizeof(*r->buf),r->start);
+    r->start += n * sizeof(*r->buf);
+    r->count -= n;
+    r->n = n;
+    r->next = 0;
+  }
+  return &r->buf[r->next];
 }
 
+/* Give a window of consecutive groups a file table and compare them */
+static void spill_compare(const struct spillrec *recs,int n){
+  static struct entry *entries;
+  static size_t entries_allocated,files_allocated;
+  struct hashes *hashes;
+  size_t pathbytes = 0;
+  char *paths,*p;
+  int i;
+
+  entries = (struct entry *)table_grow(entries,&entries_allocated,n,sizeof(*entries));
+  Files = (struct file *)table_grow(Files,&files_allocated,n,sizeof(*Files));
+  for(i=0;i<n;i++)
+    pathbytes += recs[i].pathlen + 1;
+  paths = (char *)malloc(pathbytes);
+  hashes = (struct hashes *)calloc(n,sizeof(*hashes));
+  assert(paths != NULL && hashes != NULL);
+  for(p=paths,i=0;i<n;i++){
+    read_all(Names_fd,p,recs[i].pathlen + 1,recs[i].path);
+    memset(&entries[i],0,sizeof(entries[i]));
+    entries[i].size = recs[i].size;
+    entries[i].ino = recs[i].ino;
+    entries[i].mtime = recs[i].mtime;
+    entries[i].nlink = recs[i].nlink;
+    entries[i].dev = recs[i].dev;
+    entries[i].id = i;
+    Files[i].name = p;
+    Files[i].hashes = &hashes[i]; /* Freed with the window, unlike alloc_hashes() */
+    Files[i].ctime = recs[i].ctime;
+    Files[i].dir = 0;
+    p += recs[i].pathlen + 1;
+  }
+  dupengine_compare(&Engine,entries,n);
+  free(hashes);
+  free(paths);
+}
+
+/* Merge the runs, dropping sizes that only one file has, and compare the groups as they come out */
+void external_merge(void){
+  struct spillrec *window = NULL,*rp;
+  size_t allocated = 0,nwindow = 0,group = 0,bufsize;
+  int *heap,nheap,i,c,m;
+
+  spill_run();
+  free(Spill_recs);
+  free(Spill_paths);
+  Spill_recs = NULL;
+  Spill_paths = NULL;
+  if(!Quiet_flag)
+    fprintf(stderr,"%s: %lld entries in %d sorted runs\n",Myname,Spill_total,Spill_runs);
+  Progress_total = Spill_bytes;
+
+  /* Half the budget for the run buffers */
+  bufsize = Spill_runs > 0 ? Memory_budget / 2 / Spill_runs / sizeof(struct spillrec) : 0;
+  if(bufsize < SPILL_MINBUF)
+    bufsize = SPILL_MINBUF;
+  heap = (int *)malloc((Spill_runs + 1) * sizeof(*heap));
+  assert(heap != NULL);
+  for(nheap=i=0;i<Spill_runs;i++){
+    Spill_runlist[i].buf = (struct spillrec *)malloc(bufsize * sizeof(struct spillrec));
+    assert(Spill_runlist[i].buf != NULL);
+    if(run_peek(&Spill_runlist[i],bufsize) == NULL)
+      continue;
+    /* Sift up */
+    for(c = nheap++; c > 0 && spillrec_compare(run_peek(&Spill_runlist[i],bufsize),
+					       run_peek(&Spill_runlist[heap[(c-1)/2]],bufsize)) < 0; c = (c-1)/2)
+      heap[c] = heap[(c-1)/2];
+    heap[c] = i;
+  }
+  while(nheap > 0){
+    struct spillrun *r = &Spill_runlist[heap[0]];
+
+    rp = run_peek(r,bufsize);
+    /* A new size group: drop the last one if it had just one file, and compare the window if it's full */
+    if(nwindow > group && (rp->size != window[group].size || rp->dev != window[group].dev)){
+      if(nwindow - group < 2)
+	nwindow = group;
+      group = nwindow;
+      if(nwindow >= SPILL_WINDOW){
+	spill_compare(window,nwindow);
+	nwindow = group = 0;
+      }
+    }
+    if(nwindow == allocated){
+      allocated = allocated > 0 ? 2 * allocated : SPILL_WINDOW;
+      window = (struct spillrec *)realloc(window,allocated * sizeof(*window));
+      assert(window != NULL);
+    }
+    window[nwindow++] = *rp;
+    r->next++;
+    Progress_done += rp->size;
+
+    /* Sift the run down to its new place, or drop it */
+    i = heap[0];
+    if(run_peek(r,bufsize) == NULL){
+      i = heap[--nheap];
+      if(nheap == 0)
+	break;
+    }
+    for(c=0; (m = 2*c+1) < nheap; c = m){
+      if(m + 1 < nheap && spillrec_compare(run_peek(&Spill_runlist[heap[m+1]],bufsize),
+					   run_peek(&Spill_runlist[heap[m]],bufsize)) < 0)
+	m++;
+      if(spillrec_compare(run_peek(&Spill_runlist[heap[m]],bufsize),run_peek(&Spill_runlist[i],bufsize)) >= 0)
+	break;
+      heap[c] = heap[m];
+    }
+    heap[c] = i;
+  }
+  if(nwindow - group < 2)
+    nwindow = group;
+  if(nwindow > 0)
+    spill_compare(window,nwindow);
+
+  for(i=0;i<Spill_runs;i++)
+    free(Spill_runlist[i].buf);
+  free(heap);
+  free(window);
+}
+
+/* Kernel-assisted dedupe (-d). Instead of being unlinked, each duplicate keeps its inode, owner and permissions
+ * and has its data replaced by the reference file's extents with the FIDEDUPERANGE ioctl, which compares the
+ * contents itself under the file system's locks. The duplicates of one reference file are queued and handed
+ * over together, up to DEDUPE_MAXDEST per call and DEDUPE_CHUNK bytes of each at a time.
+ * Where the file system can't do it (ext4, tmpfs, NFS...) the files are linked as usual
+ */
+#define DEDUPE_MAXDEST 120	/* Destinations per call; the kernel wants the argument to fit in a page */
+#define DEDUPE_CHUNK (16*1024*1024) /* The most btrfs will do in one call */
+
+struct dedupe_dest {
+  struct entry *ep;
+  blkcnt_t blocks;		/* As it was before dedupe */
+  int fd;
+  off_t offset;			/* Bytes shared so far; each destination goes at its own pace */
+};
+static struct entry *Dedupe_ref;
+static struct dedupe_dest Dedupe_dests[DEDUPE_MAXDEST];
+static int Dedupe_ndests;
+static unsigned char Dedupe_unsupported[USHRT_MAX+1]; /* By device index, once dedupe has failed there */
+
+static void relink_queue(struct entry *ref,struct entry *dup);
+
+/* Queue dup to share ref's extents. Returns 0 if it should be linked instead */
+static int dedupe_queue(struct entry *ref,struct entry *dup,blkcnt_t blocks){
+#ifdef FIDEDUPERANGE
+  if(Dedupe_ref != ref || Dedupe_ndests == DEDUPE_MAXDEST)
+    dedupe_flush();
+  Dedupe_ref = ref;
+  Dedupe_dests[Dedupe_ndests].ep = dup;
+  Dedupe_dests[Dedupe_ndests].blocks = blocks;
+  Dedupe_dests[Dedupe_ndests].fd = -1;
+  Dedupe_dests[Dedupe_ndests].offset = 0;
+  Dedupe_ndests++;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+#ifdef FIDEDUPERANGE
+/* Is this error from FIDEDUPERANGE the file system saying it can't? */
+static int dedupe_unsupported(int err){
+  return err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EXDEV;
+}
+#endif
+
+/* Dedupe everything queued against the current reference file */
+void dedupe_flush(void){
+#ifdef FIDEDUPERANGE
+  struct file_dedupe_range *arg;
+  struct dedupe_dest *dp;
+  char refpath[PATH_MAX+1],path[PATH_MAX+1];
+  off_t offset,size,len;
+  int srcfd,i,r,live,fallback = 0;
+  double start;
+
+  if(Dedupe_ndests == 0)
+    return;
+  size = Dedupe_ref->size;
+  path_of(Dedupe_ref,refpath);
+  if(No_do){
+    Dedupe_files += Dedupe_ndests;
+    for(i=0;i<Dedupe_ndests;i++)
+      Blocks_reclaimed += Dedupe_dests[i].blocks;
+    Dedupe_ndests = 0;
+    return;
+  }
+  if((srcfd = open(refpath,O_RDONLY)) == -1){
+    fprintf(stderr,"%s: can't open(%s): %d %s\n",Myname,refpath,errno,strerror(errno));
+    Dedupe_ndests = 0;
+    return;
+  }
+  arg = (struct file_dedupe_range *)calloc(1,sizeof(*arg) + DEDUPE_MAXDEST * sizeof(arg->info[0]));
+  assert(arg != NULL);
+  for(i=0;i<Dedupe_ndests;i++){
+    dp = &Dedupe_dests[i];
+    /* Owners may dedupe into files they can only read; a file being executed can't be opened for writing */
+    if((dp->fd = open(path_of(dp->ep,path),O_RDWR)) == -1 && (dp->fd = open(path,O_RDONLY)) == -1)
+      fprintf(stderr,"%s: can't open(%s): %d %s\n",Myname,path,errno,strerror(errno));
+  }
+  for(;;){
+    /* The kernel may do less than asked, and not the same for every file. Each call goes on from the least
+     * any file has got, for just the files that got no further, so no range is sent or counted twice
+     */
+    offset = size;
+    for(i=0;i<Dedupe_ndests;i++){
+      if(Dedupe_dests[i].fd != -1 && Dedupe_dests[i].offset < offset)
+	offset = Dedupe_dests[i].offset;
+    }
+    if(offset >= size)
+      break;
+    len = size - offset > DEDUPE_CHUNK ? DEDUPE_CHUNK : size - offset;
+    arg->src_offset = offset;
+    arg->src_length = len;
+    for(live=i=0;i<Dedupe_ndests;i++){
+      if(Dedupe_dests[i].fd == -1 || Dedupe_dests[i].offset != offset)
+	continue;
+      arg->info[live].dest_fd = Dedupe_dests[i].fd;
+      arg->info[live].dest_offset = offset;
+      arg->info[live].reserved = 0;
+      live++;
+    }
+    arg->dest_count = live;
+    start = now_seconds();
+    r = ioctl(srcfd,FIDEDUPERANGE,arg);
+    hist_add(&Link_latency,start);
+    if(r == -1){
+      if(dedupe_unsupported(errno))
+	fallback = 1;
+      else
+	fprintf(stderr,"%s: can't dedupe %s: %d %s\n",Myname,refpath,errno,strerror(errno));
+      break;
+    }
+    for(live=i=0;i<Dedupe_ndests;i++){
+      dp = &Dedupe_dests[i];
+      if(dp->fd == -1 || dp->offset != offset)
+	continue;
+      if(arg->info[live].status == FILE_DEDUPE_RANGE_SAME && arg->info[live].bytes_deduped > 0){
+	Dedupe_bytes += arg->info[live].bytes_deduped;
+	dp->offset += arg->info[live].bytes_deduped;
+	live++;
+	continue;
+      }
+      if(arg->info[live].status == FILE_DEDUPE_RANGE_SAME){
+	; /* No progress; leave it as far as it got */
+      } else if(arg->info[live].status == FILE_DEDUPE_RANGE_DIFFERS){
+	Dedupe_differs++;
+	fprintf(stderr,"%s: %s changed since it was compared, left alone\n",Myname,path_of(dp->ep,path));
+      } else if(dedupe_unsupported(-arg->info[live].status)){
+	fallback = 1; /* Keep it open, to be linked */
+	live++;
+	continue;
+      } else {
+	fprintf(stderr,"%s: can't dedupe %s: %d %s\n",Myname,path_of(dp->ep,path),
+		-arg->info[live].status,strerror(-arg->info[live].status));
+      }
+      close(dp->fd);
+      dp->fd = -1;
+      live++;
+    }
+    if(fallback)
+      break;
+  }
+  for(i=0;i<Dedupe_ndests;i++){
+    dp = &Dedupe_dests[i];
+    if(dp->fd == -1)
+      continue;
+    close(dp->fd);
+    if(dp->offset >= size){
+      Dedupe_files++;
+      Blocks_reclaimed += dp->blocks;
+    } else if(fallback){
+      /* Contents were verified by hash, same as without -d */
+      Dedupe_fallbacks++;
+      relink_queue(Dedupe_ref,dp->ep);
+    }
+  }
+  if(fallback && !Dedupe_unsupported[Dedupe_ref->dev]){
+    Dedupe_unsupported[Dedupe_ref->dev] = 1;
+    fprintf(stderr,"%s: %s: file system can't dedupe, linking instead\n",Myname,refpath);
+  }
+  free(arg);
+  close(srcfd);
+  Dedupe_ndests = 0;
+#endif
+}
+
+/* Relinking. Replacing a duplicate used to take an lstat() of each path name, then unlink() and link(): four
+ * lookups of whole path names per file, and a crash between the last two left the duplicate's name missing.
+ * Now every step names a single component relative to a directory descriptor, and the directories are
+ * opened once each and kept in a small cache. The duplicate is replaced by linking the reference file to a
+ * temporary name beside it and renaming that over the duplicate, which the kernel does atomically: at every
+ * moment the name refers to either the old file or the reference, and a crash can at worst leave behind a
+ * temporary name (.dupmerge.PID.N) for a file that is kept anyway. A link that fails, e.g., with EMLINK, now
+ * leaves the duplicate as it was.
+ *
+ * merge() queues the work and relink_flush() does it a batch at a time, sorted by the duplicate's directory:
+ * each pool thread claims all the work in one directory at a time, so the threads don't contend for one
+ * directory's lock and different directories are done in parallel. The paranoid checks on both files are
+ * made by the thread doing the link, just before it, as they were before
+ */
+#define RELINK_BATCH 1024
+#define RELINK_MAXDIRS 256	/* Directory descriptors kept open */
+
+struct relink {
+  struct entry *ref,*dup;
+  int refdir,dupdir;		/* Descriptors */
+};
+static void pool_start(void (*task)(void));
+static void pool_wait(void);
+static struct relink Relinks[RELINK_BATCH];
+static int Nrelinks;
+static int Relink_next;		/* Next to be claimed in relink_task() */
+static pthread_mutex_t Relink_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int Relink_tmp;	/* Temporary names made so far */
+
+struct dirslot {
+  unsigned int dir;		/* Index in Dirs[] */
+  int fd;
+  unsigned long long used;	/* Batch it was last used in; can't be closed before that batch is done */
+};
+static struct dirslot Dir_cache[RELINK_MAXDIRS];
+static int Dir_ncached;
+static unsigned long long Relink_batch = 1;
+
+/* Descriptor for directory Dirs[dir], from the cache or newly opened; -1 if it can't be opened, -2 if every
+ * cached descriptor is in use by the current batch
+ */
+static int dir_fd(unsigned int dir){
+  struct dirslot *sp = NULL;
+  int i;
+
+  for(i=0;i<Dir_ncached;i++){
+    if(Dir_cache[i].dir == dir){
+      Dir_cache[i].used = Relink_batch;
+      return Dir_cache[i].fd;
+    }
+  }
+  if(Dir_ncached < RELINK_MAXDIRS){
+    sp = &Dir_cache[Dir_ncached];
+  } else {
+    for(i=0;i<Dir_ncached;i++){
+      if(Dir_cache[i].used != Relink_batch && (sp == NULL || Dir_cache[i].used < sp->used))
+	sp = &Dir_cache[i]; /* Least recently used */
+    }
+    if(sp == NULL)
+      return -2;
+    close(sp->fd);
+    Dir_ncached--;
+    *sp = Dir_cache[Dir_ncached]; /* Keep the slots in use together */
+    sp = &Dir_cache[Dir_ncached];
+  }
+  if((sp->fd = open(Dirs[dir][0] != '\0' ? Dirs[dir] : ".",O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1){
+    fprintf(stderr,"%s: can't open directory %s: %d %s\n",Myname,Dirs[dir],errno,strerror(errno));
+    return -1;
+  }
+  sp->dir = dir;
+  sp->used = Relink_batch;
+  Dir_ncached++;
+  return sp->fd;
+}
+
+/* Descriptors for the directories of ref and dup, flushing the batch first if there's no room for them */
+static int relink_dirs(struct entry *ref,struct entry *dup,int *refdir,int *dupdir){
+  *refdir = dir_fd(Files[ref->id].dir);
+  *dupdir = dir_fd(Files[dup->id].dir);
+  if(*refdir == -2 || *dupdir == -2){
+    relink_flush();
+    *refdir = dir_fd(Files[ref->id].dir);
+    *dupdir = dir_fd(Files[dup->id].dir);
+  }
+  return *refdir >= 0 && *dupdir >= 0 ? 0 : -1;
+}
+
+/* The last minute paranoid checks, and dup's blocks as the file table doesn't keep them */
+static blkcnt_t merge_check(struct entry *ref,struct entry *dup,int refdir,int dupdir){
+  struct stat statbuf_a,statbuf_b;
+  char path[PATH_MAX+1];
+
+  if(fstatat(refdir,Files[ref->id].name,&statbuf_a,AT_SYMLINK_NOFOLLOW)){
+    fprintf(stderr,"%s: can't lstat(%s): %d %s\n",Myname,path_of(ref,path),errno,strerror(errno));
+    abort();
+  }
+  if(fstatat(dupdir,Files[dup->id].name,&statbuf_b,AT_SYMLINK_NOFOLLOW)){
+    fprintf(stderr,"%s: can't lstat(%s): %d %s\n",Myname,path_of(dup,path),errno,strerror(errno));
+    abort();
+  }
+  assert(statbuf_a.st_size == statbuf_b.st_size);
+  assert(statbuf_a.st_ino != statbuf_b.st_ino);
+  assert(statbuf_a.st_dev == statbuf_b.st_dev);
+  assert(statbuf_a.st_mtime <= statbuf_b.st_mtime || Files[ref->id].reference);
+  return statbuf_b.st_blocks;
+}
+
+/* Replace dup with a link to ref */
+static void relink_one(struct relink *rp){
+  const char *name = Files[rp->dup->id].name;
+  const char *slash = strrchr(name,'/'); /* With -m, names are whole paths */
+  char tmp[PATH_MAX+1],refpath[PATH_MAX+1],duppath[PATH_MAX+1];
+  int prefix = slash != NULL ? slash + 1 - name : 0;
+  blkcnt_t blocks;
+  int r;
+  double start = now_seconds();
+
+  blocks = merge_check(rp->ref,rp->dup,rp->refdir,rp->dupdir);
+  if(!No_do){
+    for(;;){
+      snprintf(tmp,sizeof(tmp),"%.*s.dupmerge.%d.%u",prefix,name,(int)getpid(),
+	       __atomic_add_fetch(&Relink_tmp,1,__ATOMIC_RELAXED));
+      if((r = linkat(rp->refdir,Files[rp->ref->id].name,rp->dupdir,tmp,0)) == 0 || errno != EEXIST)
+	break; /* Else left by an earlier run that crashed */
+    }
+    if(r != 0){
+      __atomic_add_fetch(&Unlink_failures,1,__ATOMIC_RELAXED);
+      fprintf(stderr,"%s: can't link(%s,%s): %d %s\n",Myname,path_of(rp->ref,refpath),path_of(rp->dup,duppath),errno,strerror(errno));
+      return;
+    }
+    if(renameat(rp->dupdir,tmp,rp->dupdir,name) != 0){
+      __atomic_add_fetch(&Unlink_failures,1,__ATOMIC_RELAXED);
+      fprintf(stderr,"%s: can't replace %s: %d %s\n",Myname,path_of(rp->dup,duppath),errno,strerror(errno));
+      unlinkat(rp->dupdir,tmp,0);
+      return;
+    }
+  }
+  if(rp->dup->nlink == 1){
+    /* Pathname had the single remaining link, so its blocks are recovered */
+    __atomic_add_fetch(&Blocks_reclaimed,blocks,__ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&Unlinks,1,__ATOMIC_RELAXED);
+  hist_add(&Link_latency,start);
+}
+
+static int compare_dupdir(const void *ap,const void *bp){
+  const struct relink *a = (const struct relink *)ap,*b = (const struct relink *)bp;
+
+  if(a->dupdir != b->dupdir)
+    return a->dupdir < b->dupdir ? -1 : 1;
+  return 0;
+}
+
+/* Run by every thread: claim the next directory's worth of the batch until it's all done */
+static void relink_task(void){
+  int i,end;
+
+  for(;;){
+    pthread_mutex_lock(&Relink_mutex);
+    i = Relink_next;
+    for(end = i + 1; end < Nrelinks && Relinks[end].dupdir == Relinks[i].dupdir; end++)
+      ;
+    Relink_next = end;
+    pthread_mutex_unlock(&Relink_mutex);
+    if(i >= Nrelinks)
+      break;
+    for(; i < end; i++)
+      relink_one(&Relinks[i]);
+  }
+}
+
+/* Do all the queued relinks. Main thread only, with the pool idle */
+void relink_flush(void){
+  double start;
+
+  if(Nrelinks == 0)
+    return;
+  start = now_seconds();
+  qsort(Relinks,Nrelinks,sizeof(*Relinks),compare_dupdir);
+  Relink_next = 0;
+  if(Nrelinks > 1){
+    pool_start(relink_task);
+    relink_task();
+    pool_wait();
+  } else {
+    relink_task();
+  }
+  Nrelinks = 0;
+  Relink_batch++;
+  Phase_time[PHASE_LINK] += now_seconds() - start;
+}
+
+/* Queue dup to be replaced by a link to ref */
+static void relink_queue(struct entry *ref,struct entry *dup){
+  struct relink *rp;
+
+  if(Nrelinks == RELINK_BATCH)
+    relink_flush();
+  rp = &Relinks[Nrelinks];
+  if(relink_dirs(ref,dup,&rp->refdir,&rp->dupdir) != 0){
+    Unlink_failures++;
+    return;
+  }
+  rp->ref = ref;
+  rp->dup = dup;
+  Nrelinks++;
+}
+
+/* The action sink: link dup to ref, which has identical contents and a different inode; dupengine_same() has
+ * retired dup. With -d, queue dup to have its extents shared with ref's instead
+ */
+void merge(void *arg,struct entry *ref,struct entry *dup){
+  char refpath[PATH_MAX+1],duppath[PATH_MAX+1];
+  int dedupe = Dedupe_flag && !Dedupe_unsupported[dup->dev];
+  int refdir,dupdir;
+  double start = now_seconds();
+
+  /* Distinct files with identical contents on same file system, can be linked */
+  if(!Quiet_flag){
+    fprintf(stderr,"%s: %lld %s %s -> %s\n",Myname,(long long)dup->size,dedupe ? "dedupe" : "ln",
+	    path_of(dup,duppath),path_of(ref,refpath));
+  }
+  if(!No_do && HASHES(ref) != NULL)
+    HASHES(ref)->relinked = 1; /* For cache_save() */
+  if(!No_do && HASHES(dup) != NULL && dedupe)
+    HASHES(dup)->relinked = 1;
+  if(dedupe && relink_dirs(ref,dup,&refdir,&dupdir) == 0
+     && dedupe_queue(ref,dup,merge_check(ref,dup,refdir,dupdir))){
+    Phase_time[PHASE_LINK] += now_seconds() - start;
+    return;
+  }
+  if(Dedupe_flag)
+    Dedupe_fallbacks++;
+  relink_queue(ref,dup); /* Checked and linked in relink_flush() */
+  Phase_time[PHASE_LINK] += now_seconds() - start;
+}
+
+/* The original scan: compare each reference file against every later one in the group.
+ * Still used with -f, where the timestamp heuristic isn't transitive and so can't be bucketed
+ */
+void scan_pairwise(dupengine *e,struct entry *group,int n){
+  int i,j;
+
+  for(i=0;i<n-1;i++){
+    /* Ignore hard links to earlier reference files */
+    if(group[i].gone)
+      continue;
+
+    for(j=i+1;j<n;j++){
+      /* Ignore hard links to earlier reference files */
+      if(group[j].gone)
+	continue;
+
+      if(group[i].ino == group[j].ino
+	 || comparison_equal(&group[i],&group[j]) == 0)
+	dupengine_same(e,&group[i],&group[j]);
+    }
+  }
+}
+
+/* Orderings of pointers to entries in one group; ties are broken by position in the group (i.e., sort order)
+ * so that the first member of any set of identical files is the oldest
+ */
+static int compare_position(struct entry *a,struct entry *b){
+  if(a != b)
+    return a < b ? -1 : 1;
+  return 0;
+}
+
+static int compare_ino_position(const void *ap,const void *bp){
+  struct entry *a = *(struct entry **)ap;
+  struct entry *b = *(struct entry **)bp;
+
+  if(a->ino != b->ino)
+    return a->ino < b->ino ? -1 : 1;
+  return compare_position(a,b);
+}
+
+static int compare_partial_ino(const void *ap,const void *bp){
+  struct entry *a = *(struct entry **)ap;
+  struct entry *b = *(struct entry **)bp;
+  int i;
+
+  if((i = memcmp(HASHES(a)->partialhash,HASHES(b)->partialhash,HASHSIZE)) != 0)
+    return i;
+  return compare_ino_position(ap,bp);
+}
+
+static int compare_full_position(const void *ap,const void *bp){
+  struct entry *a = *(struct entry **)ap;
+  struct entry *b = *(struct entry **)bp;
+  int i;
+
+  if((i = memcmp(HASHES(a)->filehash,HASHES(b)->filehash,HASHSIZE)) != 0)
+    return i;
+  return compare_position(a,b);
+}
+
+static int compare_first_member(const void *ap,const void *bp){
+  /* The first field of struct set */
+  return compare_position(**(struct entry ***)ap,**(struct entry ***)bp);
+}
+
+struct keyed {
+  int key;
+  struct entry *ep;
+};
+
+static int compare_key_position(const void *ap,const void *bp){
+  const struct keyed *a = (const struct keyed *)ap;
+  const struct keyed *b = (const struct keyed *)bp;
+
+  if(a->key != b->key)
+    return a->key < b->key ? -1 : 1;
+  return compare_position(a->ep,b->ep);
+}
+
+/* Lockstep comparison, for buckets of big files whose first pages match. Hashing them reads every byte
+ * of every file even when, as is usual, they differ early on. Instead all the files are read together a
+ * chunk at a time and split into subsets whenever their contents diverge; a file alone in its subset is
+ * unique and needn't be read any further. Chunks start small, since most differences show up early,
+ * and grow to amortize the seeks between files.
+ */
+#define STREAM_MAXFILES 32		/* Most files read at once */
+#define STREAM_MINSIZE (1024*1024)	/* Smaller files are just hashed */
+#define STREAM_CHUNK (64*1024)		/* First read; doubles each time up to STREAM_MAXCHUNK */
+#define STREAM_MAXCHUNK (1024*1024)
+
+struct stream {
+  int file;			/* Index in files[] */
+  int fd;
+  unsigned char *buf;
+  ssize_t len;			/* Bytes in buf */
+};
+
+/* Should a bucket of n distinct files of this size be compared in lockstep rather than hashed?
+ * Not when the hash cache (-c) is to be saved: lockstep leaves no full hash to keep, so the next run over the
+ * same files would have to read them all again
+ */
+int stream_wanted(off_t size,int n){
+  return n <= STREAM_MAXFILES && size >= STREAM_MINSIZE && (Cache_file == NULL || Memory_budget != 0);
+}
+
+static int compare_stream(const void *ap,const void *bp){
+  const struct stream *a = (const struct stream *)ap;
+  const struct stream *b = (const struct stream *)bp;
+  int i;
+
+  if(a->len != b->len)
+    return a->len < b->len ? -1 : 1; /* Only if a file has shrunk */
+  if((i = memcmp(a->buf,b->buf,a->len)) != 0)
+    return i;
+  return a->file - b->file;
+}
+
+/* Sort n distinct files of the same size, all with the same first page, into classes of identical contents.
+ * Sets class[i] for files[i]; returns the number of classes
+ */
+static int stream_classify(struct entry **files,int n,int *class){
+  static unsigned char *bufs;
+  struct stream s[STREAM_MAXFILES],t[STREAM_MAXFILES];
+  int start[STREAM_MAXFILES+1]; /* Subset i is s[start[i]] .. s[start[i+1]-1] */
+  int old[STREAM_MAXFILES+1];	/* start[] as it was before this chunk; the new one is built as it's read */
+  off_t size = files[0]->size;
+  off_t offset = size > PAGESIZE ? PAGESIZE : size; /* Known to match already */
+  size_t chunk = STREAM_CHUNK;
+  int nclasses = 0,nsubsets,live,i,j,k;
+  char path[PATH_MAX+1];
+
+  assert(n <= STREAM_MAXFILES);
+  if(bufs == NULL){
+    bufs = (unsigned char *)malloc((size_t)STREAM_MAXFILES * STREAM_MAXCHUNK);
+    assert(bufs != NULL);
+  }
+  Stream_compares++;
+  for(i=0;i<n;i++){
+    s[i].file = i;
+    s[i].buf = bufs + (size_t)i * STREAM_MAXCHUNK;
+    if((s[i].fd = timed_open(path_of(files[i],path),O_RDONLY)) == -1){
+      fprintf(stderr,"can't open(%s): %d %s\n",path,errno,strerror(errno));
+      abort();
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    if(!Background_flag)
+      posix_fadvise(s[i].fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+  start[0] = 0;
+  start[1] = live = n;
+  nsubsets = 1;
+
+  while(nsubsets > 0 && offset < size){
+    size_t want = size - offset > chunk ? chunk : size - offset;
+
+    for(i=0;i<live;i++){
+      s[i].len = read_data(files[s[i].file],s[i].fd,s[i].buf,want,offset); /* Short if the file has shrunk */
+      Stream_bytes += s[i].len;
+    }
+    /* Split each subset into runs of identical chunks; a run of one is a unique file */
+    memcpy(t,s,live * sizeof(*s));
+    memcpy(old,start,(nsubsets + 1) * sizeof(*start));
+    live = 0;
+    for(i=0,k=nsubsets,nsubsets=0;i<k;i++){
+      int a = old[i],b = old[i+1],run;
+
+      qsort(&t[a],b - a,sizeof(*t),compare_stream);
+      for(j=a;j<b;j=run){
+	for(run=j+1;run<b && t[j].len == t[run].len && memcmp(t[j].buf,t[run].buf,t[j].len) == 0;run++)
+	  ;
+	if(run - j == 1){
+	  class[t[j].file] = nclasses++;
+	  close(t[j].fd);
+	  continue;
+	}
+	start[nsubsets++] = live;
+	while(j < run)
+	  s[live++] = t[j++];
+      }
+    }
+    start[nsubsets] = live;
+    offset += want;
+    if(chunk < STREAM_MAXCHUNK)
+      chunk *= 2;
+  }
+  /* Whatever is left matched all the way through */
+  for(i=0;i<nsubsets;i++){
+    for(j=start[i];j<start[i+1];j++){
+      class[s[j].file] = nclasses;
+      close(s[j].fd);
+    }
+    nclasses++;
+  }
+  return nclasses;
+}
+
+static int Sample_sort_stage; /* For compare_sample_ino() */
+
+static int compare_sample_ino(const void *ap,const void *bp){
+  struct entry *a = *(struct entry **)ap;
+  struct entry *b = *(struct entry **)bp;
+  int i;
+
+  if((i = memcmp(HASHES(a)->samplehash[Sample_sort_stage-1],HASHES(b)->samplehash[Sample_sort_stage-1],HASHSIZE)) != 0)
+    return i;
+  return compare_ino_position(ap,bp);
+}
+
+/* Sets of identical files found so far in the current group */
+static struct set {
+  struct entry **first;	/* Oldest member, followed by the others in members[] */
+  int n;
+} *Sets;
+static int Nsets;
+static struct keyed *Keyed;	/* Bucket compared in lockstep: members with their classes */
+
+/* Split a bucket of n links, sorted by inode, whose files share a first page hash and, from level 1 on,
+ * their sample hashes up to that stage. Big files are narrowed down a sample stage at a time before
+ * any are read in full; then the files still together are split by full hash, or in lockstep.
+ * Records the sets of identical files in Sets[]
+ */
+static void split_bucket(struct entry **b,int n,int level){
+  int i,k,ninodes,hashed;
+
+  /* A bucket of links to just one inode has nothing to merge */
+  for(ninodes=hashed=k=0;k<n;k++){
+    if(k == 0 || b[k]->ino != b[k-1]->ino){
+      ninodes++;
+      hashed += HASHES(b[k])->filehash_present != 0;
+    }
+  }
+  if(ninodes < 2)
+    return;
+
+  /* Don't sample files whose full hashes are already known, e.g., from the cache */
+  if(hashed < ninodes && level < SAMPLE_STAGES && b[0]->size >= SAMPLE_MINSIZE){
+    for(k=0;k<n;k++){
+      if(k > 0 && b[k]->ino == b[k-1]->ino && HASHES(b[k])->sample_stage < HASHES(b[k-1])->sample_stage){
+	memcpy(HASHES(b[k])->samplehash,HASHES(b[k-1])->samplehash,sizeof(HASHES(b[k])->samplehash));
+	HASHES(b[k])->sample_stage = HASHES(b[k-1])->sample_stage;
+      }
+      use_sample_hash(b[k],level + 1);
+    }
+    Sample_sort_stage = level + 1;
+    qsort(b,n,sizeof(*b),compare_sample_ino);
+    for(k=0;k<n;k=i){
+      for(i=k+1;i<n && memcmp(HASHES(b[k])->samplehash[level],HASHES(b[i])->samplehash[level],HASHSIZE) == 0;i++)
+	;
+      if(b[k]->ino == b[i-1]->ino)
+	Sample_rejects[level]++; /* Told apart from the rest of the bucket */
+      else
+	split_bucket(&b[k],i - k,level + 1);
+    }
+    return;
+  }
+
+  /* Compare in lockstep if that looks cheaper, unless the hashes are already known */
+  if(hashed < ninodes && stream_wanted(b[0]->size,ninodes)){
+    struct entry *files[STREAM_MAXFILES];
+    int class[STREAM_MAXFILES];
+    int f = -1;
+
+    for(k=0;k<n;k++){
+      if(k == 0 || b[k]->ino != b[k-1]->ino)
+	files[++f] = b[k];
+    }
+    Partial_hit_full_fail += stream_classify(files,ninodes,class) - 1;
+    for(f=-1,k=0;k<n;k++){
+      if(k == 0 || b[k]->ino != b[k-1]->ino)
+	f++;
+      Keyed[k].key = class[f];
+      Keyed[k].ep = b[k];
+    }
+    qsort(Keyed,n,sizeof(*Keyed),compare_key_position);
+    for(k=0;k<n;k++)
+      b[k] = Keyed[k].ep;
+    for(k=0;k<n;k=i){
+      for(i=k+1;i<n && Keyed[i].key == Keyed[k].key;i++)
+	;
+      if(i - k > 1){
+	Sets[Nsets].first = &b[k];
+	Sets[Nsets++].n = i - k;
+      }
+    }
+    return;
+  }
+
+  /* Full hash of each inode in the bucket */
+  for(k=0;k<n;k++){
+    if(k > 0 && b[k]->ino == b[k-1]->ino && !HASHES(b[k])->filehash_present){
+      memcpy(HASHES(b[k])->filehash,HASHES(b[k-1])->filehash,HASHSIZE);
+      HASHES(b[k])->filehash_present = 1;
+    }
+    use_big_hash(b[k]);
+  }
+  qsort(b,n,sizeof(*b),compare_full_position);
+  for(k=0;k<n;k=i){
+    for(i=k+1;i<n && memcmp(HASHES(b[k])->filehash,HASHES(b[i])->filehash,HASHSIZE) == 0;i++)
+      ;
+    if(k > 0)
+      Partial_hit_full_fail++; /* Another distinct file with the same first page */
+    if(i - k > 1){
+      Sets[Nsets].first = &b[k];
+      Sets[Nsets++].n = i - k;
+    }
+  }
+}
+
+/* Find the sets of identical files in a group by sorting rather than by comparing every pair:
+ * split the group into buckets by first page hash, split each bucket holding more than one inode
+ * (see split_bucket()), then link every member of each resulting set to its first (oldest) member.
+ * Sets are processed in the order of their oldest members, so the result is the same as scan_pairwise()'s.
+ */
+void scan_buckets(dupengine *e,struct entry *group,int n){
+  static struct entry **members;
+  static int allocated;
+  int i,k,m,bucket,end;
+
+  if(allocated < n + 1){
+    members = (struct entry **)realloc(members,(n + 1) * sizeof(*members));
+    Sets = (struct set *)realloc(Sets,(n + 1) * sizeof(*Sets));
+    Keyed = (struct keyed *)realloc(Keyed,(n + 1) * sizeof(*Keyed));
+    assert(members != NULL && Sets != NULL && Keyed != NULL);
+    allocated = n + 1;
+  }
+  for(m=i=0;i<n;i++){
+    if(!group[i].gone)
+      members[m++] = &group[i];
+  }
+  /* First page hash of every file; further links to a file share its hash */
+  qsort(members,m,sizeof(*members),compare_ino_position);
+  for(k=0;k<m;k++){
+    if(k > 0 && members[k]->ino == members[k-1]->ino && !HASHES(members[k])->partialhash_present){
+      memcpy(HASHES(members[k])->partialhash,HASHES(members[k-1])->partialhash,HASHSIZE);
+      HASHES(members[k])->partialhash_present = 1;
+    }
+    use_small_hash(members[k]);
+  }
+  qsort(members,m,sizeof(*members),compare_partial_ino);
+
+  Nsets = 0;
+  for(bucket=0;bucket<m;bucket=end){
+    for(end=bucket+1;end<m && memcmp(HASHES(members[bucket])->partialhash,HASHES(members[end])->partialhash,HASHSIZE) == 0;end++)
+      ;
+    split_bucket(&members[bucket],end - bucket,0);
+  }
+  /* Sets[] are in hash order; restore sort order */
+  qsort(Sets,Nsets,sizeof(*Sets),compare_first_member);
+  for(k=0;k<Nsets;k++){
+    for(i=1;i<Sets[k].n;i++)
+      dupengine_same(e,Sets[k].first[0],Sets[k].first[i]);
+  }
+}
+
+
+int comparison_equal(const void *ap,const void *bp){
+  struct entry *a,*b;
+  int i;
+
+  a = (struct entry *)ap;
+  b = (struct entry *)bp;
+
+  if(a == b)
+    return 0; /* Can this happen? */
+
+  assert(a != NULL);
+  assert(b != NULL);
+
+  if(a->dev == b->dev && a->ino == b->ino)
+    return 0; /* Files are already hard-linked, so they're the same */
+
+  /* Make file size the most significant part of the comparison. Don't subtract: sizes don't fit in an int */
+  if(b->size != a->size)
+    return b->size < a->size ? -1 : 1;
+
+  /* Same-size files sort together only when they're on the same device */
+  if(b->dev != a->dev)
+    return b->dev - a->dev;
+
+
+  /* Optionally use the rsync heuristic -- if the files have the same size, mod timestamp and
+   * the same base name, declare them the same without actually reading the contents
+   * Do this only on files larger than Fast_threshold to further reduce chances of false equality
+   */
+  if(Fast_flag && a->size > Fast_threshold){	/* Rsync-style fast comparison */
+    /* The file table keeps the basename apart from the directory already */
+    const char *bn1 = Files[a->id].name,*bn2 = Files[b->id].name;
+    
+    /* Are the basenames and mod times identical? */
+    if(0 == strcmp(bn1,bn2) && MTIME_SEC(a) == MTIME_SEC(b))
+      return 0;
+  }
+
+  /* Next order of business: compare the partial file hashes */
+  use_small_hash(a);
+  use_small_hash(b);
+
+  i = memcmp(HASHES(a)->partialhash,HASHES(b)->partialhash,HASHSIZE);
+  if(i != 0) /* They differ, no need to continue */
+    return i;
+
+  /* Partial hashes are the same, compare full file hashes */
+  use_big_hash(a);
+  use_big_hash(b);
+
+  i = memcmp(HASHES(a)->filehash,HASHES(b)->filehash,HASHSIZE);
+  if(i != 0){
+    Partial_hit_full_fail++;
+    return i;
+  }
+  return 0; /* We've passed the gauntlet; the files are the same! */
+}
+
+/* Make sure the hashes are available, counting a hit if they were already computed by an earlier comparison */
+void use_small_hash(struct entry *ep){
+  if(!HASHES(ep)->partialhash_present)
+    get_small_hash(ep);
+  else if(HASHES(ep)->partialhash_fresh)
+    HASHES(ep)->partialhash_fresh = 0; /* First use of a hash computed by the pool */
+  else
+    Block_hash_hits++;
+}
+
+/* Make sure ep has its sample hashes through the given stage */
+void use_sample_hash(struct entry *ep,int stage){
+  if(HASHES(ep)->sample_stage < stage){
+    while(HASHES(ep)->sample_stage < stage)
+      get_sample_hash(ep);
+  } else if(HASHES(ep)->samplehash_fresh & (1 << (stage - 1)))
+    HASHES(ep)->samplehash_fresh &= ~(1 << (stage - 1));
+  else
+    Sample_hits[stage-1]++;
+}
+
+void use_big_hash(struct entry *ep){
+  if(!HASHES(ep)->filehash_present){
+    if(ep->size >= TREE_MINSIZE || uring_hash(&ep,1) == -1)
+      get_big_hash(ep);
+  }
+  else if(HASHES(ep)->filehash_fresh)
+    HASHES(ep)->filehash_fresh = 0;
+  else
+    Full_hash_hits++;
+}
+
+/* Hash a buffer in one call */
+static void hash_buffer(const void *p,size_t len,unsigned char *md){
+  hash_ctx context;
+
+  hash_init(&context);
+  hash_update(&context,p,len);
+  hash_final(&context,md);
+  __atomic_add_fetch(&Bytes_hashed,len,__ATOMIC_RELAXED);
+}
+
+/* Hash the first page of ep. A small file is read whole, with one read, and its full hash computed from the
+ * same buffer: for one of a page or less the two are the same thing, and for the rest it costs little more
+ * than the page, where reading it again later would cost another open and read. Most files in a tree of
+ * millions of sources and configuration files never need more than this
+ */
+void get_small_hash(struct entry *ep){
+  if(!HASHES(ep)->partialhash_present){
+    int fd,i;
+    size_t len;
+    unsigned char buffer[SMALL_MAXSIZE];
+    char path[PATH_MAX+1];
+    double start;
+
+    if(cache_lookup(ep) && HASHES(ep)->partialhash_present)
+      return;
+    if(HASHES(ep)->filehash_present && ep->size <= PAGESIZE){
+      memcpy(HASHES(ep)->partialhash,HASHES(ep)->filehash,HASHSIZE); /* The first page is the whole file */
+      HASHES(ep)->partialhash_present = 1;
+      return;
+    }
+    start = now_seconds();
+    __atomic_add_fetch(&Block_hashes_computed,1,__ATOMIC_RELAXED); /* May run in a pool thread */
+    if((fd = timed_open(path_of(ep,path),O_RDONLY)) == -1){
+      fprintf(stderr,"can't open(%s): %d %s\n",path,errno,strerror(errno));
+      abort();
+    }
+    len = read_data(ep,fd,buffer,ep->size <= SMALL_MAXSIZE ? ep->size : PAGESIZE,0);
+    hash_buffer(buffer,len < PAGESIZE ? len : PAGESIZE,HASHES(ep)->partialhash);
+    if(ep->size <= SMALL_MAXSIZE && !HASHES(ep)->filehash_present){
+      if(len <= PAGESIZE)
+	memcpy(HASHES(ep)->filehash,HASHES(ep)->partialhash,HASHSIZE);
+      else
+	hash_buffer(buffer,len,HASHES(ep)->filehash);
+      HASHES(ep)->filehash_present = 1;
+      HASHES(ep)->filehash_fresh = 1;
+      __atomic_add_fetch(&Small_files,1,__ATOMIC_RELAXED);
+    }
+    i = close(fd);
+    assert(i == 0);
+    HASHES(ep)->partialhash_present = 1;
+    hist_add(&Hash_latency,start);
+  }
+}
+
+/* Hash one page of a file into context; a file that has shrunk contributes what's left */
+static void hash_page(struct entry *ep,int fd,off_t offset,hash_ctx *context){
+  unsigned char buffer[PAGESIZE];
+  size_t len = read_data(ep,fd,buffer,PAGESIZE,offset);
+
+  hash_update(context,buffer,len);
+  __atomic_add_fetch(&Bytes_hashed,len,__ATOMIC_RELAXED);
+}
+
+/* Compute ep's next sample hash: stage 1 hashes the last page, stage 2 SAMPLE_PAGES pages spread evenly
+ * through the file
+ */
+void get_sample_hash(struct entry *ep){
+  hash_ctx context;
+  off_t size = ep->size;
+  int fd,i;
+  char path[PATH_MAX+1];
+  double start = now_seconds();
+
+  assert(HASHES(ep)->sample_stage < SAMPLE_STAGES);
+  __atomic_add_fetch(&Sample_hashes[HASHES(ep)->sample_stage],1,__ATOMIC_RELAXED); /* May run in a pool thread */
+  if((fd = timed_open(path_of(ep,path),O_RDONLY)) == -1){
+    fprintf(stderr,"can't open(%s): %d %s\n",path,errno,strerror(errno));
+    abort();
+  }
+  hash_init(&context);
+  if(HASHES(ep)->sample_stage == 0){
+    hash_page(ep,fd,size > PAGESIZE ? size - PAGESIZE : 0,&context);
+  } else {
+    for(i=1;i<=SAMPLE_PAGES;i++)
+      hash_page(ep,fd,(size * i / (SAMPLE_PAGES + 1)) & ~(off_t)(PAGESIZE - 1),&context);
+  }
+  hash_final(&context,HASHES(ep)->samplehash[HASHES(ep)->sample_stage]);
+  i = close(fd);
+  assert(i == 0);
+  HASHES(ep)->sample_stage++;
+  hist_add(&Hash_latency,start);
+}
+
+/* Hash a whole file with read_data(), a piece at a time */
+static void read_hash(struct entry *ep,int fd,unsigned char *md){
+  size_t len;
+  off_t offset;
+  hash_ctx context;
+  unsigned char *buffer = (unsigned char *)malloc(READ_PIECE);
+
+  assert(buffer != NULL);
+  hash_init(&context);
+  for(offset = 0; (len = read_data(ep,fd,buffer,READ_PIECE,offset)) > 0; offset += len){
+    hash_update(&context,buffer,len);
+    __atomic_add_fetch(&Bytes_hashed,len,__ATOMIC_RELAXED);
+  }
+  hash_final(&context,md);
+  free(buffer);
+}
+
+/* Full hashes of big files. Mapping a file of hundreds of gigabytes with MAP_POPULATE wants that much address
+ * space and memory, and one thread hashes it only as fast as one core can go. But BLAKE3 is itself a tree
+ * of 1 KB chunks: cut the file into TREE_LEAF leaves and each one (but the last) is a complete subtree whose
+ * chaining value depends on nothing else. Tree_threads threads claim the leaves in order, read and hash them
+ * into a table of chaining values, which are then pushed into the file's hasher in order; the last leaf goes
+ * in as ordinary input. The result is the same hash the file gets read serially, so it mixes with the cache and
+ * with files hashed other ways.
+ *
+ * Each thread has one leaf buffer, and has the kernel start reading its next leaf while it hashes the current one,
+ * so reads and hashing overlap with no more than two leaves per thread in memory whatever the size of the file.
+ * A leaf that comes up short means the file shrank; it is then hashed serially for whatever it now holds, as the
+ * other paths do. With SHA-1, whose state can't be split, big files are simply hashed serially a piece at a time
+ */
+#define TREE_LEAF (4*1024*1024)	/* A power of 2 number of BLAKE3 chunks */
+#define TREE_MAXTHREADS 64
+
+#ifndef USE_SHA1
+struct treehash {
+  struct entry *ep;
+  int fd;
+  long long nleaves;	/* Whole leaves hashed by the threads, all but the last */
+  long long next;	/* Next leaf to claim */
+  int shrunk;
+  uint8_t (*cvs)[BLAKE3_OUT_LEN];
+};
+
+static void *tree_worker(void *arg){
+  struct treehash *t = (struct treehash *)arg;
+  unsigned char *buffer = (unsigned char *)malloc(TREE_LEAF);
+  long long leaf,ahead;
+
+  assert(buffer != NULL);
+  for(leaf = __atomic_fetch_add(&t->next,1,__ATOMIC_RELAXED); leaf < t->nleaves && !t->shrunk; leaf = ahead){
+    if(read_data(t->ep,t->fd,buffer,TREE_LEAF,(off_t)leaf * TREE_LEAF) < TREE_LEAF){
+      t->shrunk = 1;
+      break;
+    }
+    ahead = __atomic_fetch_add(&t->next,1,__ATOMIC_RELAXED);
+    if(ahead < t->nleaves && !Background_flag) /* In background mode every byte goes through the throttle */
+      posix_fadvise(t->fd,(off_t)ahead * TREE_LEAF,TREE_LEAF,POSIX_FADV_WILLNEED);
+    blake3_subtree(buffer,TREE_LEAF,(uint64_t)leaf * (TREE_LEAF / BLAKE3_CHUNK_LEN),t->cvs[leaf]);
+    __atomic_add_fetch(&Bytes_hashed,TREE_LEAF,__ATOMIC_RELAXED);
+  }
+  free(buffer);
+  return NULL;
+}
+#endif
+
+static void tree_hash(struct entry *ep,int fd,unsigned char *md){
+#ifndef USE_SHA1
+  struct treehash t;
+  pthread_t threads[TREE_MAXTHREADS];
+  blake3_hasher context;
+  unsigned char *buffer;
+  long long leaf;
+  size_t len;
+  int i,nthreads;
+
+  t.ep = ep;
+  t.fd = fd;
+  t.nleaves = (ep->size - 1) / TREE_LEAF;
+  t.next = 0;
+  t.shrunk = 0;
+  t.cvs = (uint8_t (*)[BLAKE3_OUT_LEN])malloc(t.nleaves * sizeof(*t.cvs));
+  assert(t.cvs != NULL);
+  nthreads = Tree_threads < TREE_MAXTHREADS ? Tree_threads : TREE_MAXTHREADS;
+  if(nthreads > t.nleaves)
+    nthreads = t.nleaves;
+  for(i=1;i<nthreads;i++){
+    if(pthread_create(&threads[i],NULL,tree_worker,&t) != 0)
+      break;
+  }
+  nthreads = i;
+  tree_worker(&t); /* This thread too */
+  for(i=1;i<nthreads;i++)
+    pthread_join(threads[i],NULL);
+
+  if(!t.shrunk){
+    hash_init(&context);
+    for(leaf=0;leaf<t.nleaves;leaf++)
+      blake3_hasher_push_subtree(&context,t.cvs[leaf],TREE_LEAF);
+    buffer = (unsigned char *)malloc(TREE_LEAF);
+    assert(buffer != NULL);
+    len = read_data(ep,fd,buffer,ep->size - t.nleaves * TREE_LEAF,(off_t)t.nleaves * TREE_LEAF);
+    hash_update(&context,buffer,len);
+    __atomic_add_fetch(&Bytes_hashed,len,__ATOMIC_RELAXED);
+    hash_final(&context,md);
+    free(buffer);
+    free(t.cvs);
+    __atomic_add_fetch(&Tree_hashes,1,__ATOMIC_RELAXED);
+    return;
+  }
+  free(t.cvs);
+#endif
+  read_hash(ep,fd,md);
+}
+
+void get_big_hash(struct entry *ep){
+
+  if(!HASHES(ep)->filehash_present){
+    int fd,i;
+    void *p;
+    char path[PATH_MAX+1];
+    double start;
+
+    if(cache_lookup(ep) && HASHES(ep)->filehash_present)
+      return;
+    start = now_seconds();
+    __atomic_add_fetch(&Full_hashes_computed,1,__ATOMIC_RELAXED);
+    if((fd = timed_open(path_of(ep,path),O_RDONLY)) == -1){
+      fprintf(stderr,"can't open(%s): %d %s\n",path,errno,strerror(errno));
+      abort();
+    }
+    assert(fd != -1);
+    /* In background mode the file is read a piece at a time, so each piece can be charged and dropped */
+    if(ep->size >= TREE_MINSIZE)
+      tree_hash(ep,fd,HASHES(ep)->filehash);
+    else if(!Background_flag
+	    && (p = mmap(NULL, ep->size, PROT_READ, MAP_NOCACHE|MAP_FILE|MAP_SHARED|MAP_POPULATE, fd, 0)) != MAP_FAILED){
+      hash_buffer(p,ep->size,HASHES(ep)->filehash);
+      i = munmap(p,ep->size);
+      assert(i == 0);
+    } else { /* Not enough address space to map entire file? */
+      if(!Background_flag)
+	__atomic_add_fetch(&Map_fails,1,__ATOMIC_RELAXED);
+      read_hash(ep,fd,HASHES(ep)->filehash);
+    }
+    i = close(fd);
+    assert(i == 0);
+    HASHES(ep)->filehash_present = 1;
+    hist_add(&Hash_latency,start);
+  }
+}
+
+/* Background mode (-B), for running beside a production load. Every read of file data goes through read_data().
+ * It first tries the read with RWF_NOWAIT, which only succeeds with what's already in the page cache: that costs
+ * the disk nothing and is left where it is. Whatever has to come from the device is first charged to the rate
+ * limits, then dropped from the page cache once it has been read, so a run over a big tree doesn't push other
+ * programs' data out of memory. (O_DIRECT would leave the cache alone too, but needs aligned buffers and offsets,
+ * bypasses what is already cached and defeats readahead, and not every file system supports it.)
+ *
+ * The limits are token buckets kept as virtual clocks (GCRA): each read pushes the time the next one may start
+ * forward by its cost, bytes / rate and 1 / IOPS, and a read waits until both clocks allow it, less a short burst.
+ *
+ * Once a second the monitor thread looks at the kernel's pressure stall information, the share of the last
+ * ten seconds in which some task was waiting for I/O or memory. Above PSI_IO_LIMIT or PSI_MEMORY_LIMIT percent,
+ * the rates are halved, down to 1/THROTTLE_MINSCALE of what was asked, or with no rates set reading stops
+ * altogether; once pressure falls below half the limits the rates come back a step a second. Our own reads count
+ * towards I/O pressure as well, so on a slow disk this settles at the rate the disk can give us without stalling
+ * others. Without /proc/pressure (older kernels, other systems) only the fixed limits apply
+ */
+#define THROTTLE_BURST 0.05	/* Seconds of reading that may be done at once after a pause */
+#define THROTTLE_MINSCALE 64
+#define PSI_IO_LIMIT 10.0	/* Percent "some" stall over 10 s */
+#define PSI_MEMORY_LIMIT 5.0
+#define PSI_HOLD 10		/* Seconds after a cut before another, for the averages to catch up */
+
+static pthread_mutex_t Throttle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double Bytes_clock,Iops_clock;	/* When the next read may start, less THROTTLE_BURST */
+static double Rate_scale = 1;		/* Share of the rates allowed under pressure; under Throttle_mutex */
+static volatile int Pressure_stop;	/* No rates, and too much pressure: don't read at all */
+
+/* Read up to len bytes of ep at offset, fewer only at the end of the file. Aborts on a read error */
+size_t read_data(struct entry *ep,int fd,void *buf,size_t len,off_t offset){
+  size_t done = 0,cached = 0;
+  ssize_t r;
+  char path[PATH_MAX+1];
+
+  if(Background_flag){
+    off_t left = ep->size - offset;
+#ifdef RWF_NOWAIT
+    struct iovec iov = { buf, len };
+
+    if((r = preadv2(fd,&iov,1,offset,RWF_NOWAIT)) > 0)
+      done = cached = r;
+    __atomic_add_fetch(&Background_cached,cached,__ATOMIC_RELAXED);
+#endif
+    if(left > (off_t)done)
+      throttle(left < (off_t)len ? left - done : len - done);
+  }
+  for(; done < len; done += r){
+    if((r = pread(fd,(char *)buf + done,len - done,offset + done)) == 0)
+      break;
+    if(r == -1){
+      if(errno == EINTR){
+	r = 0;
+	continue;
+      }
+      fprintf(stderr,"Read error on %s: %d %s\n",path_of(ep,path),errno,strerror(errno));
+      abort();
+    }
+  }
+#ifdef POSIX_FADV_DONTNEED
+  if(Background_flag && done > cached)
+    posix_fadvise(fd,offset + cached,done - cached,POSIX_FADV_DONTNEED);
+#endif
+  return done;
+}
+
+/* Take a reservation on a virtual clock for a read costing cost seconds; returns when it may start */
+static double clock_take(double *clock,double now,double cost){
+  double start = *clock - THROTTLE_BURST > now ? *clock - THROTTLE_BURST : now;
+
+  *clock = (*clock > now ? *clock : now) + cost;
+  return start;
+}
+
+/* Wait until the limits allow a read of this many bytes from the device. Any thread */
+void throttle(size_t bytes){
+  struct timespec ts;
+  double now,start,t;
+
+  while(Pressure_stop){
+    ts.tv_sec = 0;
+    ts.tv_nsec = 100000000;
+    nanosleep(&ts,NULL);
+    pthread_mutex_lock(&Throttle_mutex);
+    Pressure_wait += 0.1;
+    pthread_mutex_unlock(&Throttle_mutex);
+  }
+  if(Rate_bytes <= 0 && Rate_iops <= 0)
+    return;
+  pthread_mutex_lock(&Throttle_mutex);
+  start = now = now_seconds();
+  if(Rate_bytes > 0 && (t = clock_take(&Bytes_clock,now,bytes / (Rate_bytes * Rate_scale))) > start)
+    start = t;
+  if(Rate_iops > 0 && (t = clock_take(&Iops_clock,now,1 / (Rate_iops * Rate_scale))) > start)
+    start = t;
+  Throttle_wait += start - now;
+  pthread_mutex_unlock(&Throttle_mutex);
+  if(start > now){
+    ts.tv_sec = start - now;
+    ts.tv_nsec = (start - now - ts.tv_sec) * 1e9;
+    nanosleep(&ts,NULL);
+  }
+}
+
+/* The "some avg10" figure from a PSI file, in percent; -1 if there isn't one */
+static double pressure(const char *path){
+  FILE *fp;
+  double avg = -1;
+
+  if((fp = fopen(path,"r")) == NULL)
+    return -1;
+  if(fscanf(fp,"some avg10=%lf",&avg) != 1)
+    avg = -1;
+  fclose(fp);
+  return avg;
+}
+
+/* Adjust the rates to the pressure on the system: multiplicative decrease, additive increase. Monitor thread */
+void pressure_check(void){
+  static int hold;
+  double io = pressure("/proc/pressure/io");
+  double memory = pressure("/proc/pressure/memory");
+
+  if(hold > 0)
+    hold--;
+  if(io > PSI_IO_LIMIT || memory > PSI_MEMORY_LIMIT){
+    if(hold > 0)
+      return;
+    hold = PSI_HOLD;
+    Pressure_backoffs++;
+    if(Rate_bytes <= 0 && Rate_iops <= 0)
+      Pressure_stop = 1;
+    pthread_mutex_lock(&Throttle_mutex);
+    if(Rate_scale > 1.0 / THROTTLE_MINSCALE)
+      Rate_scale /= 2;
+    pthread_mutex_unlock(&Throttle_mutex);
+  } else if(io < PSI_IO_LIMIT / 2 && memory < PSI_MEMORY_LIMIT / 2){
+    Pressure_stop = 0;
+    pthread_mutex_lock(&Throttle_mutex);
+    Rate_scale += 1.0 / 16;
+    if(Rate_scale > 1)
+      Rate_scale = 1;
+    pthread_mutex_unlock(&Throttle_mutex);
+  }
+}
+
+/* Hashing pool. The main thread hands out a batch of entries and works on it alongside the pool threads;
+ * each thread claims the next unhashed entry until the batch is exhausted.
+ * Entries are claimed through per-device queues; see pool_run()
+ */
+static pthread_mutex_t Pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t Pool_done = PTHREAD_COND_INITIALIZER;
+static int Pool_workers;		/* Threads besides main */
+static unsigned Pool_generation;	/* Bumped for every new batch */
+static int Pool_busy;			/* Workers that haven't finished the current batch */
+static struct entry **Pool_batch;
+static int Pool_batchsize;
+static int Pool_next;			/* Entries claimed so far */
+static void (*Pool_func)(struct entry *);
+static void (*Pool_task)(void);		/* If set, run by each worker instead of claiming entries */
+
+/* Per-device scheduling. Entries come out of dupgroup_sort() in size order, and when the input is spread
+ * over several disks the files of neighbouring sizes may well all be on one of them while the rest sit idle.
+ * So each batch is split into a queue per device and the threads take work from the queues in turn, never
+ * running more than a device's limit at once: a couple of readers on a disk with heads to move, where more
+ * would only make it seek between them, and many on SSDs and NVMe, which need deep queues to reach their
+ * speed. Whether a device is rotational comes from sysfs. Unless -j is given, the pool is made big enough for
+ * every device in the input to have its full share of readers (the threads mostly wait for reads, so this
+ * can be more than there are CPUs)
+ */
+#define DEVICE_ROTATIONAL 2	/* Readers at once on a hard disk */
+#define DEVICE_SOLID 16		/* On an SSD or NVMe drive */
+#define DEVICE_OTHER 4		/* Network and virtual file systems, or no sysfs */
+#define POOL_MAXTHREADS 64
+
+struct devqueue {
+  int limit;		/* Readers allowed at once; 0 until looked up */
+  int rotational;	/* 1, 0, or -1 if we can't tell; set with limit */
+  int active;		/* Entries being worked on */
+  int count;		/* Entries in the current batch */
+  int next,end;		/* Its unclaimed entries in Pool_batch[] */
+};
+static struct devqueue Devq[USHRT_MAX+1];	/* Indexed like Devices[] */
+static pthread_mutex_t Device_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Device_free = PTHREAD_COND_INITIALIZER;	/* A device may take another reader */
+static struct entry **Pool_order;	/* The batch, each device's entries together */
+static unsigned short *Pool_devs;	/* Devices with entries in the batch */
+static int Pool_ndevs;
+static int Pool_turn;			/* Which of them to offer the next thread first */
+
+/* Find out whether device dev is rotational, and so how many readers it should have */
+static void device_probe(unsigned short dev){
+  struct devqueue *q = &Devq[dev];
+#ifdef __linux__
+  char path[PATH_MAX];
+  FILE *fp;
+  int rotational;
+
+  /* A partition's queue is its disk's */
+  snprintf(path,sizeof(path),"/sys/dev/block/%u:%u/queue/rotational",major(Devices[dev]),minor(Devices[dev]));
+  if((fp = fopen(path,"r")) == NULL){
+    snprintf(path,sizeof(path),"/sys/dev/block/%u:%u/../queue/rotational",major(Devices[dev]),minor(Devices[dev]));
+    fp = fopen(path,"r");
+  }
+  if(fp != NULL){
+    if(fscanf(fp,"%d",&rotational) != 1)
+      rotational = -1;
+    fclose(fp);
+    if(rotational >= 0){
+      q->rotational = rotational != 0;
+      q->limit = rotational ? DEVICE_ROTATIONAL : DEVICE_SOLID;
+      return;
+    }
+  }
+#endif
+  q->rotational = -1;
+  q->limit = DEVICE_OTHER;
+}
+
+/* Size of the pool: nthreads, or enough for every device to have all its readers if that's more */
+int device_threads(int nthreads){
+  int i,sum = 0;
+
+  if(Ndevices < 2)
+    return nthreads;
+  for(i=0;i<Ndevices;i++){
+    if(Devq[i].limit == 0)
+      device_probe(i);
+    sum += Devq[i].limit;
+  }
+  if(sum > POOL_MAXTHREADS)
+    sum = POOL_MAXTHREADS;
+  return sum > nthreads ? sum : nthreads;
+}
+
+/* Physical order (-p). On a hard disk, reading files in size order sends the heads all over the platters; in
+ * the order of their first blocks, each pass over a batch is one sweep across the disk. The first block of
+ * each candidate comes from FIEMAP, or FIBMAP where that's missing (FIBMAP needs privileges on most systems),
+ * looked up on the pool threads before the first page hashes. Files we can't locate go first, in their usual
+ * order. SSDs are left alone; on devices sysfs says nothing about, the order can't hurt
+ */
+static void get_physical(struct entry *ep){
+#ifdef __linux__
+  unsigned long long buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(unsigned long long) + 1];
+  struct fiemap *fm = (struct fiemap *)buf;
+  char path[PATH_MAX+1];
+  int fd,block = 0,blocksize;
+
+  if(Devq[ep->dev].rotational == 0)
+    return;
+  if((fd = timed_open(path_of(ep,path),O_RDONLY)) == -1)
+    return; /* Reported when it's read */
+  memset(buf,0,sizeof(buf));
+  fm->fm_length = FIEMAP_MAX_OFFSET;
+  fm->fm_extent_count = 1;
+  if(ioctl(fd,FS_IOC_FIEMAP,fm) == 0 && fm->fm_mapped_extents > 0)
+    HASHES(ep)->physical = fm->fm_extents[0].fe_physical;
+  else if(ioctl(fd,FIBMAP,&block) == 0 && ioctl(fd,FIGETBSZ,&blocksize) == 0)
+    HASHES(ep)->physical = (unsigned long long)block * blocksize;
+  close(fd);
+#endif
+  if(HASHES(ep)->physical != 0)
+    __atomic_add_fetch(&Physical_found,1,__ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&Physical_unknown,1,__ATOMIC_RELAXED);
+}
+
+/* By disk address, then by place in the file table. Files -b chunks may have no hashes, so no address */
+static int compare_physical(const void *ap,const void *bp){
+  const struct entry *a = *(struct entry * const *)ap;
+  const struct entry *b = *(struct entry * const *)bp;
+  unsigned long long pa = HASHES(a) != NULL ? HASHES(a)->physical : 0;
+  unsigned long long pb = HASHES(b) != NULL ? HASHES(b)->physical : 0;
+
+  if(pa != pb)
+    return pa < pb ? -1 : 1;
+  return a < b ? -1 : a > b;
+}
+
+/* Put each device's entries of batch together in Pool_order[], keeping their order, and set up the queues */
+static void device_queues(struct entry **batch,int n){
+  static int allocated;
+  struct devqueue *q;
+  int k,pos;
+
+  if(allocated < n){
+    Pool_order = (struct entry **)realloc(Pool_order,n * sizeof(*Pool_order));
+    Pool_devs = (unsigned short *)realloc(Pool_devs,n * sizeof(*Pool_devs));
+    assert(Pool_order != NULL && Pool_devs != NULL);
+    allocated = n;
+  }
+  Pool_ndevs = 0;
+  for(k=0;k<n;k++){
+    if(Devq[batch[k]->dev].count++ == 0)
+      Pool_devs[Pool_ndevs++] = batch[k]->dev;
+  }
+  for(k=pos=0;k<Pool_ndevs;k++){
+    q = &Devq[Pool_devs[k]];
+    if(q->limit == 0)
+      device_probe(Pool_devs[k]);
+    q->next = q->end = pos;
+    pos += q->count;
+    q->count = 0;
+  }
+  for(k=0;k<n;k++)
+    Pool_order[Devq[batch[k]->dev].end++] = batch[k];
+  if(Physical_flag){
+    for(k=0;k<Pool_ndevs;k++){
+      q = &Devq[Pool_devs[k]];
+      if(q->rotational != 0)
+	qsort(&Pool_order[q->next],q->end - q->next,sizeof(*Pool_order),compare_physical);
+    }
+  }
+  Pool_turn = 0;
+}
+
+#ifdef HAVE_URING
+/* Reorder batch to take each device in turn, for the io_uring reader, which opens files in batch order */
+static void device_interleave(struct entry **batch,int n){
+  struct devqueue *q;
+  int i,k;
+
+  device_queues(batch,n);
+  if(Pool_ndevs < 2)
+    return;
+  for(k=0;k<n;){
+    for(i=0;i<Pool_ndevs;i++){
+      q = &Devq[Pool_devs[i]];
+      if(q->next < q->end)
+	batch[k++] = Pool_order[q->next++];
+    }
+  }
+}
+#endif
+
+/* Claim entries from the device queues in turn, skipping devices that have all the readers they may */
+static void pool_run(void){
+  struct devqueue *q = NULL;
+  struct entry *ep;
+  int i;
+
+  pthread_mutex_lock(&Device_mutex);
+  while(Pool_next < Pool_batchsize){
+    for(i=0;i<Pool_ndevs;i++){
+      q = &Devq[Pool_devs[(Pool_turn + i) % Pool_ndevs]];
+      if(q->next < q->end && q->active < q->limit)
+	break;
+    }
+    if(i == Pool_ndevs){
+      pthread_cond_wait(&Device_free,&Device_mutex);
+      continue;
+    }
+    Pool_turn = (Pool_turn + i + 1) % Pool_ndevs;
+    ep = Pool_batch[q->next++];
+    q->active++;
+    if(++Pool_next == Pool_batchsize)
+      pthread_cond_broadcast(&Device_free); /* Let the waiters go */
+    pthread_mutex_unlock(&Device_mutex);
+
+    (*Pool_func)(ep);
+
+    pthread_mutex_lock(&Device_mutex);
+    q->active--;
+    pthread_cond_signal(&Device_free);
+  }
+  pthread_mutex_unlock(&Device_mutex);
+}
+
+static void *pool_worker(void *arg){
+  unsigned generation = 0;
+
+  for(;;){
+    pthread_mutex_lock(&Pool_mutex);
+    while(Pool_generation == generation)
+      pthread_cond_wait(&Pool_start,&Pool_mutex);
+    generation = Pool_generation;
+    pthread_mutex_unlock(&Pool_mutex);
+
+    if(Pool_task != NULL)
+      (*Pool_task)();
+    else
+      pool_run();
+
+    pthread_mutex_lock(&Pool_mutex);
+    if(--Pool_busy == 0)
+      pthread_cond_signal(&Pool_done);
+    pthread_mutex_unlock(&Pool_mutex);
+  }
+  return NULL;
+}
+
+void hash_pool_start(int nthreads){
+  int i;
+  pthread_t tid;
+
+  for(i=1;i<nthreads;i++){
+    if(pthread_create(&tid,NULL,pool_worker,NULL) != 0){
+      fprintf(stderr,"can't create hash thread: %d %s\n",errno,strerror(errno));
+      break; /* Carry on with what we have */
+    }
+    pthread_detach(tid);
+    Pool_workers++;
+  }
+}
+
+/* Set every worker going on the current batch, or on task if it's not NULL */
+static void pool_start(void (*task)(void)){
+  pthread_mutex_lock(&Pool_mutex);
+  Pool_task = task;
+  Pool_busy = Pool_workers;
+  Pool_generation++;
+  pthread_cond_broadcast(&Pool_start);
+  pthread_mutex_unlock(&Pool_mutex);
+}
+
+/* Wait for every worker to finish */
+static void pool_wait(void){
+  pthread_mutex_lock(&Pool_mutex);
+  while(Pool_busy > 0)
+    pthread_cond_wait(&Pool_done,&Pool_mutex);
+  pthread_mutex_unlock(&Pool_mutex);
+}
+
+/* Apply func to every entry in batch using the whole pool; returns when all are done */
+static void pool_hash(struct entry **batch,int n,void (*func)(struct entry *)){
+  if(n == 0)
+    return;
+  device_queues(batch,n);
+  Pool_batch = Pool_order;
+  Pool_batchsize = n;
+  Pool_next = 0;
+  Pool_func = func;
+  pool_start(NULL);
+
+  pool_run();
+
+  pool_wait();
+}
+
+static int compare_ino(const void *ap,const void *bp){
+  const struct entry *a = *(struct entry * const *)ap;
+  const struct entry *b = *(struct entry * const *)bp;
+
+  if(a->ino != b->ino)
+    return a->ino < b->ino ? -1 : 1;
+  return 0;
+}
+
+/* Same size and device, same first page hash and same sample hashes so far? */
+static int compare_bucket(const void *ap,const void *bp){
+  const struct entry *a = *(struct entry * const *)ap;
+  const struct entry *b = *(struct entry * const *)bp;
+  int i,stage;
+
+  if(a->size != b->size)
+    return a->size < b->size ? -1 : 1;
+  if(a->dev != b->dev)
+    return a->dev < b->dev ? -1 : 1;
+  if((i = memcmp(HASHES(a)->partialhash,HASHES(b)->partialhash,HASHSIZE)) != 0)
+    return i;
+  if(HASHES(a)->sample_stage != HASHES(b)->sample_stage)
+    return HASHES(a)->sample_stage < HASHES(b)->sample_stage ? -1 : 1;
+  for(stage=0;stage<HASHES(a)->sample_stage;stage++){
+    if((i = memcmp(HASHES(a)->samplehash[stage],HASHES(b)->samplehash[stage],HASHSIZE)) != 0)
+      return i;
+  }
+  return 0;
+}
+
+/* Sort inodes (one entry each) into buckets by compare_bucket() and keep only those holding more than one.
+ * Returns how many are left
+ */
+static int keep_buckets(struct entry **batch,int n){
+  int m,run,out;
+
+  qsort(batch,n,sizeof(*batch),compare_bucket);
+  for(m=out=0;m<n;m=run){
+    for(run=m+1;run < n && compare_bucket(&batch[m],&batch[run]) == 0;run++)
+      ;
+    if(run - m > 1){
+      while(m < run)
+	batch[out++] = batch[m++];
+    }
+  }
+  return out;
+}
+
+/* Compute in parallel every hash the comparison loop is going to want for the size groups starting at
+ * entries[first], gathering groups until there's enough work to keep the pool busy.
+ * Each distinct inode gets its first page hashed; only inodes whose first page hash matches that of another
+ * inode in the same group go on to the sample hashes (if big enough) and then to a full file hash, which is
+ * just what the serial comparisons would compute. Extra links to an inode get copies of its hashes.
+ * Returns the index of the first entry not covered.
+ */
+int prefetch_hashes(struct entry *entries,int first,int nfiles){
+  static struct entry **cand;	/* Candidates, grouped, each group sorted by inode */
+  static struct entry **batch;	/* One entry per inode needing a hash */
+  static struct entry **sampled;
+  static int *group;		/* Start of each group in cand[] */
+  static int allocated;
+  long long room = 0;		/* With -L in bytes, what's left to read */
+  int ncand,ngroups,nbatch,nsampled,stage,g,k,m,end,run,out;
+
+  if(allocated < nfiles + 1){
+    cand = (struct entry **)realloc(cand,(nfiles + 1) * sizeof(*cand));
+    batch = (struct entry **)realloc(batch,(nfiles + 1) * sizeof(*batch));
+    sampled = (struct entry **)realloc(sampled,(nfiles + 1) * sizeof(*sampled));
+    group = (int *)realloc(group,(nfiles + 1) * sizeof(*group));
+    assert(cand != NULL && batch != NULL && sampled != NULL && group != NULL);
+    allocated = nfiles + 1;
+  }
+  ncand = ngroups = nbatch = 0;
+  if(Byte_budget > 0)
+    room = Byte_budget - Bytes_hashed - Stream_bytes;
+  for(k=first; k < nfiles && ncand < PREFETCH_BATCH * Hash_threads; k = end){
+    for(end=k+1;
+	end < nfiles
+	  && entries[k].size == entries[end].size
+	  && entries[k].dev == entries[end].dev;
+	end++)
+      ;
+    if(end - k < 2)
+      continue; /* Unique size, never compared */
+    if(Fast_flag && entries[k].size > Fast_threshold)
+      continue; /* Comparisons may not need any hashes; leave them to be computed lazily */
+    if(Byte_budget > 0){
+      /* Stop where the group could take the read budget past what's left, so compare_start() checks the
+       * budget before it's spent on groups that won't be compared; the first group is the one it's about to do
+       */
+      if(ngroups > 0 && (long long)entries[k].size * (end - k) > room)
+	break;
+      room -= (long long)entries[k].size * (end - k);
+    }
+
+    group[ngroups++] = ncand;
+    for(m=k;m<end;m++){
+      if(!entries[m].gone){
+	alloc_hashes(&entries[m]); /* Here, as the pool threads can't */
+	cand[ncand++] = &entries[m];
+      }
+    }
+    qsort(&cand[group[ngroups-1]],ncand - group[ngroups-1],sizeof(*cand),compare_ino);
+  }
+  group[ngroups] = ncand;
+
+  /* First page hashes, one per inode */
+  for(m=0;m<ncand;m++){
+    if(m == 0 || cand[m]->ino != cand[m-1]->ino)
+      batch[nbatch++] = cand[m];
+  }
+  if(Physical_flag)
+    pool_hash(batch,nbatch,get_physical); /* So that the hashes can be read in disk order */
+  pool_hash(batch,nbatch,get_small_hash);
+  for(m=0;m<ncand;m++){
+    if(m == 0 || cand[m]->ino != cand[m-1]->ino){
+      HASHES(cand[m])->partialhash_fresh = 1;
+    } else {
+      memcpy(HASHES(cand[m])->partialhash,HASHES(cand[m-1])->partialhash,HASHSIZE);
+      HASHES(cand[m])->partialhash_present = 1;
+    }
+  }
+
+  /* Inodes sharing a first page hash with another inode of the same group */
+  nbatch = 0;
+  for(g=0;g<ngroups;g++){
+    for(m=group[g];m<group[g+1];m++){
+      if(m == group[g] || cand[m]->ino != cand[m-1]->ino)
+	batch[nbatch++] = cand[m];
+    }
+  }
+  nbatch = keep_buckets(batch,nbatch);
+
+  /* Narrow big files down by their sample hashes a stage at a time, as split_bucket() will */
+  for(stage=0;stage<SAMPLE_STAGES;stage++){
+    nsampled = 0;
+    for(m=0;m<nbatch;m=run){
+      int hashed = 0;
+
+      for(run=m;run < nbatch && compare_bucket(&batch[m],&batch[run]) == 0;run++)
+	hashed += HASHES(batch[run])->filehash_present != 0;
+      if(hashed < run - m && batch[m]->size >= SAMPLE_MINSIZE){
+	for(;m < run;m++){
+	  if(HASHES(batch[m])->sample_stage == stage) /* Not already known, e.g., from the cache */
+	    sampled[nsampled++] = batch[m];
+	}
+      }
+    }
+    if(nsampled == 0)
+      continue; /* A later stage may still split the buckets whose hashes were all cached */
+    pool_hash(sampled,nsampled,get_sample_hash);
+    for(m=0;m<nsampled;m++)
+      HASHES(sampled[m])->samplehash_fresh |= 1 << stage;
+    nbatch = keep_buckets(batch,nbatch);
+  }
+
+  /* Full hashes for the rest, except where they'll be compared in lockstep instead */
+  for(m=out=0;m<nbatch;m=run){
+    for(run=m+1;run < nbatch && compare_bucket(&batch[m],&batch[run]) == 0;run++)
+      ;
+    if(!stream_wanted(batch[m]->size,run - m)){
+      while(m < run)
+	batch[out++] = batch[m++];
+    }
+  }
+  nbatch = out;
+  /* Big files last, hashed one at a time here, as each already keeps Tree_threads threads busy */
+  for(m=out=nsampled=0;m<nbatch;m++){
+    if(batch[m]->size >= TREE_MINSIZE)
+      sampled[nsampled++] = batch[m];
+    else
+      batch[out++] = batch[m];
+  }
+  memcpy(&batch[out],sampled,nsampled * sizeof(*batch));
+  if(uring_hash(batch,out) == -1)
+    pool_hash(batch,out,get_big_hash);
+  for(m=out;m<nbatch;m++)
+    get_big_hash(batch[m]);
+  for(m=0;m<nbatch;m++)
+    HASHES(batch[m])->filehash_fresh = 1;
+  for(m=1;m<ncand;m++){
+    if(cand[m]->ino == cand[m-1]->ino && HASHES(cand[m-1])->filehash_present){
+      memcpy(HASHES(cand[m])->filehash,HASHES(cand[m-1])->filehash,HASHSIZE);
+      HASHES(cand[m])->filehash_present = 1;
+    }
+  }
+  return k;
+}
+
+#ifdef HAVE_URING
+/* Full file hashes read through io_uring. The main thread keeps up to Uring_entries large reads in flight
+ * across many files at once, each into one of a fixed set of registered buffers. Completed buffers are handed,
+ * in file order, to whichever thread is free to hash them (a file is hashed by one thread at a time) and then
+ * go back on the free list. No file ever holds more than URING_PERFILE buffers, so memory use is fixed
+ * however large the files are. The ring is only ever used from the main thread.
+ */
+#define URING_BUFSIZE (256*1024)
+#define URING_PERFILE 4
+
+struct ufile;
+
+struct ubuf {
+  struct ubuf *next;		/* On the free list, or the file's list of completed reads in offset order */
+  struct ufile *file;
+  unsigned char *data;
+  off_t offset;
+  unsigned int len;		/* Bytes asked for */
+  unsigned int done;		/* Bytes read so far */
+  int index;			/* Registered buffer number */
+};
+
+struct ufile {
+  struct ufile *next;		/* Hash queue */
+  struct entry *ep;		/* NULL when the slot is free */
+  int fd;
+  off_t submitted;		/* Reads issued up to here */
+  off_t hashed;			/* Hashed up to here */
+  int buffers;			/* Buffers being read or waiting to be hashed */
+  int queued;			/* On the hash queue or being hashed */
+  struct ubuf *ready;		/* Completed reads not yet hashed */
+  hash_ctx context;
+  double started;		/* For Hash_latency */
+};
+
+static int Uring_fd = -1;
+static unsigned Uring_entries;		/* Reads in flight at most */
+static unsigned *Sq_head,*Sq_tail,*Sq_mask,*Sq_array;
+static unsigned *Cq_head,*Cq_tail,*Cq_mask;
+static struct io_uring_sqe *Sqes;
+static struct io_uring_cqe *Cqes;
+static unsigned Uring_pending;		/* Reads set up but not yet submitted */
+static unsigned Uring_queued;		/* Reads set up and not yet completed */
+static struct ufile *Ufiles;		/* Uring_entries slots */
+
+/* Shared with the hashing threads */
+static pthread_mutex_t Uring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Uring_work = PTHREAD_COND_INITIALIZER;	 /* Something on the hash queue, or all done */
+static pthread_cond_t Uring_progress = PTHREAD_COND_INITIALIZER; /* Buffers freed or a file finished */
+static struct ubuf *Ufree;
+static struct ufile *Uqueue,*Uqueue_tail;
+static int Uring_open;			/* Files being read or hashed */
+static int Uring_finished;		/* No more files; hashing threads go back to the pool */
+
+/* Set up the ring and its buffers. On any failure (old kernel, not permitted, registered memory limit)
+ * the ring is just not used and files are mapped and hashed as before
+ */
+void uring_start(int depth){
+  struct io_uring_params params;
+  struct iovec *iov;
+  unsigned char *sq,*cq,*data;
+  size_t sqsize,cqsize;
+  int fd,i,nbufs;
+
+  if(depth <= 0)
+    return;
+  memset(&params,0,sizeof(params));
+  if((fd = syscall(__NR_io_uring_setup,depth,&params)) == -1)
+    return;
+  sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    if(cqsize > sqsize)
+      sqsize = cqsize;
+    cqsize = sqsize;
+  }
+  sq = mmap(NULL,sqsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+  if(sq == MAP_FAILED){
+    close(fd);
+    return;
+  }
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    cq = sq;
+  else
+    cq = mmap(NULL,cqsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+  Sqes = mmap(NULL,params.sq_entries * sizeof(struct io_uring_sqe),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+	      fd,IORING_OFF_SQES);
+  if(cq == MAP_FAILED || Sqes == MAP_FAILED){
+    close(fd); /* The mappings go with the process */
+    return;
+  }
+  Sq_head = (unsigned *)(sq + params.sq_off.head);
+  Sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  Sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  Sq_array = (unsigned *)(sq + params.sq_off.array);
+  Cq_head = (unsigned *)(cq + params.cq_off.head);
+  Cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  Cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  Cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  Uring_entries = params.sq_entries; /* The completion ring is at least as big, so it can't overflow */
+
+  /* Twice as many buffers as reads in flight, so files can be hashed while the next reads proceed */
+  nbufs = 2 * Uring_entries;
+  data = mmap(NULL,(size_t)nbufs * URING_BUFSIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  Ufiles = (struct ufile *)calloc(Uring_entries,sizeof(*Ufiles));
+  iov = (struct iovec *)calloc(nbufs,sizeof(*iov));
+  if(data == MAP_FAILED || Ufiles == NULL || iov == NULL){
+    close(fd);
+    return;
+  }
+  for(i=0;i<nbufs;i++){
+    iov[i].iov_base = data + (size_t)i * URING_BUFSIZE;
+    iov[i].iov_len = URING_BUFSIZE;
+  }
+  if(syscall(__NR_io_uring_register,fd,IORING_REGISTER_BUFFERS,iov,nbufs) == -1){
+    close(fd);
+    free(iov);
+    return;
+  }
+  for(i=nbufs-1;i>=0;i--){
+    struct ubuf *b = (struct ubuf *)calloc(1,sizeof(*b));
+
+    assert(b != NULL);
+    b->data = iov[i].iov_base;
+    b->index = i;
+    b->next = Ufree;
+    Ufree = b;
+  }
+  free(iov);
+  Uring_fd = fd;
+}
+
+/* Set up a read of the rest of buffer b. Only the main thread touches the submission ring */
+static void uring_read(struct ubuf *b){
+  unsigned tail = *Sq_tail;
+  unsigned index = tail & *Sq_mask;
+  struct io_uring_sqe *sqe = &Sqes[index];
+
+  memset(sqe,0,sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->fd = b->file->fd;
+  sqe->off = b->offset + b->done;
+  sqe->addr = (unsigned long)(b->data + b->done);
+  sqe->len = b->len - b->done;
+  sqe->buf_index = b->index;
+  sqe->user_data = (unsigned long)b;
+  Sq_array[index] = index;
+  __atomic_store_n(Sq_tail,tail + 1,__ATOMIC_RELEASE);
+  Uring_pending++;
+  Uring_queued++;
+}
+
+static void uring_enqueue(struct ufile *f){
+  f->queued = 1;
+  f->next = NULL;
+  if(Uqueue == NULL)
+    Uqueue = f;
+  else
+    Uqueue_tail->next = f;
+  Uqueue_tail = f;
+  pthread_cond_signal(&Uring_work);
+}
+
+/* Collect completed reads. Called with Uring_mutex held */
+static void uring_reap(void){
+  unsigned head = *Cq_head;
+
+  while(head != __atomic_load_n(Cq_tail,__ATOMIC_ACQUIRE)){
+    struct io_uring_cqe *cqe = &Cqes[head & *Cq_mask];
+    struct ubuf *b = (struct ubuf *)(unsigned long)cqe->user_data;
+    struct ufile *f = b->file;
+    struct ubuf **bp;
+    int res = cqe->res;
+
+    head++;
+    Uring_queued--;
+    if(res == -EINTR || res == -EAGAIN){
+      uring_read(b);
+      continue;
+    }
+    if(res < 0){
+      char path[PATH_MAX+1];
+
+      fprintf(stderr,"Read error on %s: %d %s\n",path_of(f->ep,path),-res,strerror(-res));
+      abort();
+    }
+    b->done += res;
+    if(res > 0 && b->done < b->len){
+      uring_read(b); /* Short read; get the rest */
+      continue;
+    }
+    /* Done, or the file has shrunk since it was listed: hash what there is */
+    for(bp = &f->ready; *bp != NULL && (*bp)->offset < b->offset; bp = &(*bp)->next)
+      ;
+    b->next = *bp;
+    *bp = b;
+    if(!f->queued && f->ready->offset == f->hashed)
+      uring_enqueue(f);
+  }
+  __atomic_store_n(Cq_head,head,__ATOMIC_RELEASE);
+}
+
+/* Hash the completed reads of f that carry on from where its hash left off. Called with Uring_mutex held */
+static void uring_hash_file(struct ufile *f){
+  struct ubuf *run,*b,**tail;
+  off_t end = f->hashed;
+  int finished;
+
+  /* Take the contiguous run at the front of the list */
+  run = f->ready;
+  for(tail = &run; *tail != NULL && (*tail)->offset == end; tail = &(*tail)->next)
+    end += (*tail)->len;
+  f->ready = *tail;
+  *tail = NULL;
+  finished = end == f->ep->size;
+  pthread_mutex_unlock(&Uring_mutex);
+
+  for(b = run; b != NULL; b = b->next){
+    hash_update(&f->context,b->data,b->done);
+    __atomic_add_fetch(&Bytes_hashed,b->done,__ATOMIC_RELAXED);
+  }
+  if(finished){
+    hash_final(&f->context,HASHES(f->ep)->filehash);
+    close(f->fd);
+    hist_add(&Hash_latency,f->started);
+  }
+  pthread_mutex_lock(&Uring_mutex);
+  f->hashed = end;
+  while(run != NULL){
+    b = run;
+    run = run->next;
+    b->next = Ufree;
+    Ufree = b;
+    f->buffers--;
+  }
+  if(finished){
+    HASHES(f->ep)->filehash_present = 1;
+    f->ep = NULL;
+    f->queued = 0;
+    Uring_open--;
+  } else if(f->ready != NULL && f->ready->offset == f->hashed)
+    uring_enqueue(f);
+  else
+    f->queued = 0;
+  pthread_cond_signal(&Uring_progress);
+}
+
+/* Body of each pool thread while the ring is in use */
+static void uring_hasher(void){
+  pthread_mutex_lock(&Uring_mutex);
+  for(;;){
+    struct ufile *f;
+
+    while(Uqueue == NULL && !Uring_finished)
+      pthread_cond_wait(&Uring_work,&Uring_mutex);
+    if((f = Uqueue) == NULL)
+      break;
+    Uqueue = f->next;
+    uring_hash_file(f);
+  }
+  pthread_mutex_unlock(&Uring_mutex);
+}
+
+/* Compute the full hash of every entry in batch that still needs one, reading through the ring
+ * and hashing on the pool threads. Must be called from the main thread.
+ * Returns -1 if the ring isn't available, in which case nothing has been done
+ */
+int uring_hash(struct entry **batch,int n){
+  int next = 0,rr = 0,hashwork;
+  unsigned k;
+
+  if(Uring_fd == -1)
+    return -1;
+  device_interleave(batch,n);
+  if(Pool_workers > 0)
+    pool_start(uring_hasher);
+
+  pthread_mutex_lock(&Uring_mutex);
+  for(;;){
+    struct ufile *f;
+    int progress;
+
+    /* Fill free slots with files that need reading */
+    for(k=0; k < Uring_entries && next < n; k++){
+      struct entry *ep;
+      char path[PATH_MAX+1];
+
+      f = &Ufiles[k];
+      if(f->ep != NULL)
+	continue;
+      /* Skip what's already hashed (small files are, whole) without giving up the slot, or with
+       * nothing opened and nothing in flight there'd be no progress to wait for
+       */
+      while(next < n && (HASHES(batch[next])->filehash_present
+			 || (cache_lookup(batch[next]) && HASHES(batch[next])->filehash_present)))
+	next++;
+      if(next == n)
+	break;
+      ep = batch[next++];
+      __atomic_add_fetch(&Full_hashes_computed,1,__ATOMIC_RELAXED);
+      if((f->fd = timed_open(path_of(ep,path),O_RDONLY)) == -1){
+	fprintf(stderr,"can't open(%s): %d %s\n",path,errno,strerror(errno));
+	abort();
+      }
+      f->ep = ep;
+      f->started = now_seconds();
+      f->submitted = f->hashed = 0;
+      f->buffers = 0;
+      f->ready = NULL;
+      hash_init(&f->context);
+      Uring_open++;
+      if(ep->size == 0)
+	uring_enqueue(f); /* Nothing to read */
+    }
+    if(Uring_open == 0 && next >= n)
+      break;
+
+    /* Start reads, taking the open files in turn */
+    do {
+      progress = 0;
+      for(k=0; k < Uring_entries && Ufree != NULL && Uring_queued < Uring_entries; k++){
+	struct ubuf *b;
+
+	f = &Ufiles[(rr + k) % Uring_entries];
+	if(f->ep == NULL || f->submitted >= f->ep->size || f->buffers >= URING_PERFILE)
+	  continue;
+	b = Ufree;
+	Ufree = b->next;
+	b->file = f;
+	b->offset = f->submitted;
+	b->len = f->ep->size - f->submitted > URING_BUFSIZE ? URING_BUFSIZE
+	  : f->ep->size - f->submitted;
+	b->done = 0;
+	f->submitted += b->len;
+	f->buffers++;
+	uring_read(b);
+	progress = 1;
+      }
+    } while(progress);
+    rr = (rr + 1) % Uring_entries;
+
+    /* With no pool threads, or nothing to wait for, hash here */
+    hashwork = Uqueue != NULL && (Pool_workers == 0 || Uring_queued == 0);
+    if(!hashwork && Uring_queued == 0){
+      pthread_cond_wait(&Uring_progress,&Uring_mutex); /* All buffers are with the hashing threads */
+      continue;
+    }
+    pthread_mutex_unlock(&Uring_mutex);
+
+    if(Uring_pending > 0 || !hashwork){
+      int r = syscall(__NR_io_uring_enter,Uring_fd,Uring_pending,hashwork ? 0 : 1,IORING_ENTER_GETEVENTS,NULL,0);
+
+      if(r == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+	fprintf(stderr,"io_uring_enter: %d %s\n",errno,strerror(errno));
+	abort();
+      }
+      if(r > 0)
+	Uring_pending -= r;
+    }
+    pthread_mutex_lock(&Uring_mutex);
+    if(hashwork && Uqueue != NULL){
+      f = Uqueue;
+      Uqueue = f->next;
+      uring_hash_file(f);
+    }
+    uring_reap();
+  }
+  Uring_finished = 1;
+  pthread_cond_broadcast(&Uring_work);
+  pthread_mutex_unlock(&Uring_mutex);
+  if(Pool_workers > 0)
+    pool_wait();
+  Uring_finished = 0;
+  return 0;
+}
+#else
+void uring_start(int depth){
+}
+
+int uring_hash(struct entry **batch,int n){
+  return -1;
+}
+#endif
+
+/* Sub-file duplicates (-b). Files that are still distinct after the whole-file comparisons, and big enough
+ * to be worth it, are cut into content-defined chunks (fastcdc.c), and every chunk's hash goes into an index.
+ * Cut points depend only on the content around them, so an insertion or deletion in one copy of a file moves
+ * the chunk boundaries only near the change and the rest of the chunks still match. Chunks seen before are
+ * counted as shared space; with -d, runs of them are also handed to FIDEDUPERANGE, trimmed to whole blocks.
+ * Files are chunked and hashed by the pool a batch at a time, and the index is updated in file order.
+ */
+#define CHUNK_AVG (64*1024)
+#define CHUNK_MINFILE (1024*1024)	/* Smaller files aren't chunked */
+#define CHUNK_BUFSIZE (8*1024*1024)	/* Read this much of a file at a time */
+#define CHUNK_BLOCK 4096		/* Extents are shared in whole blocks */
+#define CHUNK_MINRANGE (64*1024)	/* Shorter shared ranges aren't worth deduping */
+
+struct chunk {
+  unsigned long long fp;	/* First 8 bytes of the chunk's hash */
+  unsigned int len;
+};
+
+struct chunklist {
+  struct chunk *chunks;
+  size_t n;
+};
+
+/* Index record: where a chunk was first seen. 20 bytes */
+struct chunkrec {
+  unsigned long long fp;	/* 0 = empty slot */
+  unsigned int file;		/* Into Chunk_files[] */
+  unsigned long long where;	/* Offset << 20 | length */
+} __attribute__((packed));
+#define CHUNK_LENBITS 20
+
+/* A run of chunks of the current file found earlier in another file, or earlier in this one */
+struct chunkrange {
+  unsigned int file;
+  off_t src,dst,len;
+};
+
+static struct entry *Chunk_files;
+static struct chunklist *Chunk_lists;	/* Parallel to Chunk_files */
+static struct chunkrec *Chunk_index;
+static unsigned long long Chunk_index_size,Chunk_index_used; /* Size is a power of 2 */
+
+/* Cut one file into chunks and hash them; runs in the pool */
+static void chunk_file(struct entry *ep){
+  struct chunklist *cl = &Chunk_lists[ep - Chunk_files];
+  unsigned char md[HASHSIZE],*buf;
+  char path[PATH_MAX+1];
+  size_t have = 0,off,m,i,r,allocated = 0;
+  off_t pos = 0;
+  uint32_t *lens;
+  fastcdc cdc;
+  int fd,eof = 0;
+
+  if((fd = timed_open(path_of(ep,path),O_RDONLY)) == -1){
+    fprintf(stderr,"can't open(%s): %d %s\n",path,errno,strerror(errno));
+    abort();
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  if(!Background_flag)
+    posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+  fastcdc_init(&cdc,CHUNK_AVG);
+  buf = (unsigned char *)malloc(CHUNK_BUFSIZE);
+  lens = (uint32_t *)malloc((CHUNK_BUFSIZE / cdc.min + 1) * sizeof(*lens));
+  assert(buf != NULL && lens != NULL);
+  cl->chunks = NULL;
+  cl->n = 0;
+  for(;;){
+    if(!eof && have < CHUNK_BUFSIZE){
+      if((r = read_data(ep,fd,buf + have,CHUNK_BUFSIZE - have,pos)) < CHUNK_BUFSIZE - have)
+	eof = 1; /* Possibly early, if the file has shrunk */
+      have += r;
+      pos += r;
+    }
+    m = fastcdc_split(&cdc,buf,have,eof,lens,CHUNK_BUFSIZE / cdc.min + 1);
+    if(cl->n + m > allocated){
+      while(cl->n + m > allocated)
+	allocated = allocated > 0 ? 2 * allocated : 1024;
+      cl->chunks = (struct chunk *)realloc(cl->chunks,allocated * sizeof(*cl->chunks));
+      assert(cl->chunks != NULL);
+    }
+    for(off=i=0;i<m;i++){
+      hash_buffer(buf + off,lens[i],md);
+      memcpy(&cl->chunks[cl->n].fp,md,sizeof(cl->chunks[cl->n].fp));
+      cl->chunks[cl->n].len = lens[i];
+      cl->n++;
+      off += lens[i];
+    }
+    memmove(buf,buf + off,have - off);
+    have -= off;
+    if(eof && have == 0)
+      break;
+  }
+  close(fd);
+  free(lens);
+  free(buf);
+  fastcdc_free(&cdc);
+}
+
+/* Slot for fp in the index: its record, or the empty slot where it would go */
+static struct chunkrec *chunk_slot(unsigned long long fp){
+  unsigned long long mask = Chunk_index_size - 1,i;
+
+  for(i = (fp * 0x9e3779b97f4a7c15ULL) >> 20 & mask; Chunk_index[i].fp != 0 && Chunk_index[i].fp != fp; i = (i + 1) & mask)
+    ;
+  return &Chunk_index[i];
+}
+
+/* Keep the index no more than 3/4 full */
+static void chunk_index_grow(void){
+  struct chunkrec *old = Chunk_index;
+  unsigned long long i,oldsize = Chunk_index_size;
+
+  if(4 * (Chunk_index_used + 1) <= 3 * Chunk_index_size)
+    return;
+  Chunk_index_size = oldsize > 0 ? 2 * oldsize : 65536;
+  Chunk_index = (struct chunkrec *)calloc(Chunk_index_size,sizeof(*Chunk_index));
+  assert(Chunk_index != NULL);
+  for(i=0;i<oldsize;i++){
+    if(old[i].fp != 0)
+      *chunk_slot(old[i].fp) = old[i];
+  }
+  free(old);
+}
+
+/* Share the extents of one run with FIDEDUPERANGE, trimmed to whole blocks on both sides */
+static void chunk_dedupe(struct chunkrange *r,int dstfd,const char *dstpath,unsigned short dev){
+#ifdef FIDEDUPERANGE
+  struct file_dedupe_range *arg;
+  char srcpath[PATH_MAX+1];
+  off_t trim,len,done;
+  int srcfd;
+
+  trim = (CHUNK_BLOCK - r->dst % CHUNK_BLOCK) % CHUNK_BLOCK;
+  if((r->src + trim) % CHUNK_BLOCK != 0){
+    Chunk_unaligned_bytes += r->len; /* The run is at different offsets within a block in the two files */
+    return;
+  }
+  len = (r->len - trim) / CHUNK_BLOCK * CHUNK_BLOCK;
+  if(r->len <= trim || len < CHUNK_MINRANGE || Dedupe_unsupported[dev])
+    return;
+  if((srcfd = open(path_of(&Chunk_files[r->file],srcpath),O_RDONLY)) == -1){
+    fprintf(stderr,"%s: can't open(%s): %d %s\n",Myname,srcpath,errno,strerror(errno));
+    return;
+  }
+  arg = (struct file_dedupe_range *)calloc(1,sizeof(*arg) + sizeof(arg->info[0]));
+  assert(arg != NULL);
+  for(done = 0; done < len; done += arg->info[0].bytes_deduped){
+    arg->src_offset = r->src + trim + done;
+    arg->src_length = len - done > DEDUPE_CHUNK ? DEDUPE_CHUNK : len - done;
+    arg->dest_count = 1;
+    arg->info[0].dest_fd = dstfd;
+    arg->info[0].dest_offset = r->dst + trim + done;
+    if(ioctl(srcfd,FIDEDUPERANGE,arg) == -1){
+      if(dedupe_unsupported(errno)){
+	Dedupe_unsupported[dev] = 1;
+	fprintf(stderr,"%s: %s: file system can't dedupe\n",Myname,dstpath);
+      } else
+	fprintf(stderr,"%s: can't dedupe %s: %d %s\n",Myname,dstpath,errno,strerror(errno));
+      break;
+    } else if(arg->info[0].status == FILE_DEDUPE_RANGE_DIFFERS){
+      break; /* Changed since it was read */
+    } else if(arg->info[0].status < 0){
+      if(dedupe_unsupported(-arg->info[0].status))
+	Dedupe_unsupported[dev] = 1;
+      else
+	fprintf(stderr,"%s: can't dedupe %s: %d %s\n",Myname,dstpath,-arg->info[0].status,strerror(-arg->info[0].status));
+      break;
+    } else if(arg->info[0].bytes_deduped == 0)
+      break;
+    Chunk_deduped_bytes += arg->info[0].bytes_deduped;
+  }
+  free(arg);
+  close(srcfd);
+#else
+  (void)r; (void)dstfd; (void)dstpath; (void)dev;
+#endif
+}
+
+/* Enter file k's chunks in the index, counting and (with -d) deduping those seen before */
+static void chunk_index_file(unsigned int k){
+  struct chunklist *cl = &Chunk_lists[k];
+  struct chunkrange *ranges = NULL,*rp;
+  struct chunkrec *cp;
+  char path[PATH_MAX+1];
+  size_t i,nranges = 0,allocated = 0;
+  off_t offset = 0;
+  int fd;
+
+  Chunk_nfiles++;
+  Chunk_count += cl->n;
+  for(i=0;i<cl->n;offset += cl->chunks[i++].len){
+    /* Keyed by device too: extents can only be shared within one file system */
+    unsigned long long fp = cl->chunks[i].fp ^ (unsigned long long)(Chunk_files[k].dev + 1) * 0x9e3779b97f4a7c15ULL;
+
+    Chunk_bytes += cl->chunks[i].len;
+    if(fp == 0)
+      fp = 1;
+    chunk_index_grow();
+    cp = chunk_slot(fp);
+    if(cp->fp == 0){
+      cp->fp = fp;
+      cp->file = k;
+      cp->where = (unsigned long long)offset << CHUNK_LENBITS | cl->chunks[i].len;
+      Chunk_index_used++;
+      continue;
+    }
+    if((cp->where & ((1 << CHUNK_LENBITS) - 1)) != cl->chunks[i].len || Chunk_files[cp->file].dev != Chunk_files[k].dev)
+      continue; /* Different lengths or devices, so the 64-bit keys collided */
+    Chunk_shared++;
+    Chunk_shared_bytes += cl->chunks[i].len;
+    if(!Dedupe_flag || No_do)
+      continue;
+    /* Extend the last run if this chunk follows on in both files, without overlapping itself */
+    rp = nranges > 0 ? &ranges[nranges-1] : NULL;
+    if(rp != NULL && rp->file == cp->file && rp->src + rp->len == (off_t)(cp->where >> CHUNK_LENBITS)
+       && rp->dst + rp->len == offset && (cp->file != k || rp->src + rp->len + cl->chunks[i].len <= rp->dst)){
+      rp->len += cl->chunks[i].len;
+      continue;
+    }
+    if(nranges == allocated){
+      allocated = allocated > 0 ? 2 * allocated : 64;
+      ranges = (struct chunkrange *)realloc(ranges,allocated * sizeof(*ranges));
+      assert(ranges != NULL);
+    }
+    rp = &ranges[nranges++];
+    rp->file = cp->file;
+    rp->src = cp->where >> CHUNK_LENBITS;
+    rp->dst = offset;
+    rp->len = cl->chunks[i].len;
+  }
+  if(nranges > 0 && !Dedupe_unsupported[Chunk_files[k].dev]){
+    if((fd = open(path_of(&Chunk_files[k],path),O_RDWR)) == -1 && (fd = open(path,O_RDONLY)) == -1){
+      fprintf(stderr,"%s: can't open(%s): %d %s\n",Myname,path,errno,strerror(errno));
+    } else {
+      for(i=0;i<nranges;i++)
+	chunk_dedupe(&ranges[i],fd,path,Chunk_files[k].dev);
+      close(fd);
+    }
+  }
+  free(ranges);
+  free(cl->chunks);
+  cl->chunks = NULL;
+}
+
+static int compare_dev_ino(const void *ap,const void *bp){
+  const struct entry *a = (const struct entry *)ap,*b = (const struct entry *)bp;
+
+  if(a->dev != b->dev)
+    return a->dev < b->dev ? -1 : 1;
+  if(a->ino != b->ino)
+    return a->ino < b->ino ? -1 : 1;
+  return 0;
+}
+
+/* Copy the entries big enough to be chunked, before dupgroup_sort() drops those of unique size */
+int chunk_candidates(struct entry *entries,int nfiles,struct entry **bigp){
+  struct entry *big;
+  int i,n;
+
+  big = (struct entry *)malloc((size_t)nfiles * sizeof(*big) + 1);
+  assert(big != NULL);
+  for(n=i=0;i<nfiles;i++){
+    if(entries[i].size >= CHUNK_MINFILE && !entries[i].gone)
+      big[n++] = entries[i]; /* Not if already linked to a reference file */
+  }
+  *bigp = big;
+  return n;
+}
+
+/* Chunk every big file not merged whole, one inode each; entries[0..nfiles-1] are the grouped table,
+ * and ids run up to ntotal
+ */
+void chunk_scan(struct entry *big,int nbig,struct entry *entries,int nfiles,int ntotal){
+  unsigned char *merged;
+  struct entry **batch;
+  fastcdc cdc;
+  int i,k,n,batchsize;
+
+  merged = (unsigned char *)calloc(ntotal + 1,1); /* By id */
+  assert(merged != NULL);
+  for(i=0;i<nfiles;i++){
+    if(entries[i].gone)
+      merged[entries[i].id] = 1;
+  }
+  qsort(big,nbig,sizeof(*big),compare_dev_ino);
+  for(n=i=0;i<nbig;i++){
+    if(!merged[big[i].id] && (n == 0 || compare_dev_ino(&big[n-1],&big[i]) != 0))
+      big[n++] = big[i];
+  }
+  free(merged);
+
+  fastcdc_init(&cdc,CHUNK_AVG); /* Set up the tables before the pool threads use them */
+  Chunk_files = big;
+  Chunk_lists = (struct chunklist *)calloc(n + 1,sizeof(*Chunk_lists));
+  batchsize = 4 * Hash_threads;
+  batch = (struct entry **)malloc(batchsize * sizeof(*batch));
+  assert(Chunk_lists != NULL && batch != NULL);
+  for(Progress_total=Progress_done=i=0;i<n;i++)
+    Progress_total += big[i].size;
+  for(i=0;i<n;i+=batchsize){
+    int m = n - i < batchsize ? n - i : batchsize;
+
+    for(k=0;k<m;k++)
+      batch[k] = &big[i+k];
+    pool_hash(batch,m,chunk_file);
+    for(k=0;k<m;k++){
+      chunk_index_file(i+k);
+      Progress_done += big[i+k].size;
+    }
+  }
+  free(batch);
+  free(Chunk_lists);
+  free(Chunk_index);
+  Chunk_index = NULL;
+  Chunk_index_size = Chunk_index_used = 0;
+}
+
+/* Persistent hash cache, so that files unchanged since an earlier run needn't be read again.
+ * The cache file is a header followed by fixed-size records sorted by device and inode, and is mapped
+ * read-only and binary searched in place, so even a very large cache costs nothing to load.
+ * A record is used only if the file's size, mtime and ctime (both to the nanosecond) still match. Any
+ * write to a file, or a change to its times, updates its ctime, which can't be set from user space.
+ * New and changed records are merged with the old ones into a new file, renamed over the old one at exit.
+ */
+#define CACHE_VERSION 2
+#define CACHE_PARTIAL 1		/* partialhash is valid */
+#define CACHE_FULL 2		/* filehash is valid */
+
+struct cachehdr {
+  char magic[8];		/* "dupmerge" */
+  unsigned int version;		/* Also catches byte order differences */
+  unsigned int recsize;		/* sizeof(struct cacherec) */
+  char hash[16];		/* Hash function name */
+  unsigned long long count;	/* Number of records that follow */
+};
+
+struct cacherec {
+  unsigned long long dev;
+  unsigned long long ino;
+  long long size;
+  long long mtime_ns;
+  long long ctime_ns;
+  unsigned int flags;
+  unsigned int samples;		/* Sample stages valid in samplehash; see get_sample_hash() */
+  unsigned char partialhash[HASHSIZE];
+  unsigned char filehash[HASHSIZE];
+  unsigned char samplehash[SAMPLE_STAGES][HASHSIZE];
+};
+
+static const struct cacherec *Cache;	/* Mapped records, sorted by dev,ino */
+static unsigned long long Cache_count;
+static size_t Cache_mapsize;
+
+static void cache_header(struct cachehdr *hdr,unsigned long long count){
+  memset(hdr,0,sizeof(*hdr));
+  memcpy(hdr->magic,"dupmerge",8);
+  hdr->version = CACHE_VERSION;
+  hdr->recsize = sizeof(struct cacherec);
+  strncpy(hdr->hash,HASHNAME,sizeof(hdr->hash));
+  hdr->count = count;
+}
+
+/* Map an existing cache file. A missing or unusable one just means starting with an empty cache */
+void cache_open(const char *path){
+  struct cachehdr want;
+  const struct cachehdr *hdr;
+  struct stat statbuf;
+  void *p;
+  int fd;
+
+  if((fd = open(path,O_RDONLY)) == -1){
+    if(errno != ENOENT)
+      fprintf(stderr,"%s: can't open hash cache %s: %d %s\n",Myname,path,errno,strerror(errno));
+    return;
+  }
+  if(fstat(fd,&statbuf) != 0 || statbuf.st_size < (off_t)sizeof(struct cachehdr)){
+    fprintf(stderr,"%s: hash cache %s is truncated, ignoring it\n",Myname,path);
+    close(fd);
+    return;
+  }
+  p = mmap(NULL,statbuf.st_size,PROT_READ,MAP_FILE|MAP_SHARED,fd,0);
+  close(fd);
+  if(p == MAP_FAILED){
+    fprintf(stderr,"%s: can't map hash cache %s: %d %s\n",Myname,path,errno,strerror(errno));
+    return;
+  }
+  hdr = (const struct cachehdr *)p;
+  cache_header(&want,hdr->count);
+  if(memcmp(hdr,&want,sizeof(want)) != 0
+     || (unsigned long long)statbuf.st_size != sizeof(struct cachehdr) + hdr->count * sizeof(struct cacherec)){
+    fprintf(stderr,"%s: hash cache %s is from another version or is damaged, ignoring it\n",Myname,path);
+    munmap(p,statbuf.st_size);
+    return;
+  }
+  Cache = (const struct cacherec *)(hdr + 1);
+  Cache_count = hdr->count;
+  Cache_mapsize = statbuf.st_size;
+  if(!Quiet_flag)
+    fprintf(stderr,"%s: hash cache %s: %llu entries\n",Myname,path,Cache_count);
+}
+
+static int cache_compare(unsigned long long dev_a,unsigned long long ino_a,const struct cacherec *b){
+  if(dev_a != b->dev)
+    return dev_a < b->dev ? -1 : 1;
+  if(ino_a != b->ino)
+    return ino_a < b->ino ? -1 : 1;
+  return 0;
+}
+
+/* Fill in whatever hashes the cache holds for this file; returns nonzero if it had any.
+ * Called from the hashing pool threads, so it only reads the cache
+ */
+int cache_lookup(struct entry *ep){
+  unsigned long long lo,hi,mid;
+  const struct cacherec *rp;
+  int i;
+
+  if(Cache == NULL)
+    return 0;
+  lo = 0;
+  hi = Cache_count;
+  while(lo < hi){
+    mid = lo + (hi - lo) / 2;
+    i = cache_compare(Devices[ep->dev],ep->ino,&Cache[mid]);
+    if(i == 0)
+      break;
+    if(i < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  if(lo >= hi)
+    return 0;
+  rp = &Cache[mid];
+  if(rp->size != ep->size
+     || rp->mtime_ns != ep->mtime
+     || rp->ctime_ns != Files[ep->id].ctime)
+    return 0; /* File has changed since */
+
+  if((rp->flags & CACHE_PARTIAL) && !HASHES(ep)->partialhash_present){
+    memcpy(HASHES(ep)->partialhash,rp->partialhash,HASHSIZE);
+    HASHES(ep)->partialhash_present = 1;
+  }
+  if((rp->flags & CACHE_FULL) && !HASHES(ep)->filehash_present){
+    memcpy(HASHES(ep)->filehash,rp->filehash,HASHSIZE);
+    HASHES(ep)->filehash_present = 1;
+  }
+  if(rp->samples > HASHES(ep)->sample_stage){
+    memcpy(HASHES(ep)->samplehash,rp->samplehash,sizeof(HASHES(ep)->samplehash));
+    HASHES(ep)->sample_stage = rp->samples;
+  }
+  if(rp->flags || rp->samples)
+    __atomic_add_fetch(&Cache_hits,1,__ATOMIC_RELAXED);
+  return rp->flags != 0 || rp->samples != 0;
+}
+
+static int cacherec_sort(const void *ap,const void *bp){
+  const struct cacherec *a = (const struct cacherec *)ap;
+
+  return cache_compare(a->dev,a->ino,(const struct cacherec *)bp);
+}
+
+/* Write the hashes we know about, together with the old records for files we didn't see this time.
+ * Entries retired by dupengine_same() are left out unless this was a dry run: their inodes may be gone now
+ */
+void cache_save(const char *path,struct entry *entries,int nfiles){
+  struct cacherec *recs;
+  struct cachehdr hdr;
+  unsigned long long i,n,old,total;
+  char *tmp;
+  FILE *fp;
+  int k;
+
+  recs = (struct cacherec *)calloc(nfiles + 1,sizeof(*recs));
+  assert(recs != NULL);
+  for(n=k=0;k<nfiles;k++){
+    struct entry *ep = &entries[k];
+    struct stat statbuf;
+    char path[PATH_MAX+1];
+
+    /* A link to a file, or a dedupe, changes its ctime; read it again so the record is still good next time */
+    if(!ep->gone && HASHES(ep) != NULL && HASHES(ep)->relinked
+       && lstat(path_of(ep,path),&statbuf) == 0 && statbuf.st_ino == ep->ino && statbuf.st_size == ep->size
+       && MTIME_NS(&statbuf) == ep->mtime)
+      Files[ep->id].ctime = CTIME_NS(&statbuf);
+
+    if((ep->gone && !No_do) || HASHES(ep) == NULL
+       || !(HASHES(ep)->partialhash_present || HASHES(ep)->filehash_present || HASHES(ep)->sample_stage > 0))
+      continue;
+    recs[n].dev = Devices[ep->dev];
+    recs[n].ino = ep->ino;
+    recs[n].size = ep->size;
+    recs[n].mtime_ns = ep->mtime;
+    recs[n].ctime_ns = Files[ep->id].ctime;
+    if(HASHES(ep)->partialhash_present){
+      recs[n].flags |= CACHE_PARTIAL;
+      memcpy(recs[n].partialhash,HASHES(ep)->partialhash,HASHSIZE);
+    }
+    if(HASHES(ep)->filehash_present){
+      recs[n].flags |= CACHE_FULL;
+      memcpy(recs[n].filehash,HASHES(ep)->filehash,HASHSIZE);
+    }
+    recs[n].samples = HASHES(ep)->sample_stage;
+    memcpy(recs[n].samplehash,HASHES(ep)->samplehash,sizeof(recs[n].samplehash));
+    n++;
+  }
+  qsort(recs,n,sizeof(*recs),cacherec_sort);
+
+  tmp = (char *)malloc(strlen(path) + 32);
+  assert(tmp != NULL);
+  sprintf(tmp,"%s.%d.tmp",path,(int)getpid());
+  if((fp = fopen(tmp,"w")) == NULL){
+    fprintf(stderr,"%s: can't create %s: %d %s\n",Myname,tmp,errno,strerror(errno));
+    free(tmp);
+    free(recs);
+    return;
+  }
+  /* Merge the two sorted lists, dropping duplicate links and old records for files we've seen again */
+  cache_header(&hdr,0);
+  fwrite(&hdr,sizeof(hdr),1,fp);
+  total = 0;
+  for(i=old=0;i < n || old < Cache_count;){
+    const struct cacherec *rp;
+
+    if(old < Cache_count && (i >= n || cache_compare(Cache[old].dev,Cache[old].ino,&recs[i]) < 0)){
+      rp = &Cache[old++];
+    } else {
+      if(old < Cache_count && cache_compare(Cache[old].dev,Cache[old].ino,&recs[i]) == 0)
+	old++; /* Superseded */
+      rp = &recs[i++];
+      while(i < n && cache_compare(rp->dev,rp->ino,&recs[i]) == 0){
+	long long ctime = rp->ctime_ns > recs[i].ctime_ns ? rp->ctime_ns : recs[i].ctime_ns;
+
+	if((recs[i].flags & ~rp->flags) || recs[i].samples > rp->samples)
+	  rp = &recs[i]; /* Prefer the link that got more hashes */
+	recs[rp - recs].ctime_ns = ctime; /* And the latest ctime seen through any of them */
+	i++;
+      }
+    }
+    fwrite(rp,sizeof(*rp),1,fp);
+    total++;
+  }
+  cache_header(&hdr,total);
+  if(ferror(fp) || fseek(fp,0,SEEK_SET) != 0 || fwrite(&hdr,sizeof(hdr),1,fp) != 1 || fflush(fp) != 0
+     || fsync(fileno(fp)) != 0 || fclose(fp) != 0){
+    fprintf(stderr,"%s: can't write %s: %d %s\n",Myname,tmp,errno,strerror(errno));
+    unlink(tmp);
+  } else if(rename(tmp,path) != 0){
+    fprintf(stderr,"%s: can't rename %s to %s: %d %s\n",Myname,tmp,path,errno,strerror(errno));
+    unlink(tmp);
+  } else if(!Quiet_flag)
+    fprintf(stderr,"%s: hash cache %s: %llu entries written\n",Myname,path,total);
+  free(tmp);
+  free(recs);
+  if(Cache != NULL){
+    munmap((void *)((const struct cachehdr *)Cache - 1),Cache_mapsize);
+    Cache = NULL;
+  }
+}
+
+/* Manifests (-M) and reference sets (-r). A manifest lists every file of a tree once per inode with its size,
+ * device, inode, modification time, first page hash, full hash and whole path name, so that a big tree that
+ * doesn't change, such as a golden corpus, can be hashed once and new files deduped against it later without
+ * walking or reading it again. It is a header, then fixed-size records sorted by size, device and inode, then
+ * the path names; like the hash cache it is mapped read-only and searched in place, however big it is.
+ *
+ * The manifests given with -r are joined with the file table by size before the usual grouping. A file with the
+ * size and device of a record for another inode has its first page hashed and, where that matches the record's,
+ * its full hash; if that matches too, the file is linked to the one the record names, which is always the one
+ * kept, whatever the times. Only the new files are read. Just before the link, the record's path is looked up
+ * with lstat(), and unless it still names a regular file with the recorded device, inode, size and modification
+ * time the record is passed over as stale. Files that match no record are then compared among themselves as usual
+ */
+#define MANIFEST_VERSION 1
+#define REFERENCE_CHUNK 1024	/* Entries for reference files allocated at once */
+
+struct manifesthdr {
+  char magic[8];		/* "dupmanif" */
+  unsigned int version;		/* Also catches byte order differences */
+  unsigned int recsize;		/* sizeof(struct manifestrec) */
+  char hash[16];		/* Hash function name */
+  unsigned long long count;	/* Number of records that follow */
+  unsigned long long strings;	/* Bytes of path names after the records */
+};
+
+struct manifestrec {
+  long long size;
+  unsigned long long dev;
+  unsigned long long ino;
+  long long mtime_ns;
+  unsigned long long path;	/* Offset of the null-terminated path name from the start of the names */
+  unsigned char partialhash[HASHSIZE];
+  unsigned char filehash[HASHSIZE];
+};
+
+struct manifest {
+  const struct manifestrec *recs;	/* Mapped */
+  unsigned long long count;
+  const char *strings;
+};
+static struct manifest *Manifests;	/* The reference sets */
+static int Nmanifests;
+static struct entry *Reference_next;	/* Entries for the reference files linked to; never freed */
+static int Reference_left;
+static struct arena Reference_arena;
+
+static void manifest_header(struct manifesthdr *hdr,unsigned long long count,unsigned long long strings){
+  memset(hdr,0,sizeof(*hdr));
+  memcpy(hdr->magic,"dupmanif",8);
+  hdr->version = MANIFEST_VERSION;
+  hdr->recsize = sizeof(struct manifestrec);
+  strncpy(hdr->hash,HASHNAME,sizeof(hdr->hash));
+  hdr->count = count;
+  hdr->strings = strings;
+}
+
+/* Manifest order: size, then device, then inode */
+static int compare_manifest_entry(const void *ap,const void *bp){
+  const struct entry *a = *(struct entry * const *)ap;
+  const struct entry *b = *(struct entry * const *)bp;
+
+  if(a->size != b->size)
+    return a->size < b->size ? -1 : 1;
+  if(Devices[a->dev] != Devices[b->dev])
+    return Devices[a->dev] < Devices[b->dev] ? -1 : 1;
+  if(a->ino != b->ino)
+    return a->ino < b->ino ? -1 : 1;
+  return 0;
+}
+
+/* Full hashes for the n entries of batch, in parallel, with the big files last and one at a time as in
+ * prefetch_hashes(). Reorders batch. Main thread only
+ */
+static void full_hashes(struct entry **batch,int n){
+  struct entry *t;
+  int m,out;
+
+  for(m=out=0;m<n;m++){
+    if(batch[m]->size < TREE_MINSIZE){
+      t = batch[out];
+      batch[out++] = batch[m];
+      batch[m] = t;
+    }
+  }
+  if(uring_hash(batch,out) == -1)
+    pool_hash(batch,out,get_big_hash);
+  for(m=out;m<n;m++)
+    get_big_hash(batch[m]);
+}
+
+/* Write a manifest of every file in entries[0..nfiles-1] not retired by dupengine_same() (unless this was a dry run),
+ * hashing those that need it.
+ * Paths are made absolute, so the manifest can be used from anywhere
+ */
+void manifest_write(const char *path,struct entry *entries,int nfiles){
+  struct entry **files,**batch;
+  struct manifesthdr hdr;
+  struct manifestrec rec;
+  char cwd[PATH_MAX+1],buf[PATH_MAX+1],*tmp;
+  const char *p;
+  unsigned long long strings;
+  size_t cwdlen;
+  FILE *fp;
+  int k,n,nbatch,pass;
+
+  if(getcwd(cwd,sizeof(cwd)) == NULL){
+    fprintf(stderr,"%s: can't get current directory: %d %s\n",Myname,errno,strerror(errno));
+    return;
+  }
+  cwdlen = strlen(cwd);
+  files = (struct entry **)malloc(2 * (size_t)nfiles * sizeof(*files) + 1);
+  assert(files != NULL);
+  batch = files + nfiles;
+  for(n=k=0;k<nfiles;k++){
+    if(!entries[k].gone || No_do)
+      files[n++] = &entries[k];
+  }
+  qsort(files,n,sizeof(*files),compare_manifest_entry);
+  for(nbatch=k=0;k<n;k++){
+    if(nbatch == 0 || compare_manifest_entry(&files[nbatch-1],&files[k]) != 0)
+      files[nbatch++] = files[k]; /* One link to each inode */
+  }
+  n = nbatch;
+  for(k=0;k<n;k++){
+    alloc_hashes(files[k]);
+    batch[k] = files[k];
+  }
+  if(Physical_flag)
+    pool_hash(batch,n,get_physical);
+  pool_hash(batch,n,get_small_hash);
+  for(nbatch=k=0;k<n;k++){
+    if(!HASHES(files[k])->filehash_present)
+      batch[nbatch++] = files[k];
+  }
+  full_hashes(batch,nbatch);
+
+  tmp = (char *)malloc(strlen(path) + 32);
+  assert(tmp != NULL);
+  sprintf(tmp,"%s.%d.tmp",path,(int)getpid());
+  if((fp = fopen(tmp,"w")) == NULL){
+    fprintf(stderr,"%s: can't create %s: %d %s\n",Myname,tmp,errno,strerror(errno));
+    free(tmp);
+    free(files);
+    return;
+  }
+  /* The records, then the names they point to */
+  manifest_header(&hdr,n,0);
+  fwrite(&hdr,sizeof(hdr),1,fp);
+  for(pass=0;pass<2;pass++){
+    strings = 0;
+    for(k=0;k<n;k++){
+      for(p = path_of(files[k],buf); p[0] == '.' && p[1] == '/'; p += 2)
+	;
+      if(pass == 0){
+	memset(&rec,0,sizeof(rec));
+	rec.size = files[k]->size;
+	rec.dev = Devices[files[k]->dev];
+	rec.ino = files[k]->ino;
+	rec.mtime_ns = files[k]->mtime;
+	rec.path = strings;
+	memcpy(rec.partialhash,HASHES(files[k])->partialhash,HASHSIZE);
+	memcpy(rec.filehash,HASHES(files[k])->filehash,HASHSIZE);
+	fwrite(&rec,sizeof(rec),1,fp);
+      } else {
+	if(p[0] != '/'){
+	  fwrite(cwd,cwdlen,1,fp);
+	  putc('/',fp);
+	}
+	fwrite(p,strlen(p) + 1,1,fp);
+      }
+      strings += (p[0] != '/' ? cwdlen + 1 : 0) + strlen(p) + 1;
+    }
+  }
+  manifest_header(&hdr,n,strings);
+  if(ferror(fp) || fseek(fp,0,SEEK_SET) != 0 || fwrite(&hdr,sizeof(hdr),1,fp) != 1 || fflush(fp) != 0
+     || fsync(fileno(fp)) != 0 || fclose(fp) != 0){
+    fprintf(stderr,"%s: can't write %s: %d %s\n",Myname,tmp,errno,strerror(errno));
+    unlink(tmp);
+  } else if(rename(tmp,path) != 0){
+    fprintf(stderr,"%s: can't rename %s to %s: %d %s\n",Myname,tmp,path,errno,strerror(errno));
+    unlink(tmp);
+  } else if(!Quiet_flag)
+    fprintf(stderr,"%s: manifest %s: %d files written\n",Myname,path,n);
+  free(tmp);
+  free(files);
+}
+
+/* Map a manifest to use as a reference set. Unlike the cache, it was asked for by name, so failing is fatal */
+void reference_open(const char *path){
+  struct manifesthdr want;
+  const struct manifesthdr *hdr;
+  struct manifest *mp;
+  struct stat statbuf;
+  void *p;
+  int fd;
+
+  if((fd = open(path,O_RDONLY)) == -1){
+    fprintf(stderr,"%s: can't open manifest %s: %d %s\n",Myname,path,errno,strerror(errno));
+    exit(1);
+  }
+  if(fstat(fd,&statbuf) != 0 || statbuf.st_size < (off_t)sizeof(struct manifesthdr)){
+    fprintf(stderr,"%s: manifest %s is truncated\n",Myname,path);
+    exit(1);
+  }
+  p = mmap(NULL,statbuf.st_size,PROT_READ,MAP_FILE|MAP_SHARED,fd,0);
+  close(fd);
+  if(p == MAP_FAILED){
+    fprintf(stderr,"%s: can't map manifest %s: %d %s\n",Myname,path,errno,strerror(errno));
+    exit(1);
+  }
+  hdr = (const struct manifesthdr *)p;
+  manifest_header(&want,hdr->count,hdr->strings);
+  if(memcmp(hdr,&want,sizeof(want)) != 0
+     || (unsigned long long)statbuf.st_size != sizeof(struct manifesthdr) + hdr->count * sizeof(struct manifestrec) + hdr->strings
+     || (hdr->strings > 0 && ((const char *)p)[statbuf.st_size - 1] != '\0')){
+    fprintf(stderr,"%s: manifest %s is from another version, uses another hash or is damaged\n",Myname,path);
+    exit(1);
+  }
+  Manifests = (struct manifest *)realloc(Manifests,(Nmanifests + 1) * sizeof(*Manifests));
+  assert(Manifests != NULL);
+  mp = &Manifests[Nmanifests++];
+  mp->recs = (const struct manifestrec *)(hdr + 1);
+  mp->count = hdr->count;
+  mp->strings = (const char *)(mp->recs + mp->count);
+  Reference_records += mp->count;
+  if(!Quiet_flag)
+    fprintf(stderr,"%s: manifest %s: %llu files\n",Myname,path,mp->count);
+}
+
+/* The first record of mp with ep's size and device, or where it would be */
+static const struct manifestrec *reference_first(const struct manifest *mp,const struct entry *ep){
+  unsigned long long lo = 0,hi = mp->count,mid;
+  const struct manifestrec *rp;
+
+  while(lo < hi){
+    mid = lo + (hi - lo) / 2;
+    rp = &mp->recs[mid];
+    if(rp->size < ep->size || (rp->size == ep->size && rp->dev < Devices[ep->dev]))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return &mp->recs[lo];
+}
+
+/* The next record after rp (from the start if rp is NULL), in any reference set, for a file that could be
+ * ep's: another inode of the same size and device and, from stage 1, the same first page hash and, at stage 2,
+ * the same full hash. NULL if there are no more. Sets its manifest in *mpp
+ */
+static const struct manifestrec *reference_next(const struct entry *ep,const struct manifestrec *rp,int stage,
+						 const struct manifest **mpp){
+  const struct manifest *mp;
+  int m = 0;
+
+  if(rp != NULL){
+    while(rp < Manifests[m].recs || rp >= Manifests[m].recs + Manifests[m].count)
+      m++;
+    rp++;
+  }
+  for(; m < Nmanifests; m++){
+    mp = &Manifests[m];
+    if(rp == NULL)
+      rp = reference_first(mp,ep);
+    for(; rp < mp->recs + mp->count && rp->size == ep->size && rp->dev == Devices[ep->dev]; rp++){
+      if(rp->ino == ep->ino
+	 || (stage >= 1 && memcmp(rp->partialhash,HASHES(ep)->partialhash,HASHSIZE) != 0)
+	 || (stage >= 2 && memcmp(rp->filehash,HASHES(ep)->filehash,HASHSIZE) != 0))
+	continue;
+      if(mpp != NULL)
+	*mpp = mp;
+      return rp;
+    }
+    rp = NULL;
+  }
+  return NULL;
+}
+
+/* An entry for the file named by record rp of mp, if it is still that file; NULL if it has changed.
+ * Main thread only
+ */
+static struct entry *reference_entry(const struct manifest *mp,const struct manifestrec *rp){
+  static const char *lastdir;	/* Directory of the last one, usually shared with this one */
+  static size_t lastdirlen;
+  static unsigned int dir;
+  const char *path = mp->strings + rp->path;
+  const char *name = strrchr(path,'/') + 1;
+  struct stat statbuf;
+  struct entry *ep;
+  unsigned int id;
+
+  if(lstat(path,&statbuf) != 0 || (statbuf.st_mode & S_IFMT) != S_IFREG
+     || statbuf.st_dev != rp->dev || statbuf.st_ino != rp->ino
+     || statbuf.st_size != rp->size || MTIME_NS(&statbuf) != rp->mtime_ns){
+    Reference_stale++;
+    fprintf(stderr,"%s: %s has changed since its manifest was written, not linked to\n",Myname,path);
+    return NULL;
+  }
+  if(Reference_left == 0){
+    Reference_left = REFERENCE_CHUNK;
+    Reference_next = (struct entry *)calloc(Reference_left,sizeof(struct entry));
+    assert(Reference_next != NULL);
+  }
+  ep = Reference_next++;
+  Reference_left--;
+  id = file_new();
+  entry_fill(ep,&Files[id],&statbuf,dev_index(statbuf.st_dev));
+  ep->id = id;
+  if(lastdir == NULL || name - path != lastdirlen || memcmp(path,lastdir,lastdirlen) != 0){
+    lastdir = path;
+    lastdirlen = name - path;
+    dir = dir_index(path,lastdirlen,&Reference_arena);
+  }
+  Files[id].dir = dir;
+  Files[id].name = name; /* In the mapped manifest, there for the rest of the run */
+  Files[id].reference = 1;
+  return ep;
+}
+
+/* Link every file in entries[0..nfiles-1] that is identical to one in a reference set to that one */
+void reference_scan(struct entry *entries,int nfiles){
+  struct entry **cand,**batch;
+  const struct manifestrec *rp;
+  const struct manifest *mp;
+  struct entry *ref;
+  double link,t;
+  int k,n,nbatch;
+
+  cand = (struct entry **)malloc(2 * (size_t)nfiles * sizeof(*cand) + 1);
+  assert(cand != NULL);
+  batch = cand + nfiles;
+  /* The files with the size and device of some other inode's record, links to each inode together */
+  for(n=k=0;k<nfiles;k++){
+    if(!entries[k].gone)
+      cand[n++] = &entries[k];
+  }
+  qsort(cand,n,sizeof(*cand),compare_manifest_entry);
+  for(nbatch=k=0;k<n;k++){
+    if(reference_next(cand[k],NULL,0,NULL) != NULL)
+      cand[nbatch++] = cand[k];
+  }
+  n = nbatch;
+
+  /* First page hashes, one per inode */
+  for(nbatch=k=0;k<n;k++){
+    alloc_hashes(cand[k]);
+    if(k == 0 || cand[k]->ino != cand[k-1]->ino)
+      batch[nbatch++] = cand[k];
+  }
+  if(Physical_flag)
+    pool_hash(batch,nbatch,get_physical);
+  pool_hash(batch,nbatch,get_small_hash);
+  for(k=0;k<n;k++){
+    if(k == 0 || cand[k]->ino != cand[k-1]->ino){
+      HASHES(cand[k])->partialhash_fresh = 1;
+    } else {
+      memcpy(HASHES(cand[k]),HASHES(cand[k-1]),sizeof(struct hashes));
+      HASHES(cand[k])->partialhash_fresh = 0;
+      HASHES(cand[k])->filehash_fresh = 0;
+    }
+  }
+  /* Full hashes where the first page matches */
+  for(nbatch=k=0;k<n;k++){
+    if((k == 0 || cand[k]->ino != cand[k-1]->ino) && !HASHES(cand[k])->filehash_present
+       && reference_next(cand[k],NULL,1,NULL) != NULL)
+      batch[nbatch++] = cand[k];
+  }
+  full_hashes(batch,nbatch);
+  for(k=0;k<nbatch;k++)
+    HASHES(batch[k])->filehash_fresh = 1;
+  for(k=1;k<n;k++){
+    if(cand[k]->ino == cand[k-1]->ino && HASHES(cand[k-1])->filehash_present){
+      memcpy(HASHES(cand[k])->filehash,HASHES(cand[k-1])->filehash,HASHSIZE);
+      HASHES(cand[k])->filehash_present = 1;
+    }
+  }
+  /* Link each to the first matching record that still checks out */
+  link = Phase_time[PHASE_LINK];
+  for(k=0;k<n;k++){
+    if(!HASHES(cand[k])->filehash_present)
+      continue;
+    for(rp = NULL; (rp = reference_next(cand[k],rp,2,&mp)) != NULL; ){
+      if((ref = reference_entry(mp,rp)) != NULL){
+	Reference_matches++;
+	dupengine_same(&Engine,ref,cand[k]);
+	t = now_seconds();
+	dedupe_flush(); /* Each reference file is its own */
+	Phase_time[PHASE_LINK] += now_seconds() - t;
+	break;
+      }
+    }
+  }
+  relink_flush();
+  Reference_link_time = Phase_time[PHASE_LINK] - link;
+  free(cand);
+}
+
+/* Run report (-R) and progress (-P). The report is the statistics printed at exit plus timings, latency
+ * histograms and resource use, as one JSON object, so that runs over the same tree can be compared by a script.
+ * Read system calls, bytes from storage and so on come from /proc/self/io where there is one.
+ * A monitor thread wakes once a second to print a progress line every -P seconds, and to write the report
+ * (to the -R file, or to stderr) whenever SIGUSR1 arrives; the signal handler only sets a flag.
+ * The counters are read without locks, so a report taken mid-run may be off by a file or two
+ */
+static volatile sig_atomic_t Report_requested;
+
+double now_seconds(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Charge the time since the last call to the phase we were in, and go on to p. Main thread only */
+void phase_enter(enum phase p){
+  double t = now_seconds();
+
+  if(Phase < NPHASES)
+    Phase_time[Phase] += t - Phase_started;
+  Phase = p;
+  Phase_started = t;
+  Progress_total = Progress_done = 0;
+}
+
+/* Count the time since start. May be called from any thread */
+void hist_add(struct histogram *h,double start){
+  long long ns = (now_seconds() - start) * 1e9;
+  int b;
+
+  for(b=0; b < HIST_BUCKETS-1 && ns >= 1000LL << b; b++)
+    ;
+  __atomic_add_fetch(&h->count[b],1,__ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->total_ns,ns,__ATOMIC_RELAXED);
+}
+
+/* Open a file to read its data. In background mode there's no readahead, which would bring in data that
+ * hasn't been charged to the rate limits
+ */
+int timed_open(const char *path,int flags){
+  double start = now_seconds();
+  int fd = open(path,flags);
+
+  hist_add(&Open_latency,start);
+#ifdef POSIX_FADV_RANDOM
+  if(Background_flag && fd != -1)
+    posix_fadvise(fd,0,0,POSIX_FADV_RANDOM);
+#endif
+  return fd;
+}
+
+static void hist_write(FILE *fp,const char *name,const struct histogram *h){
+  long long n = 0;
+  int b,last;
+
+  for(last=b=0;b<HIST_BUCKETS;b++){
+    n += h->count[b];
+    if(h->count[b] != 0)
+      last = b;
+  }
+  fprintf(fp,"    \"%s\": { \"count\": %lld, \"total_seconds\": %.6f, \"buckets\": [",name,n,h->total_ns / 1e9);
+  for(b=0;b<=last && n > 0;b++)
+    fprintf(fp,"%s%lld",b > 0 ? ", " : "",h->count[b]);
+  fprintf(fp,"] }");
+}
+
+/* Write the report to path; "-" is stdout and NULL stderr */
+void report_write(const char *path){
+  struct rusage ru;
+  char line[256],name[64];
+  unsigned long long value;
+  double elapsed = now_seconds() - Run_started,t;
+  FILE *fp,*io;
+  int i;
+
+  if(path == NULL)
+    fp = stderr;
+  else if(strcmp(path,"-") == 0)
+    fp = stdout;
+  else if((fp = fopen(path,"w")) == NULL){
+    fprintf(stderr,"%s: can't create %s: %d %s\n",Myname,path,errno,strerror(errno));
+    return;
+  }
+  getrusage(RUSAGE_SELF,&ru);
+  fprintf(fp,"{\n");
+  fprintf(fp,"  \"hash\": \"%s\",\n",HASHNAME);
+  fprintf(fp,"  \"threads\": %d,\n",Hash_threads);
+  fprintf(fp,"  \"dry_run\": %s,\n",No_do ? "true" : "false");
+  fprintf(fp,"  \"phase\": \"%s\",\n",Phase < NPHASES ? Phase_names[Phase] : "done");
+  fprintf(fp,"  \"progress_bytes\": [%lld, %lld],\n",Progress_done,Progress_total);
+  fprintf(fp,"  \"input_files\": %u,\n",Total_files);
+  fprintf(fp,"  \"ordinary_files\": %u,\n",Regular_file);
+  fprintf(fp,"  \"files_examined\": %lld,\n",Files_examined);
+  fprintf(fp,"  \"elapsed_seconds\": %.6f,\n",elapsed);
+  fprintf(fp,"  \"files_per_second\": %.1f,\n",elapsed > 0 ? Files_examined / elapsed : 0.0);
+  fprintf(fp,"  \"phase_seconds\": {");
+  for(i=0;i<NPHASES;i++){
+    t = Phase_time[i];
+    if(i == (int)Phase)
+      t += now_seconds() - Phase_started; /* Still going */
+    if(i == PHASE_COMPARE)
+      t -= Phase_time[PHASE_LINK] - Watch_link_time - Reference_link_time;
+    if(i == PHASE_WATCH)
+      t -= Watch_link_time;
+    if(i == PHASE_REFERENCE)
+      t -= Reference_link_time;
+    fprintf(fp,"%s\"%s\": %.6f",i > 0 ? ", " : " ",Phase_names[i],t);
+  }
+  fprintf(fp," },\n");
+  fprintf(fp,"  \"bytes_hashed\": %lld,\n",Bytes_hashed);
+  fprintf(fp,"  \"bytes_read\": %lld,\n",Bytes_hashed + Stream_bytes);
+  fprintf(fp,"  \"read_bytes_per_second\": %.0f,\n",elapsed > 0 ? (Bytes_hashed + Stream_bytes) / elapsed : 0.0);
+  fprintf(fp,"  \"first_page_hashes\": %lld,\n",Block_hashes_computed);
+  fprintf(fp,"  \"small_files_read_whole\": %lld,\n",Small_files);
+  fprintf(fp,"  \"sample_hashes\": [%lld, %lld],\n",Sample_hashes[0],Sample_hashes[1]);
+  fprintf(fp,"  \"full_hashes\": %lld,\n",Full_hashes_computed);
+  fprintf(fp,"  \"tree_hashes\": %lld,\n",Tree_hashes);
+  fprintf(fp,"  \"cache_hits\": %lld,\n",Cache_hits);
+  fprintf(fp,"  \"lockstep_compares\": %lld,\n",Stream_compares);
+  fprintf(fp,"  \"lockstep_bytes\": %lld,\n",Stream_bytes);
+  fprintf(fp,"  \"unlinks\": %lld,\n",Unlinks);
+  fprintf(fp,"  \"deduped_files\": %lld,\n",Dedupe_files);
+  fprintf(fp,"  \"blocks_reclaimed\": %lld,\n",Blocks_reclaimed);
+  fprintf(fp,"  \"chunk_shared_bytes\": %lld,\n",Chunk_shared_bytes);
+  fprintf(fp,"  \"budget_spent\": %s,\n",Budget_spent ? "true" : "false");
+  fprintf(fp,"  \"groups_skipped\": %lld,\n",Engine.stats.groups_skipped);
+  fprintf(fp,"  \"reference_matches\": %lld,\n",Reference_matches);
+  fprintf(fp,"  \"reference_stale\": %lld,\n",Reference_stale);
+  fprintf(fp,"  \"watched_directories\": %lld,\n",Watch_ndirs);
+  fprintf(fp,"  \"watched_files_checked\": %lld,\n",Watch_files);
+  fprintf(fp,"  \"background_cached_bytes\": %lld,\n",Background_cached);
+  fprintf(fp,"  \"throttle_wait_seconds\": %.3f,\n",Throttle_wait);
+  fprintf(fp,"  \"pressure_wait_seconds\": %.3f,\n",Pressure_wait);
+  fprintf(fp,"  \"pressure_backoffs\": %lld,\n",Pressure_backoffs);
+  fprintf(fp,"  \"latency_histograms\": {\n");
+  fprintf(fp,"    \"bucket_limits_us\": \"1, 2, 4, ... 2^%d, more\",\n",HIST_BUCKETS-2);
+  hist_write(fp,"open",&Open_latency);
+  fprintf(fp,",\n");
+  hist_write(fp,"hash",&Hash_latency);
+  fprintf(fp,",\n");
+  hist_write(fp,"link",&Link_latency);
+  fprintf(fp,"\n  },\n");
+  fprintf(fp,"  \"peak_rss_kb\": %ld,\n",ru.ru_maxrss);
+  fprintf(fp,"  \"user_seconds\": %.6f,\n",ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6);
+  fprintf(fp,"  \"system_seconds\": %.6f,\n",ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+  fprintf(fp,"  \"major_faults\": %ld,\n",ru.ru_majflt);
+  fprintf(fp,"  \"voluntary_switches\": %ld,\n",ru.ru_nvcsw);
+  fprintf(fp,"  \"involuntary_switches\": %ld",ru.ru_nivcsw);
+  /* rchar, wchar, syscr, syscw, read_bytes, write_bytes, cancelled_write_bytes */
+  if((io = fopen("/proc/self/io","r")) != NULL){
+    while(fgets(line,sizeof(line),io) != NULL){
+      if(sscanf(line,"%63[a-z_]: %llu",name,&value) == 2)
+	fprintf(fp,",\n  \"io_%s\": %llu",name,value);
+    }
+    fclose(io);
+  }
+  fprintf(fp,"\n}\n");
+  if(fp == stdout || fp == stderr)
+    fflush(fp);
+  else if(fclose(fp) != 0)
+    fprintf(stderr,"%s: can't write %s: %d %s\n",Myname,path,errno,strerror(errno));
+}
+
+/* One line on how the current phase is going */
+static void progress_line(double *last,long long *lastbytes){
+  double t = now_seconds(),rate,eta;
+  long long done = Progress_done,total = Progress_total,bytes = Bytes_hashed + Stream_bytes;
+
+  fprintf(stderr,"%s: %s",Myname,Phase < NPHASES ? Phase_names[Phase] : "done");
+  if(Phase == PHASE_WALK)
+    fprintf(stderr,": %u files, %u directories",Total_files,Directory);
+  if(total > 0){
+    fprintf(stderr," %.1f%%: %.1f of %.1f MB",100.0 * done / total,done / 1e6,total / 1e6);
+    rate = done / (t - Phase_started);
+    if(done > 0 && rate > 0){
+      eta = (total - done) / rate;
+      fprintf(stderr,", ETA %d:%02d:%02d",(int)eta / 3600,(int)eta / 60 % 60,(int)eta % 60);
+    }
+  }
+  fprintf(stderr,"; read %.1f MB/s\n",(bytes - *lastbytes) / 1e6 / (t - *last));
+  *last = t;
+  *lastbytes = bytes;
+}
+
+static void report_signal(int sig){
+  Report_requested = 1;
+}
+
+static void *monitor(void *arg){
+  double last = now_seconds(),lastline = last;
+  long long lastbytes = 0;
+  struct timespec second = {1,0};
+
+  for(;;){
+    nanosleep(&second,NULL);
+    if(Background_flag)
+      pressure_check();
+    if(Report_requested){
+      Report_requested = 0;
+      report_write(Report_file);
+    }
+    if(Progress_interval > 0 && now_seconds() - lastline >= Progress_interval){
+      lastline = now_seconds();
+      progress_line(&last,&lastbytes);
+    }
+  }
+  return NULL;
+}
+
+/* Catch SIGUSR1 and start the monitor thread */
+void monitor_start(void){
+  struct sigaction sa;
+  pthread_t tid;
+
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler = report_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1,&sa,NULL);
+  if(pthread_create(&tid,NULL,monitor,NULL) != 0){
+    fprintf(stderr,"%s: can't create monitor thread: %d %s\n",Myname,errno,strerror(errno));
+    return;
+  }
+  pthread_detach(tid);
+}
@@ -0,0 +1,235 @@
+/* Content-defined chunking, as used by dupmerge
+ *
+ * The gear hash h = (h << 1) + Gear[byte] forgets a byte after 64 shifts, so its value at any position
+ * is a function of the 64 bytes ending there. That makes every position independent: instead of one
+ * long chain of dependent shifts and adds, the buffer is cut into LANES segments that are hashed side
+ * by side, each starting 63 bytes early to fill its window. The eight lanes are the elements of an
+ * AVX-512 vector and the table lookups are gathers. Every position that passes the loose mask is a
+ * candidate; picking the cut points from the candidates is then cheap.
+ *
+ * Without AVX-512, or if a buffer has too many candidates to keep (long runs of data that happen to hit
+ * the mask), the cuts are found by the classic FastCDC loop, which skips the first min bytes of each
+ * chunk; in scalar code that beats hashing every position. Both give the same cut points.
+ *
+ * May be used under the terms of the GNU General Public License v 2.0
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include "fastcdc.h"
+
+#define LANES 8
+#define WINDOW 64		/* Bytes in the hash, one per bit */
+#define STRICT 0x80000000U	/* Candidate also passes the strict mask */
+#define CAND_MIN 16		/* Room for candidates per lane, beyond one per CAND_SPACING bytes */
+#define CAND_SPACING 256	/* About 64 times the expected density with the smallest masks */
+
+static uint64_t Gear[256];
+
+/* Fixed pseudo-random table, so cut points are the same from run to run and machine to machine */
+static void gear_init(void){
+  uint64_t s = 0x6a09e667f3bcc908ULL,z;
+  int i;
+
+  for(i=0;i<256;i++){
+    z = (s += 0x9e3779b97f4a7c15ULL); /* splitmix64 */
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    Gear[i] = z ^ (z >> 31);
+  }
+}
+
+/* Not thread safe the first time: call it before starting any threads */
+void fastcdc_init(fastcdc *c,size_t avg){
+  int bits;
+
+  if(Gear[0] == 0)
+    gear_init();
+  fastcdc_implementation(); /* Pick the kernel now */
+  for(bits=8;((size_t)1 << bits) < avg;bits++)
+    ;
+  c->normal = (size_t)1 << bits;
+  c->min = c->normal / 4;	/* Never less than WINDOW */
+  c->max = c->normal * 4;
+  /* Normalization level 2: 4 times less likely to cut before the normal size, 4 times more likely after */
+  c->mask_s = ~0ULL << (64 - (bits + 2));
+  c->mask_l = ~0ULL << (64 - (bits - 2));
+  c->cand = NULL;
+  c->cand_size = 0;
+}
+
+void fastcdc_free(fastcdc *c){
+  free(c->cand);
+  c->cand = NULL;
+  c->cand_size = 0;
+}
+
+/* Classic FastCDC: length of the chunk at the start of p, with n bytes available */
+static size_t cut_scalar(const fastcdc *c,const uint8_t *p,size_t n){
+  uint64_t h = 0;
+  size_t i,normal,max;
+
+  if(n <= c->min)
+    return n;
+  normal = n < c->normal ? n : c->normal;
+  max = n < c->max ? n : c->max;
+  for(i = c->min - WINDOW; i < c->min - 1; i++)
+    h = (h << 1) + Gear[p[i]];
+  for(; i < normal; i++){
+    h = (h << 1) + Gear[p[i]];
+    if((h & c->mask_s) == 0)
+      return i + 1;
+  }
+  for(; i < max; i++){
+    h = (h << 1) + Gear[p[i]];
+    if((h & c->mask_l) == 0)
+      return i + 1;
+  }
+  return max;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX512 1
+
+/* Hash seg positions of each lane, lane l starting at from + l * seg with hash h[l], and append the
+ * positions that pass the loose mask to out[l]; returns -1 if any lane's list fills up.
+ * One lane per 64-bit vector element: each lane's next 8 bytes come in with one gather, and the table
+ * lookups for a position in all lanes with another. seg must be a multiple of 8
+ */
+__attribute__((target("avx512f")))
+static int lanes_avx512(const fastcdc *c,const uint8_t *buf,size_t from,size_t seg,uint64_t h[LANES],
+			uint32_t *out[LANES],uint32_t *end[LANES]){
+  const __m512i offsets = _mm512_set_epi64(7*seg,6*seg,5*seg,4*seg,3*seg,2*seg,seg,0);
+  const __m512i bytemask = _mm512_set1_epi64(0xff);
+  const __m512i below = _mm512_set1_epi64(~c->mask_l);
+  __m512i hv = _mm512_loadu_si512(h),bytes,g;
+  uint64_t hs[LANES];
+  __mmask8 hits;
+  size_t t;
+  int b,l;
+
+  for(t=0;t<seg;t+=8){
+    bytes = _mm512_i64gather_epi64(offsets,(const void *)(buf + from + t),1);
+    for(b=0;b<8;b++){
+      g = _mm512_i64gather_epi64(_mm512_and_si512(_mm512_srli_epi64(bytes,8*b),bytemask),(const void *)Gear,8);
+      hv = _mm512_add_epi64(_mm512_slli_epi64(hv,1),g);
+      hits = _mm512_cmple_epu64_mask(hv,below);
+      if(__builtin_expect(hits != 0,0)){
+	_mm512_storeu_si512(hs,hv);
+	for(l=0;l<LANES;l++){
+	  if(hits & (1 << l)){
+	    if(out[l] == end[l])
+	      return -1;
+	    *out[l]++ = (uint32_t)(from + l * seg + t + b) | ((hs[l] & c->mask_s) == 0 ? STRICT : 0);
+	  }
+	}
+      }
+    }
+  }
+  _mm512_storeu_si512(h,hv);
+  return 0;
+}
+#endif
+
+static int Use_avx512 = -1;
+
+const char *fastcdc_implementation(void){
+  if(Use_avx512 == -1){
+#ifdef HAVE_AVX512
+    __builtin_cpu_init();
+    Use_avx512 = __builtin_cpu_supports("avx512f") != 0;
+#else
+    Use_avx512 = 0;
+#endif
+  }
+  return Use_avx512 ? "avx512" : "generic";
+}
+
+#ifdef HAVE_AVX512
+/* Store the positions in [from,len) whose window hash passes the loose mask, in order, in c->cand.
+ * Returns how many, or -1 if there were too many
+ */
+static long find_candidates(fastcdc *c,const uint8_t *buf,size_t from,size_t len){
+  uint64_t h[LANES];
+  uint32_t *out[LANES],*end[LANES];
+  size_t seg,cap,i,pos;
+  long n;
+  int l;
+
+  seg = ((len - from) / LANES) & ~(size_t)7;
+  cap = seg / CAND_SPACING + CAND_MIN;
+  if(c->cand_size < LANES * cap){
+    free(c->cand);
+    c->cand_size = LANES * cap;
+    c->cand = (uint32_t *)malloc(c->cand_size * sizeof(*c->cand));
+    assert(c->cand != NULL);
+  }
+  for(l=0;l<LANES;l++){
+    size_t start = from + l * seg;
+
+    out[l] = c->cand + l * cap;
+    end[l] = out[l] + cap;
+    h[l] = 0;
+    for(i = start - (WINDOW - 1); i < start; i++)
+      h[l] = (h[l] << 1) + Gear[buf[i]];
+  }
+  if(lanes_avx512(c,buf,from,seg,h,out,end) < 0)
+    return -1;
+  /* Close up the lanes' lists, then do what's left over after the last lane */
+  n = out[0] - c->cand;
+  for(l=1;l<LANES;l++){
+    size_t k = out[l] - (c->cand + l * cap);
+
+    for(i=0;i<k;i++)
+      c->cand[n++] = c->cand[l * cap + i];
+  }
+  for(pos = from + LANES * seg; pos < len; pos++){
+    h[LANES-1] = (h[LANES-1] << 1) + Gear[buf[pos]];
+    if((h[LANES-1] & c->mask_l) == 0){
+      if((size_t)n == c->cand_size)
+	return -1;
+      c->cand[n++] = (uint32_t)pos | ((h[LANES-1] & c->mask_s) == 0 ? STRICT : 0);
+    }
+  }
+  return n;
+}
+#endif
+
+size_t fastcdc_split(fastcdc *c,const uint8_t *buf,size_t len,int eof,uint32_t *lens,size_t nlens){
+  size_t start,avail,cut,pos,n = 0;
+  long ncand,k = 0;
+
+  assert(len < STRICT);
+#ifdef HAVE_AVX512
+  ncand = !Use_avx512 ? -1 : len >= c->min ? find_candidates(c,buf,c->min - 1,len) : 0;
+#else
+  ncand = -1;
+#endif
+  for(start = 0; n < nlens && start < len; start += cut){
+    avail = len - start;
+    if(!eof && avail < c->max)
+      break;
+    if(ncand < 0){
+      cut = cut_scalar(c,buf + start,avail);
+    } else {
+      /* First strict candidate before the normal size, else first loose one before the maximum */
+      cut = avail < c->max ? avail : c->max;
+      while(k < ncand && (c->cand[k] & ~STRICT) < start + c->min - 1)
+	k++;
+      for(; k < ncand; k++){
+	pos = (c->cand[k] & ~STRICT) - start + 1;
+	if(pos > cut)
+	  break;
+	if(pos > c->normal || (c->cand[k] & STRICT)){
+	  cut = pos;
+	  k++;
+	  break;
+	}
+      }
+      if(avail <= c->min)
+	cut = avail;
+    }
+    lens[n++] = cut;
+  }
+  return n;
+}
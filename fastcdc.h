@@ -0,0 +1,36 @@
+/* Content-defined chunking for dupmerge, after FastCDC (Xia et al., USENIX ATC 2016)
+ *
+ * A gear hash over the last 64 bytes picks the cut points, with normalized chunking: a stricter mask
+ * before the normal size and a looser one after it, so chunk sizes cluster around the average.
+ * The hash depends only on the window, not on where the chunk started, so it is computed for every
+ * position of a buffer in several independent lanes at once; see fastcdc.c
+ *
+ * May be used under the terms of the GNU General Public License v 2.0
+ */
+#ifndef _FASTCDC_H
+#define _FASTCDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  size_t min,normal,max;	/* Chunk sizes: smallest, where the mask loosens, largest */
+  uint64_t mask_s,mask_l;	/* Cut where (hash & mask) == 0 */
+  uint32_t *cand;		/* Scratch: candidate cut points */
+  size_t cand_size;
+} fastcdc;
+
+/* Set up for chunks averaging about avg bytes (rounded to a power of 2, at least 256) */
+void fastcdc_init(fastcdc *c,size_t avg);
+void fastcdc_free(fastcdc *c);
+
+/* Split buf[0..len) into chunks, storing their lengths in lens[], at most nlens of them; returns how many.
+ * Unless eof is set, stops while fewer than c->max bytes remain, as more data could move the last cut;
+ * the caller then carries the rest over to the next call. len must be under 2 GB
+ */
+size_t fastcdc_split(fastcdc *c,const uint8_t *buf,size_t len,int eof,uint32_t *lens,size_t nlens);
+
+/* Name of the hashing kernel chosen for this CPU */
+const char *fastcdc_implementation(void);
+
+#endif
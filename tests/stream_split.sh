@@ -0,0 +1,29 @@
+#!/bin/sh
+# Regression test for the lockstep comparison (stream_classify()): six 2 MB files with the same first page, split
+# into different classes at two different places, must not be linked across classes.
+# Usage: tests/stream_split.sh [dupmerge binary]; exits 0 if the files are grouped correctly
+DUPMERGE=${1:-./dupmerge}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/dupmerge-test.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+# Byte 10000 is X X X X Y Y and byte 100000 is U U V V V V, so the classes are {Q1,Q2} {R1,R2} {S1,S2}
+mkfile(){ # name byte-at-10000 byte-at-100000
+  head -c 2097152 /dev/zero | tr '\0' 'a' > "$DIR/base"
+  printf %s "$2" | dd of="$DIR/base" bs=1 seek=10000 conv=notrunc 2>/dev/null
+  printf %s "$3" | dd of="$DIR/base" bs=1 seek=100000 conv=notrunc 2>/dev/null
+  mv "$DIR/base" "$DIR/sc/$1"
+}
+mkdir "$DIR/sc"
+mkfile Q1 X U; mkfile Q2 X U; mkfile R1 X V; mkfile R2 X V; mkfile S1 Y V; mkfile S2 Y V
+touch -d '2020-01-01' "$DIR/sc/Q1"
+SUMS=$(cd "$DIR/sc" && md5sum Q1 Q2 R1 R2 S1 S2)
+
+(cd "$DIR" && "$DUPMERGE" -q sc) || { echo "FAIL: dupmerge exited with $?"; exit 1; }
+cd "$DIR/sc"
+[ "$(md5sum Q1 Q2 R1 R2 S1 S2)" = "$SUMS" ] || { echo "FAIL: contents changed"; exit 1; }
+for pair in "Q1 Q2" "R1 R2" "S1 S2"; do
+  set -- $pair
+  [ "$(stat -c %i "$1")" = "$(stat -c %i "$2")" ] || { echo "FAIL: $1 and $2 not linked"; exit 1; }
+done
+[ "$(stat -c %i Q1 R1 S1 | sort -u | wc -l)" -eq 3 ] || { echo "FAIL: different files linked"; exit 1; }
+echo "PASS"